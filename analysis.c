@@ -0,0 +1,338 @@
+#include <stdlib.h>
+#include <string.h>
+#include "analysis.h"
+#include "bits.h"
+#include "instruction.h"
+#include "trap.h"
+
+// The registers at an instruction: which hold a value known on every
+// path there, and the values
+typedef struct {
+    bool reached;
+    uint8_t known;
+    uint16_t value[8];
+} state_t;
+
+typedef struct {
+    const uint16_t* memory;
+    state_t* states;
+    uint16_t* queue;        // addresses whose state changed
+    uint32_t queued;
+    uint8_t* waiting;       // whether an address is in the queue
+    bool exact;             // every jump and call was resolved, so no
+                            // path reaches code with other values
+} walk_t;
+
+static bool is_known(const state_t* s, int reg) {
+    return s->known & (1 << reg);
+}
+
+static void set(state_t* s, int reg, uint16_t value) {
+    s->known |= 1 << reg;
+    s->value[reg] = value;
+}
+
+static void forget(state_t* s, int reg) {
+    s->known &= ~(1 << reg);
+}
+
+// Merge a state into the one at an address and queue the address if
+// that taught it anything new. Device registers are never analyzed.
+static void flow(walk_t* w, uint16_t address, const state_t* s) {
+    if (address >= MMIO_BASE) {
+        return;
+    }
+    state_t* to = &w->states[address];
+    if (!to->reached) {
+        *to = *s;
+        to->reached = true;
+    } else {
+        uint8_t known = to->known & s->known;
+        for (int i = 0; i < 8; i++) {
+            if ((known & (1 << i)) && to->value[i] != s->value[i]) {
+                known &= ~(1 << i);
+            }
+        }
+        if (known == to->known) {
+            return;
+        }
+        to->known = known;
+    }
+    if (!w->waiting[address]) {
+        w->waiting[address] = 1;
+        w->queue[w->queued++] = address;
+    }
+}
+
+// Follow an instruction to the instructions after it
+static void step(walk_t* w, uint16_t pc) {
+    uint16_t word = w->memory[pc];
+    uint16_t next = pc + 1;
+    state_t s = w->states[pc];
+    int dr = getbits(word, 9, 3);
+    int sr = getbits(word, 6, 3);
+    int sr2 = getbits(word, 0, 3);
+    uint16_t imm5 = sign_extend(getbits(word, 0, 5), 5);
+    uint16_t offset9 = sign_extend(getbits(word, 0, 9), 9);
+    int nzp = getbits(word, 9, 3);
+    state_t unknown = { .reached = true };
+
+    switch (getopcode(word)) {
+    case OP_ADD:
+    case OP_AND:
+        if (getopcode(word) == OP_AND && getimmediate(word) == 1
+            && imm5 == 0) {
+            set(&s, dr, 0);
+        } else if (!is_known(&s, sr)
+                   || (getimmediate(word) == 0 && !is_known(&s, sr2))) {
+            forget(&s, dr);
+        } else {
+            uint16_t b = getimmediate(word) == 1 ? imm5 : s.value[sr2];
+            set(&s, dr, getopcode(word) == OP_ADD ? s.value[sr] + b
+                                                  : s.value[sr] & b);
+        }
+        flow(w, next, &s);
+        break;
+
+    case OP_NOT:
+        if (is_known(&s, sr)) {
+            set(&s, dr, ~s.value[sr]);
+        } else {
+            forget(&s, dr);
+        }
+        flow(w, next, &s);
+        break;
+
+    case OP_LEA:
+        set(&s, dr, next + offset9);
+        flow(w, next, &s);
+        break;
+
+    case OP_LD:
+    case OP_LDI:
+    case OP_LDR:
+        // Memory may change, so loaded values are never known
+        forget(&s, dr);
+        flow(w, next, &s);
+        break;
+
+    case OP_ST:
+    case OP_STI:
+    case OP_STR:
+        flow(w, next, &s);
+        break;
+
+    case OP_CAS:
+        // Other encodings leave through the vector table
+        if (getbits(word, 3, 3) == 0) {
+            forget(&s, dr);
+            flow(w, next, &s);
+        }
+        break;
+
+    case OP_BR:
+        if (nzp != 0) {
+            flow(w, next + offset9, &s);
+        }
+        if (nzp != (FL_NEG | FL_ZRO | FL_POS)) {
+            flow(w, next, &s);
+        }
+        break;
+
+    case OP_JMP:
+        // A jump through R7 that is not known returns to a caller, which
+        // the call already flows to
+        if (is_known(&s, sr)) {
+            flow(w, s.value[sr], &s);
+        }
+        break;
+
+    case OP_JSR:
+        // The callee starts with what the caller knew, and the caller
+        // goes on knowing nothing
+        // R7 is set before the base register is read
+        set(&s, R_R7, next);
+        if (getbit(word, 11) == 1) {
+            flow(w, next + sign_extend(getbits(word, 0, 11), 11), &s);
+        } else if (is_known(&s, sr)) {
+            flow(w, s.value[sr], &s);
+        }
+        flow(w, next, &unknown);
+        break;
+
+    case OP_TRAP:
+        if (getbits(word, 0, 8) != TRAP_HALT) {
+            forget(&s, R_R0);
+            forget(&s, R_R7);
+            flow(w, next, &s);
+        }
+        break;
+
+    default:
+        // RTI leaves through the vector table
+        break;
+    }
+}
+
+// The target of a store from the final state, or -1 if it is not known
+static long store_target(const walk_t* w, uint16_t pc,
+                         const uint8_t* written, bool any_unknown) {
+    uint16_t word = w->memory[pc];
+    const state_t* s = &w->states[pc];
+    uint16_t next = pc + 1;
+    uint16_t pointer;
+    int base = getbits(word, 6, 3);
+
+    switch (getopcode(word)) {
+    case OP_ST:
+        return (uint16_t) (next + sign_extend(getbits(word, 0, 9), 9));
+    case OP_STR:
+        if (!w->exact || !is_known(s, base)) {
+            return -1;
+        }
+        return (uint16_t) (s->value[base]
+                           + sign_extend(getbits(word, 0, 6), 6));
+    case OP_CAS:
+        if (!w->exact || !is_known(s, base)) {
+            return -1;
+        }
+        return s->value[base];
+    case OP_STI:
+        // The pointer is the word in memory now, if no store can change it
+        pointer = next + sign_extend(getbits(word, 0, 9), 9);
+        if (written == NULL || any_unknown || written[pointer]) {
+            return -1;
+        }
+        return w->memory[pointer];
+    default:
+        return -1;
+    }
+}
+
+// Classify the store at pc by its target
+static void classify(analysis_t* analysis, uint16_t pc, long target) {
+    if (target < 0) {
+        analysis->flags[pc] |= ANALYSIS_STORE_ANY;
+        analysis->unknown_stores++;
+    } else if (analysis->flags[target] & ANALYSIS_CODE) {
+        analysis->flags[pc] |= ANALYSIS_STORE_CODE;
+        analysis->code_stores++;
+    } else {
+        analysis->flags[pc] |= ANALYSIS_STORE_DATA;
+        analysis->data_stores++;
+    }
+}
+
+// Analyze the memory of a machine
+void analysis_run(analysis_t* analysis, x16_t* machine) {
+    memset(analysis, 0, sizeof(analysis_t));
+    walk_t w;
+    w.memory = x16_memory(machine, 0);
+    w.states = (state_t*) calloc(MAX_MEMORY, sizeof(state_t));
+    w.queue = (uint16_t*) malloc(MAX_MEMORY * sizeof(uint16_t));
+    w.waiting = (uint8_t*) calloc(MAX_MEMORY, 1);
+    w.queued = 0;
+    w.exact = false;
+
+    // Nothing is known about the registers where the programs start
+    const uint16_t vectors[] = {
+        VECTOR_PRIVILEGE, VECTOR_ILLEGAL, VECTOR_KEYBOARD,
+    };
+    state_t unknown = { .reached = true };
+    flow(&w, x16_pc(machine), &unknown);
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        uint16_t handler = w.memory[VECTOR_TABLE + vectors[i]];
+        if (handler != 0) {
+            flow(&w, handler, &unknown);
+        }
+    }
+    analysis->entries = w.queued;
+
+    // Go round until no state changes. Values only ever become unknown,
+    // so this ends.
+    while (w.queued > 0) {
+        uint16_t pc = w.queue[--w.queued];
+        w.waiting[pc] = 0;
+        step(&w, pc);
+    }
+
+    for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+        if (!w.states[pc].reached) {
+            continue;
+        }
+        analysis->flags[pc] |= ANALYSIS_CODE;
+        analysis->code_words++;
+        uint16_t word = w.memory[pc];
+        int base = getbits(word, 6, 3);
+        opcode_t op = getopcode(word);
+        if ((op == OP_JMP || (op == OP_JSR && getbit(word, 11) == 0))
+            && base != R_R7) {
+            analysis->unresolved += !is_known(&w.states[pc], base);
+        }
+    }
+
+    w.exact = analysis->unresolved == 0;
+
+    // Direct stores first, so that an indirect store can tell whether
+    // anything writes its pointer
+    uint8_t* written = (uint8_t*) calloc(MAX_MEMORY, 1);
+    for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+        opcode_t op = getopcode(w.memory[pc]);
+        if (!w.states[pc].reached
+            || (op != OP_ST && op != OP_STR && op != OP_CAS)) {
+            continue;
+        }
+        long target = store_target(&w, pc, NULL, false);
+        if (target >= 0) {
+            written[target] = 1;
+        }
+        classify(analysis, pc, target);
+    }
+    bool any_unknown = analysis->unknown_stores > 0;
+    long* targets = (long*) malloc(MAX_MEMORY * sizeof(long));
+    for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+        targets[pc] = -1;
+        if (w.states[pc].reached && getopcode(w.memory[pc]) == OP_STI) {
+            targets[pc] = store_target(&w, pc, written, any_unknown);
+            if (targets[pc] >= 0) {
+                written[targets[pc]] = 1;
+            }
+        }
+    }
+    for (uint32_t pc = 0; pc < MAX_MEMORY; pc++) {
+        if (w.states[pc].reached && getopcode(w.memory[pc]) == OP_STI) {
+            // Another indirect store may write the pointer after all
+            uint16_t pointer = pc + 1
+                + sign_extend(getbits(w.memory[pc], 0, 9), 9);
+            classify(analysis, pc, written[pointer] ? -1 : targets[pc]);
+        }
+    }
+
+    free(targets);
+    free(written);
+    free(w.states);
+    free(w.queue);
+    free(w.waiting);
+}
+
+// True unless every store reached is known to leave code alone
+bool analysis_modifies_code(const analysis_t* analysis) {
+    return analysis->code_stores > 0 || analysis->unknown_stores > 0;
+}
+
+// Write what the analysis found
+void analysis_write_report(const analysis_t* analysis, FILE* fp) {
+    fprintf(fp, "Entries: %d\n", analysis->entries);
+    fprintf(fp, "Code words: %u\n", analysis->code_words);
+    fprintf(fp, "Stores: %u to data, %u to code, %u to unknown targets\n",
+            analysis->data_stores, analysis->code_stores,
+            analysis->unknown_stores);
+    fprintf(fp, "Unresolved jumps and calls: %u\n", analysis->unresolved);
+    if (analysis_modifies_code(analysis)) {
+        fprintf(fp, "The programs may modify their code\n");
+    } else if (analysis->unresolved > 0) {
+        fprintf(fp, "The code that was found is never modified\n");
+    } else {
+        fprintf(fp, "The programs never modify their code\n");
+    }
+}
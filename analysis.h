@@ -0,0 +1,53 @@
+#ifndef ANALYSIS_H_
+#define ANALYSIS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "x16.h"
+
+// Static analysis of the programs loaded into a machine, for the fast
+// engine. Starting at the PC and the handlers in the vector table, it
+// follows control flow, tracking which registers hold known values, to
+// find the words that may run as code. Then it classifies every store it
+// reached by whether its target may be one of those words.
+//
+// A jump through R7 whose value is not known is taken to return to just
+// after a call. Register values only place stores when every other jump
+// and call was resolved.
+//
+// A store whose target is known and is not code never has to invalidate
+// decoded instructions. When no store may write code the programs never
+// modify themselves, as far as the code that was found goes; jumps
+// through registers that are not known may lead to more.
+
+// What the analysis found out about a word
+enum {
+    ANALYSIS_CODE = 1 << 0,         // control flow may reach it
+    ANALYSIS_STORE_DATA = 1 << 1,   // a store that never writes code
+    ANALYSIS_STORE_CODE = 1 << 2,   // a store that writes a code word
+    ANALYSIS_STORE_ANY = 1 << 3,    // a store whose target is not known
+};
+
+typedef struct {
+    uint8_t flags[MAX_MEMORY];      // ANALYSIS_ flags of each word
+    int entries;                    // where the analysis started
+    uint32_t code_words;
+    uint32_t data_stores;
+    uint32_t code_stores;
+    uint32_t unknown_stores;
+    uint32_t unresolved;            // jumps and calls through registers
+                                    // that are not known, except returns
+} analysis_t;
+
+// Analyze the memory of a machine, starting at its PC and the handlers in
+// its vector table
+void analysis_run(analysis_t* analysis, x16_t* machine);
+
+// True unless every store reached is known to leave code alone
+bool analysis_modifies_code(const analysis_t* analysis);
+
+// Write what the analysis found, for x16 -A
+void analysis_write_report(const analysis_t* analysis, FILE* fp);
+
+#endif  // ANALYSIS_H_
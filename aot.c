@@ -0,0 +1,73 @@
+#include <signal.h>
+#include "aot.h"
+#include "control.h"
+#include "io.h"
+#include "loader.h"
+
+// Interpret at least one instruction, then on until native code can take
+// over again. Writes are journaled to see whether any hit translated
+// code. Return -1 for HALT or 0 to go on.
+static int interpret(x16_t* machine, const aot_program_t* program,
+                     x16_journal_t* journal, bool* modified) {
+    int rv;
+    x16_set_journal(machine, journal);
+    do {
+        journal->count = 0;
+        rv = execute_instruction(machine);
+        for (size_t i = 0; i < journal->count; i++) {
+            if (aot_translated(program, journal->entries[i].address)) {
+                *modified = true;
+            }
+        }
+    } while (rv == 0
+             && (*modified || !aot_translated(program, x16_pc(machine))));
+    x16_set_journal(machine, NULL);
+    return rv;
+}
+
+// Run native code where there is some and interpret the rest
+static int run(x16_t* machine, const aot_program_t* program) {
+    x16_journal_t journal = {0};
+    bool modified = false;
+    int rv = 0;
+    while (rv == 0) {
+        if (modified || !aot_translated(program, x16_pc(machine))) {
+            rv = interpret(machine, program, &journal, &modified);
+            continue;
+        }
+        switch (program->native(machine)) {
+        case -1:
+            rv = -1;
+            break;
+        case AOT_POLL:
+            x16_interrupt(machine, false);
+            break;
+        case AOT_IDLE:
+            x16_interrupt(machine, true);
+            break;
+        case AOT_MODIFIED:
+            modified = true;
+            break;
+        default:
+            rv = interpret(machine, program, &journal, &modified);
+            break;
+        }
+    }
+    x16_journal_free(&journal);
+    return rv;
+}
+
+// Run a translated program on the terminal
+int aot_main(const aot_program_t* program) {
+    x16_t* machine = x16_create();
+    loader_load(machine, program->image);
+
+    // Set up signal handler to clean up TTY state on SIGINT
+    signal(SIGINT, handle_interrupt);
+    disable_input_buffering();
+    run(machine, program);
+    restore_input_buffering();
+
+    x16_free(machine);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef AOT_H_
+#define AOT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "image.h"
+#include "instruction.h"
+#include "x16.h"
+
+// Runtime of programs translated ahead of time by x16c. The translation
+// holds the image and a native function with a label for every word the
+// analysis found as code. The runtime loads the image, runs the native
+// code and falls back to the interpreter in control.c where the native
+// code cannot go on: a jump to a word that was not translated, an
+// instruction it does not model, an interrupt to take, or a store that
+// rewrote translated code. The interpreter hands back to native code as
+// soon as the PC is on a translated word again, unless translated code
+// was modified, which makes it run the rest of the program.
+
+// Why native code returned, besides -1 for HALT. The PC of the machine
+// says where to go on.
+enum {
+    AOT_LEAVE = 1,          // interpret the instruction at the PC
+    AOT_POLL,               // a branch ended with interrupts enabled
+    AOT_IDLE,               // as AOT_POLL, for a branch to itself
+    AOT_MODIFIED,           // a store wrote a translated word
+};
+
+typedef struct {
+    const image_t* image;
+    const uint8_t* translated;          // a bit per translated address
+    int (*native)(x16_t* machine);      // runs from the PC of the machine
+} aot_program_t;
+
+// True if the address has native code
+static inline bool aot_translated(const aot_program_t* program,
+                                  uint16_t address) {
+    return program->translated[address >> 3] & (1 << (address & 7));
+}
+
+// Run a translated program on the terminal, like x16 runs its image.
+// Return 0 once it halts.
+int aot_main(const aot_program_t* program);
+
+// Helpers for the native code, which keeps the machine in m, its memory
+// in mem and its page map in pages
+
+// Read memory, through x16_memread for pages with flags set
+#define AOT_LOAD(address) \
+    (pages[(uint16_t) (address) >> PAGE_SHIFT] != 0 \
+        ? x16_memread(m, (address)) : mem[(uint16_t) (address)])
+
+// The condition codes of a result
+#define AOT_CC(result) \
+    ((result) == 0 ? FL_ZRO : ((result) & 0x8000) ? FL_NEG : FL_POS)
+
+#endif  // AOT_H_
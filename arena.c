@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+// Usual size of a block. Larger allocations get a block of their own.
+#define ARENA_BLOCK_SIZE    (64 * 1024)
+
+struct arena_block {
+    arena_block_t* next;
+    size_t used;
+    size_t size;
+    max_align_t data[];
+};
+
+// Round a size up to the alignment of every allocation
+static size_t align(size_t size) {
+    return (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+}
+
+// Allocate size bytes from the arena
+void* arena_alloc(arena_t* arena, size_t size) {
+    size = align(size);
+    arena_block_t* block = arena->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        size_t bytes = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (arena_block_t*) malloc(sizeof(arena_block_t) + bytes);
+        block->used = 0;
+        block->size = bytes;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    void* p = (char*) block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+// Resize an allocation
+void* arena_grow(arena_t* arena, void* p, size_t size, size_t new_size) {
+    arena_block_t* block = arena->blocks;
+    if (p != NULL && block != NULL
+        && (char*) p + align(size) == (char*) block->data + block->used
+        && (char*) p + align(new_size) <= (char*) block->data + block->size) {
+        block->used += align(new_size) - align(size);
+        return p;
+    }
+    void* q = arena_alloc(arena, new_size);
+    if (p != NULL) {
+        memcpy(q, p, size < new_size ? size : new_size);
+    }
+    return q;
+}
+
+// Copy a string into the arena
+char* arena_strndup(arena_t* arena, const char* str, size_t length) {
+    char* copy = (char*) arena_alloc(arena, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Free every allocation made from the arena
+void arena_free(arena_t* arena) {
+    while (arena->blocks != NULL) {
+        arena_block_t* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
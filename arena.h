@@ -0,0 +1,28 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+// A bump allocator. Allocations are never freed one by one; everything
+// goes away at once when the arena is freed.
+typedef struct arena_block arena_block_t;
+
+typedef struct {
+    arena_block_t* blocks;
+} arena_t;
+
+// Allocate size bytes, suitably aligned for any type
+void* arena_alloc(arena_t* arena, size_t size);
+
+// Resize an allocation, copying it unless it is the newest one in its
+// block and there is room to grow it in place. The old memory is only
+// given back when the arena is freed.
+void* arena_grow(arena_t* arena, void* p, size_t size, size_t new_size);
+
+// Copy a string of the given length into the arena, NUL terminated
+char* arena_strndup(arena_t* arena, const char* str, size_t length);
+
+// Free every allocation made from the arena
+void arena_free(arena_t* arena);
+
+#endif  // ARENA_H_
@@ -0,0 +1,2007 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include "assembler.h"
+#include "instruction.h"
+#include "lexer.h"
+#include "mnemonic.h"
+#include "peephole.h"
+#include "symtab.h"
+#include "x16.h"
+
+#define ORIGIN 0x3000
+
+// How deep macros may use macros and constants may use constants
+#define MAX_DEPTH 16
+
+// Stands for any number of label addresses in a value that is more than
+// a sum of them
+#define NONLINEAR 1000
+
+// The fields of a word that operands go in
+typedef enum
+{
+    FIELD_IMM5,
+    FIELD_OFFSET6,
+    FIELD_PC9,
+    FIELD_PC11,
+    FIELD_TRAP8,
+    FIELD_WORD
+} Field;
+
+static const struct
+{
+    const char *name;
+    int bits;
+    long min;
+    long max;
+    bool relative;      // holds the offset of an address from the next word
+} fields[] = {
+    [FIELD_IMM5] = {"imm5", 5, -16, 15, false},
+    [FIELD_OFFSET6] = {"offset6", 6, -32, 31, false},
+    [FIELD_PC9] = {"offset9", 9, -256, 255, true},
+    [FIELD_PC11] = {"offset11", 11, -1024, 1023, true},
+    [FIELD_TRAP8] = {"trap vector", 8, 0, 255, false},
+    [FIELD_WORD] = {"word", 16, INT16_MIN, UINT16_MAX, false},
+};
+
+// A macro, defined by .macro NAME PARAM, ... and the lines up to .endm
+typedef struct
+{
+    token_t *params;
+    int numParams;
+    const char *body;   // the lines in between, in the source
+    size_t size;
+    int line;           // where the body starts
+} Macro;
+
+// A use of a macro. The body, with the arguments put in, is read in
+// place of the source until it ends.
+typedef struct Expansion
+{
+    const char *name;
+    int line;                   // where the macro was used
+    int depth;                  // 1 for a use in the source itself
+    struct Expansion *caller;   // expansion the use is in, or NULL
+    lexer_t resume;             // where reading goes on afterwards
+} Expansion;
+
+// A place in the source to read from again
+typedef struct
+{
+    token_t token;      // the token there
+    lexer_t lexer;      // reading on after it
+    Expansion *expansion;
+} Position;
+
+// A use of a label before its definition, or of an expression with
+// labels in it. A label is patched into the word once it is defined. An
+// expression is evaluated again once all labels are known, and again
+// after optimizing moves them.
+typedef struct
+{
+    symbol_t *label;    // the label, or NULL for an expression
+    int index;          // word holding the field, 1 for the first
+    Field field;
+    int next;           // 1 + index of the previous use of the label
+    Position at;        // where the operand starts
+} Fixup;
+
+// The line of the source the words from index on come from
+typedef struct
+{
+    int index;
+    int line;
+} DebugLine;
+
+// Words .orig skipped over, which the image leaves out so that the words
+// on either side become separate segments
+typedef struct
+{
+    int index;          // of the first word skipped
+    int count;
+} Gap;
+
+// The value of an expression
+typedef struct
+{
+    long value;
+    int relative;       // net number of label addresses added in
+    bool known;         // no label in it is undefined yet
+    bool labels;        // it depends on labels
+} Value;
+
+// State of the assembler while it goes through the source once. All
+// memory comes from the arena, so files can be assembled on several
+// threads at once.
+typedef struct
+{
+    const char *fileName;
+    arena_t *arena;
+    FILE *diagnostics;
+    lexer_t lexer;
+    token_t token;      // the token being looked at
+    symtab_t *labels;   // labels and .equ constants
+    uint16_t origin;
+    uint16_t *code;     // origin then the words, in file byte order
+    uint8_t *flags;     // word_flag_t of each word, when optimizing
+    int count;          // words emitted
+    int capacity;
+    Fixup *fixups;
+    int numFixups;
+    int fixupCapacity;
+    Position *constants;    // expression of each .equ
+    int numConstants;
+    int constantCapacity;
+    symtab_t *macroNames;   // index of each macro in macros
+    Macro *macros;
+    int numMacros;
+    int macroCapacity;
+    Expansion *expansion;   // macro being read, or NULL for the source
+    int expansions;         // macros used so far, for \@
+    int depth;              // constants being evaluated
+    int line;               // line of the statement being assembled
+    DebugLine *lines;       // for the debug map
+    int numLines;
+    int lineCapacity;
+    Gap *gaps;
+    int numGaps;
+    int gapCapacity;
+    Position entry;     // expression of .entry
+    bool hasEntry;
+    bool relocatable;   // write an object for xld instead of an image
+    bool optimize;      // run the peephole optimizer
+    bool full;          // ran out of memory
+    bool debug;         // write a debug map next to the image
+    int errors;
+} Assembler;
+
+// Report an error at a position in the source
+static void error_at(Assembler *as, int line, int column, const char *format,
+                     ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(as->diagnostics, "%s:%d:%d: error: ", as->fileName, line, column);
+    vfprintf(as->diagnostics, format, args);
+    if (as->expansion)
+    {
+        fprintf(as->diagnostics, " (in macro '%s' used on line %d)",
+                as->expansion->name, as->expansion->line);
+    }
+    fprintf(as->diagnostics, "\n");
+    va_end(args);
+    as->errors++;
+}
+
+// Report an error at the current token
+static void error(Assembler *as, const char *what)
+{
+    token_t *token = &as->token;
+    if (token->kind == TOKEN_ERROR)
+    {
+        error_at(as, token->line, token->column, "%s", token->message);
+    }
+    else if (token->kind == TOKEN_NEWLINE || token->kind == TOKEN_END)
+    {
+        error_at(as, token->line, token->column, "%s at end of line", what);
+    }
+    else
+    {
+        error_at(as, token->line, token->column, "%s, found '%.*s'", what,
+                 token->length, token->text);
+    }
+}
+
+static void advance(Assembler *as)
+{
+    lexer_next(&as->lexer, &as->token);
+}
+
+// Look at the token after the current one
+static token_t peek(Assembler *as)
+{
+    lexer_t lexer = as->lexer;
+    token_t token;
+    lexer_next(&lexer, &token);
+    return token;
+}
+
+// Where the assembler is reading
+static Position position(Assembler *as)
+{
+    Position at = {as->token, as->lexer, as->expansion};
+    return at;
+}
+
+// Go to a position to read from there
+static void seek(Assembler *as, const Position *at)
+{
+    as->token = at->token;
+    as->lexer = at->lexer;
+    as->expansion = at->expansion;
+}
+
+// Skip to the start of the next line
+static void skip_line(Assembler *as)
+{
+    while (as->token.kind != TOKEN_NEWLINE && as->token.kind != TOKEN_END)
+    {
+        advance(as);
+    }
+    if (as->token.kind == TOKEN_NEWLINE)
+    {
+        advance(as);
+    }
+}
+
+// Operands are separated by blanks, commas or both
+static void separator(Assembler *as, bool first)
+{
+    if (!first && as->token.kind == TOKEN_COMMA)
+    {
+        advance(as);
+    }
+}
+
+static bool is_operator(const token_t *token, char c)
+{
+    return token->kind == TOKEN_OPERATOR && token->value == c;
+}
+
+// True if the token is the given name
+static bool is_named(const token_t *token, const char *name)
+{
+    return token->kind == TOKEN_NAME && strlen(name) == (size_t) token->length
+        && strncmp(name, token->text, token->length) == 0;
+}
+
+static bool parse_reg(Assembler *as, bool first, reg_t *reg)
+{
+    separator(as, first);
+    if (as->token.kind != TOKEN_REGISTER)
+    {
+        error(as, "expected a register");
+        return false;
+    }
+    *reg = (reg_t) as->token.value;
+    advance(as);
+    return true;
+}
+
+// Make room for one more element at the end of an array from the arena
+static void *grow(Assembler *as, void *array, int count, int *capacity,
+                  size_t size)
+{
+    if (count == *capacity)
+    {
+        int newCapacity = *capacity ? *capacity * 2 : 16;
+        array = arena_grow(as->arena, array, *capacity * size,
+                           newCapacity * size);
+        *capacity = newCapacity;
+    }
+    return array;
+}
+
+static bool parse_expression(Assembler *as, bool final, Value *value);
+
+// Evaluate the expression of a constant where it is used
+static bool parse_constant_value(Assembler *as, bool final, symbol_t *constant,
+                                 const token_t *use, Value *value)
+{
+    if (as->depth == MAX_DEPTH)
+    {
+        error_at(as, use->line, use->column,
+                 "constant '%s' refers to itself or nests too deeply",
+                 constant->name);
+        return false;
+    }
+    Position here = position(as);
+    seek(as, &as->constants[constant->expression - 1]);
+    as->depth++;
+    bool ok = parse_expression(as, final, value);
+    as->depth--;
+    seek(as, &here);
+    return ok;
+}
+
+// The value of the label or constant named by the current token. A label
+// not defined yet has an unknown value, which is an error once the whole
+// source has been read.
+static bool parse_symbol(Assembler *as, bool final, Value *value)
+{
+    token_t name = as->token;
+    symbol_t *symbol = symtab_find(as->labels, name.text, name.length);
+    advance(as);
+    if (symbol && symbol->expression)
+    {
+        return parse_constant_value(as, final, symbol, &name, value);
+    }
+
+    value->value = 0;
+    value->relative = 1;
+    value->known = symbol && symbol->defined;
+    value->labels = true;
+    if (value->known)
+    {
+        value->value = symbol->address;
+    }
+    else if (final && symbol && symbol->imported)
+    {
+        error_at(as, name.line, name.column,
+                 "external label '%s' can only be used alone", symbol->name);
+        return false;
+    }
+    else if (final)
+    {
+        error_at(as, name.line, name.column, "undefined label '%.*s'",
+                 name.length, name.text);
+        return false;
+    }
+    return true;
+}
+
+// Add label addresses counted in values that are summed
+static int add_relative(int a, int b)
+{
+    if (a == NONLINEAR || b == NONLINEAR || a + b >= NONLINEAR
+        || a + b <= -NONLINEAR)
+    {
+        return NONLINEAR;
+    }
+    return a + b;
+}
+
+// A number, a label or constant, hi(X), lo(X), a unary operator applied
+// to one of these, or an expression in parentheses
+static bool parse_unary(Assembler *as, bool final, Value *value)
+{
+    token_t token = as->token;
+    if (token.kind == TOKEN_NUMBER)
+    {
+        value->value = token.value;
+        value->relative = 0;
+        value->known = true;
+        value->labels = false;
+        advance(as);
+        return true;
+    }
+    if (token.kind == TOKEN_NAME)
+    {
+        // hi(X) and lo(X) are the high and low bytes of X
+        bool high = is_named(&token, "hi");
+        if ((high || is_named(&token, "lo")) && peek(as).kind == TOKEN_OPERATOR
+            && peek(as).value == '(')
+        {
+            advance(as);
+            if (!parse_unary(as, final, value))
+            {
+                return false;
+            }
+            value->value = (high ? value->value >> 8 : value->value) & 0xff;
+            value->relative = value->relative ? NONLINEAR : 0;
+            return true;
+        }
+        return parse_symbol(as, final, value);
+    }
+    if (is_operator(&token, '('))
+    {
+        advance(as);
+        if (!parse_expression(as, final, value))
+        {
+            return false;
+        }
+        if (!is_operator(&as->token, ')'))
+        {
+            error(as, "expected )");
+            return false;
+        }
+        advance(as);
+        return true;
+    }
+    if (is_operator(&token, '-') || is_operator(&token, '+')
+        || is_operator(&token, '~'))
+    {
+        advance(as);
+        if (!parse_unary(as, final, value))
+        {
+            return false;
+        }
+        if (token.value == '-')
+        {
+            value->value = -value->value;
+            value->relative = add_relative(0, -value->relative);
+        }
+        else if (token.value == '~')
+        {
+            value->value = ~value->value;
+            value->relative = value->relative ? NONLINEAR : 0;
+        }
+        return true;
+    }
+    error(as, "expected an expression");
+    return false;
+}
+
+// How tightly a binary operator binds, tightest last as in C, or 0 if the
+// token is not one
+static int precedence(const token_t *token)
+{
+    if (token->kind != TOKEN_OPERATOR)
+    {
+        return 0;
+    }
+    switch (token->value)
+    {
+    case '|':
+        return 1;
+    case '^':
+        return 2;
+    case '&':
+        return 3;
+    case '<':
+    case '>':
+        return 4;
+    case '+':
+    case '-':
+        return 5;
+    case '*':
+    case '/':
+    case '%':
+        return 6;
+    }
+    return 0;
+}
+
+// Apply a binary operator to two values, leaving the result in left
+static bool apply(Assembler *as, const token_t *op, Value *left,
+                  const Value *right)
+{
+    unsigned long a = left->value;
+    unsigned long b = right->value;
+    bool known = left->known && right->known;
+    int relative = left->relative || right->relative ? NONLINEAR : 0;
+
+    if (known && (op->value == '/' || op->value == '%') && b == 0)
+    {
+        error_at(as, op->line, op->column, "division by zero");
+        return false;
+    }
+    if (known && (op->value == '<' || op->value == '>')
+        && (right->value < 0 || right->value > 31))
+    {
+        error_at(as, op->line, op->column, "shift by %ld is out of range",
+                 right->value);
+        return false;
+    }
+
+    if (known)
+    {
+        switch (op->value)
+        {
+        case '+':
+            a += b;
+            break;
+        case '-':
+            a -= b;
+            break;
+        case '*':
+            a *= b;
+            break;
+        case '/':
+            a = left->value / right->value;
+            break;
+        case '%':
+            a = left->value % right->value;
+            break;
+        case '&':
+            a &= b;
+            break;
+        case '|':
+            a |= b;
+            break;
+        case '^':
+            a ^= b;
+            break;
+        case '<':
+            a <<= b;
+            break;
+        case '>':
+            a = left->value >> b;
+            break;
+        }
+    }
+    if (op->value == '+')
+    {
+        relative = add_relative(left->relative, right->relative);
+    }
+    else if (op->value == '-')
+    {
+        relative = add_relative(left->relative, -right->relative);
+    }
+
+    left->value = known ? (long) a : 0;
+    left->relative = relative;
+    left->known = known;
+    left->labels |= right->labels;
+    return true;
+}
+
+// Parse operators binding at least as tightly as min and their operands
+static bool parse_binary(Assembler *as, bool final, int min, Value *value)
+{
+    if (!parse_unary(as, final, value))
+    {
+        return false;
+    }
+    while (precedence(&as->token) >= min && precedence(&as->token) > 0)
+    {
+        token_t op = as->token;
+        Value right;
+        advance(as);
+        if (!parse_binary(as, final, precedence(&op) + 1, &right)
+            || !apply(as, &op, value, &right))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parse an expression with the operators and precedence of C. Until
+// final, labels that are not defined yet leave the value unknown.
+static bool parse_expression(Assembler *as, bool final, Value *value)
+{
+    return parse_binary(as, final, 1, value);
+}
+
+// Check that a value fits a field of the word at index and return the
+// bits of the field. An address in an offset field becomes its offset
+// from the next word.
+static bool fit(Assembler *as, const token_t *at, Field field, int index,
+                long value, uint16_t *bits)
+{
+    if (fields[field].relative)
+    {
+        value -= as->origin + index;
+    }
+    if (value < fields[field].min || value > fields[field].max)
+    {
+        error_at(as, at->line, at->column,
+                 "%s %ld out of range (%ld to %ld)", fields[field].name,
+                 value, fields[field].min, fields[field].max);
+        return false;
+    }
+    *bits = (uint16_t) value & (uint16_t) ((1 << fields[field].bits) - 1);
+    return true;
+}
+
+// Make room for n more words, growing the buffer as needed, and return
+// the first. Return NULL if they do not fit in memory.
+static uint16_t *reserve(Assembler *as, long n)
+{
+    if (as->origin + as->count + n > MAX_MEMORY)
+    {
+        if (!as->full)
+        {
+            error_at(as, as->token.line, as->token.column,
+                     "the program does not fit in memory");
+        }
+        as->full = true;
+        return NULL;
+    }
+    if (as->count + 1 + n > as->capacity)
+    {
+        int capacity = 2 * as->capacity;
+        if (capacity < as->count + 1 + n)
+        {
+            capacity = as->count + 1 + n;
+        }
+        as->code = arena_grow(as->arena, as->code,
+                              as->capacity * sizeof(uint16_t),
+                              capacity * sizeof(uint16_t));
+        if (as->optimize)
+        {
+            as->flags = arena_grow(as->arena, as->flags, as->capacity,
+                                   capacity);
+        }
+        as->capacity = capacity;
+    }
+    if (as->optimize)
+    {
+        memset(&as->flags[as->count + 1], 0, n);
+    }
+    if (as->debug && n > 0 && (as->numLines == 0
+                               || as->lines[as->numLines - 1].line != as->line))
+    {
+        as->lines = grow(as, as->lines, as->numLines, &as->lineCapacity,
+                         sizeof(DebugLine));
+        as->lines[as->numLines].index = as->count + 1;
+        as->lines[as->numLines++].line = as->line;
+    }
+    uint16_t *words = &as->code[as->count + 1];
+    as->count += n;
+    return words;
+}
+
+// Append a word in file byte order. Return false if it does not fit
+static bool emit_word(Assembler *as, uint16_t word)
+{
+    uint16_t *p = reserve(as, 1);
+    if (p)
+    {
+        *p = htons(word);
+    }
+    return p != NULL;
+}
+
+// Append an instruction
+static void emit_code(Assembler *as, uint16_t word)
+{
+    if (emit_word(as, word) && as->optimize)
+    {
+        as->flags[as->count] = WORD_CODE;
+    }
+}
+
+// Append n copies of a word
+static void emit_block(Assembler *as, long n, uint16_t word)
+{
+    uint16_t *p = reserve(as, n);
+    if (p)
+    {
+        word = htons(word);
+        for (long i = 0; i < n; i++)
+        {
+            p[i] = word;
+        }
+    }
+}
+
+// Put a value in the field of the word a fixup is for
+static void patch(Assembler *as, const Fixup *fixup, long value)
+{
+    uint16_t bits;
+    Expansion *expansion = as->expansion;
+    as->expansion = fixup->at.expansion;
+    if (fixup->index <= as->count
+        && fit(as, &fixup->at.token, fixup->field, fixup->index, value, &bits))
+    {
+        uint16_t mask = (1 << fields[fixup->field].bits) - 1;
+        uint16_t word = ntohs(as->code[fixup->index]);
+        as->code[fixup->index] = htons((word & ~mask) | bits);
+    }
+    as->expansion = expansion;
+}
+
+// Define a label as the address of the next word
+static void define_label(Assembler *as, const token_t *name)
+{
+    symbol_t *label = symtab_intern(as->labels, name->text, name->length);
+    if (label->defined)
+    {
+        error_at(as, name->line, name->column,
+                 "label '%s' already defined on line %d", label->name,
+                 label->line);
+        return;
+    }
+    if (label->imported)
+    {
+        error_at(as, name->line, name->column,
+                 "label '%s' is declared .extern", label->name);
+        return;
+    }
+    label->address = as->origin + as->count;
+    label->line = name->line;
+    label->defined = true;
+
+    // Patch the words that used the label before it was defined
+    while (label->pending != 0)
+    {
+        Fixup *fixup = &as->fixups[label->pending - 1];
+        patch(as, fixup, label->address);
+        label->pending = fixup->next;
+    }
+}
+
+// Remember a use of a label or expression by the word at index, to patch
+// it later or to relocate it in an object
+static void add_fixup(Assembler *as, symbol_t *label, int index, Field field,
+                      bool pending, const Position *at)
+{
+    as->fixups = grow(as, as->fixups, as->numFixups, &as->fixupCapacity,
+                      sizeof(Fixup));
+    Fixup *fixup = &as->fixups[as->numFixups++];
+    fixup->label = label;
+    fixup->index = index;
+    fixup->field = field;
+    fixup->next = 0;
+    fixup->at = *at;
+    if (pending)
+    {
+        fixup->next = label->pending;
+        label->pending = as->numFixups;
+    }
+}
+
+// Parse an operand for a field of the word about to be emitted and
+// return the bits of the field. A value that depends on labels is left
+// as 0 and patched later.
+static bool parse_operand(Assembler *as, Field field, uint16_t *bits)
+{
+    int index = as->count + 1;
+    Position at = position(as);
+    *bits = 0;
+
+    // A label alone is the common case, patched as soon as it is defined
+    if ((fields[field].relative || field == FIELD_WORD)
+        && as->token.kind == TOKEN_NAME && peek(as).kind != TOKEN_OPERATOR)
+    {
+        symbol_t *label = symtab_intern(as->labels, as->token.text,
+                                        as->token.length);
+        if (!label->expression)
+        {
+            bool ok = true;
+            if (!label->defined)
+            {
+                add_fixup(as, label, index, field, true, &at);
+            }
+            else
+            {
+                // The address changes when the code is optimized or linked
+                if (field == FIELD_WORD)
+                {
+                    add_fixup(as, label, index, field, false, &at);
+                }
+                ok = fit(as, &as->token, field, index, label->address, bits);
+            }
+            advance(as);
+            return ok;
+        }
+    }
+
+    Value value;
+    if (!parse_expression(as, false, &value))
+    {
+        return false;
+    }
+    if (value.labels)
+    {
+        add_fixup(as, NULL, index, field, false, &at);
+        return true;
+    }
+    if (fields[field].relative && as->relocatable)
+    {
+        error_at(as, at.token.line, at.token.column,
+                 "an object cannot branch to a fixed address");
+        return false;
+    }
+    return fit(as, &at.token, field, index, value.value, bits);
+}
+
+// Parse an immediate operand, which is $ and an expression
+static bool parse_immediate(Assembler *as, bool first, Field field,
+                            uint16_t *bits)
+{
+    separator(as, first);
+    if (as->token.kind != TOKEN_DOLLAR)
+    {
+        error(as, "expected an immediate value");
+        return false;
+    }
+    advance(as);
+    return parse_operand(as, field, bits);
+}
+
+// Parse the address an offset field points at, a label or an expression
+static bool parse_offset(Assembler *as, bool first, Field field, uint16_t *bits)
+{
+    separator(as, first);
+    return parse_operand(as, field, bits);
+}
+
+// Parse the operands of an instruction and emit it. Return false on
+// errors, which have been reported.
+static bool parse_instruction(Assembler *as, const mnemonic_t *m)
+{
+    reg_t dst;
+    reg_t src;
+    reg_t value;
+    uint16_t bits;
+    uint16_t word;
+
+    switch (m->format)
+    {
+    case FORMAT_NONE:
+        word = m->bits;
+        break;
+    case FORMAT_ALU:
+        if (!parse_reg(as, true, &dst) || !parse_reg(as, false, &src))
+        {
+            return false;
+        }
+        separator(as, false);
+        if (as->token.kind == TOKEN_REGISTER)
+        {
+            reg_t src2 = (reg_t) as->token.value;
+            word = m->opcode == OP_ADD ? emit_add_reg(dst, src, src2)
+                                       : emit_and_reg(dst, src, src2);
+            advance(as);
+        }
+        else if (as->token.kind == TOKEN_DOLLAR)
+        {
+            if (!parse_immediate(as, true, FIELD_IMM5, &bits))
+            {
+                return false;
+            }
+            word = m->opcode == OP_ADD ? emit_add_imm(dst, src, bits)
+                                       : emit_and_imm(dst, src, bits);
+        }
+        else
+        {
+            error(as, "expected a register or an immediate value");
+            return false;
+        }
+        break;
+    case FORMAT_NOT:
+        if (!parse_reg(as, true, &dst) || !parse_reg(as, false, &src))
+        {
+            return false;
+        }
+        word = emit_not(dst, src);
+        break;
+    case FORMAT_BRANCH:
+        if (!parse_offset(as, true, FIELD_PC9, &bits))
+        {
+            return false;
+        }
+        word = emit_br(m->bits & FL_NEG, m->bits & FL_ZRO, m->bits & FL_POS,
+                       bits);
+        break;
+    case FORMAT_JSR:
+        if (!parse_offset(as, true, FIELD_PC11, &bits))
+        {
+            return false;
+        }
+        word = emit_jsr(bits);
+        break;
+    case FORMAT_BASE:
+        if (!parse_reg(as, true, &src))
+        {
+            return false;
+        }
+        word = m->opcode == OP_JMP ? emit_jmp(src) : emit_jsrr(src);
+        break;
+    case FORMAT_PCREL:
+        if (!parse_reg(as, true, &dst)
+            || !parse_offset(as, false, FIELD_PC9, &bits))
+        {
+            return false;
+        }
+        word = (m->opcode << 12) | (dst << 9) | bits;
+        break;
+    case FORMAT_BASE_OFFSET:
+        if (!parse_reg(as, true, &dst) || !parse_reg(as, false, &src)
+            || !parse_immediate(as, false, FIELD_OFFSET6, &bits))
+        {
+            return false;
+        }
+        word = m->opcode == OP_LDR ? emit_ldr(dst, src, bits)
+                                   : emit_str(dst, src, bits);
+        break;
+    case FORMAT_CAS:
+        if (!parse_reg(as, true, &dst) || !parse_reg(as, false, &src)
+            || !parse_reg(as, false, &value))
+        {
+            return false;
+        }
+        word = emit_cas(dst, src, value);
+        break;
+    case FORMAT_TRAP:
+        if (!parse_immediate(as, true, FIELD_TRAP8, &bits))
+        {
+            return false;
+        }
+        word = emit_trap(bits);
+        break;
+    case FORMAT_VALUE:
+        if (!parse_immediate(as, true, FIELD_WORD, &bits))
+        {
+            return false;
+        }
+        word = emit_value(bits);
+        break;
+    default:
+        error(as, "unknown instruction format");
+        return false;
+    }
+
+    if (m->format == FORMAT_VALUE)
+    {
+        emit_word(as, word);
+    }
+    else
+    {
+        emit_code(as, word);
+    }
+    return true;
+}
+
+// Parse .global or .extern and the labels it names
+static bool parse_symbols(Assembler *as, const token_t *name)
+{
+    bool global = name->text[1] == 'g';
+    bool external = !global;
+    bool first = true;
+    do
+    {
+        separator(as, first);
+        if (as->token.kind != TOKEN_NAME)
+        {
+            error(as, "expected a label");
+            return false;
+        }
+        symbol_t *label = symtab_intern(as->labels, as->token.text,
+                                        as->token.length);
+        if (external && label->defined)
+        {
+            error(as, "label defined here cannot be .extern");
+            return false;
+        }
+        if (!label->defined)
+        {
+            label->line = as->token.line;
+        }
+        label->exported |= global;
+        label->imported |= external;
+        advance(as);
+        first = false;
+    } while (as->token.kind == TOKEN_COMMA || as->token.kind == TOKEN_NAME);
+    return true;
+}
+
+// Parse the value of a directive, with or without a $ in front, that
+// must be known where it is, like a size or an address
+static bool parse_constant(Assembler *as, bool first, long *value)
+{
+    separator(as, first);
+    if (as->token.kind == TOKEN_DOLLAR)
+    {
+        advance(as);
+    }
+    token_t at = as->token;
+    Value v;
+    if (!parse_expression(as, false, &v))
+    {
+        return false;
+    }
+    if (v.labels)
+    {
+        error_at(as, at.line, at.column,
+                 "expected a value that does not depend on labels");
+        return false;
+    }
+    *value = v.value;
+    return true;
+}
+
+// Parse a value that must fit in a word
+static bool parse_word(Assembler *as, bool first, long *value)
+{
+    uint16_t bits;
+    token_t at = as->token;
+    if (!parse_constant(as, first, value))
+    {
+        return false;
+    }
+    return fit(as, &at, FIELD_WORD, 0, *value, &bits);
+}
+
+// Labels defined since the last word name the next one, which .orig is
+// about to place at address. Uses of them before they were defined were
+// patched already, so patch those again.
+static void move_labels(Assembler *as, uint16_t address)
+{
+    uint16_t next = as->origin + as->count;
+    for (size_t i = 0; i < symtab_count(as->labels); i++)
+    {
+        symbol_t *label = symtab_at(as->labels, i);
+        if (!label->defined || label->expression || label->address != next)
+        {
+            continue;
+        }
+        label->address = address;
+        for (int j = 0; j < as->numFixups; j++)
+        {
+            if (as->fixups[j].label == label)
+            {
+                patch(as, &as->fixups[j], address);
+            }
+        }
+    }
+}
+
+// .orig ADDRESS sets the address of the first word. Later on it skips
+// ahead to the address and starts a new segment of the image.
+static bool parse_orig(Assembler *as, const token_t *name)
+{
+    long address;
+    if (!parse_constant(as, true, &address))
+    {
+        return false;
+    }
+    if (as->relocatable)
+    {
+        error_at(as, name->line, name->column,
+                 ".orig cannot be used in an object, place it with xld");
+        return false;
+    }
+    if (address < 0 || address >= MAX_MEMORY)
+    {
+        error_at(as, name->line, name->column, "no address 0x%lx", address);
+        return false;
+    }
+    if (as->count == 0)
+    {
+        move_labels(as, address);
+        as->origin = address;
+    }
+    else if (address < as->origin + as->count)
+    {
+        error_at(as, name->line, name->column,
+                 ".orig cannot go back to 0x%04lx", address);
+        return false;
+    }
+    else if (address > as->origin + as->count)
+    {
+        // The gap is kept in the code so addresses stay an index away
+        // from the origin, but left out of the image
+        as->gaps = grow(as, as->gaps, as->numGaps, &as->gapCapacity,
+                        sizeof(Gap));
+        move_labels(as, address);
+        int n = address - (as->origin + as->count);
+        as->gaps[as->numGaps].index = as->count + 1;
+        as->gaps[as->numGaps++].count = n;
+        emit_block(as, n, 0);
+        if (as->optimize && !as->full)
+        {
+            memset(&as->flags[as->count + 1 - n], WORD_GAP, n);
+        }
+    }
+    return true;
+}
+
+// .entry ADDRESS sets where the program starts, which may be a label
+// defined later
+static bool parse_entry(Assembler *as, const token_t *name)
+{
+    if (as->relocatable)
+    {
+        error_at(as, name->line, name->column,
+                 ".entry cannot be used in an object");
+        return false;
+    }
+    if (as->hasEntry)
+    {
+        error_at(as, name->line, name->column, "the entry is already set");
+        return false;
+    }
+    as->entry = position(as);
+    as->hasEntry = true;
+    Value value;
+    return parse_expression(as, false, &value);
+}
+
+// .fill VALUE, ... emits words with the values, which may use labels
+static bool parse_fill(Assembler *as, const token_t *name)
+{
+    bool first = true;
+    do
+    {
+        uint16_t word;
+        separator(as, first);
+        if (as->token.kind == TOKEN_DOLLAR)
+        {
+            advance(as);
+        }
+        if (!parse_operand(as, FIELD_WORD, &word))
+        {
+            return false;
+        }
+        emit_word(as, word);
+        first = false;
+    } while (as->token.kind == TOKEN_COMMA);
+    return true;
+}
+
+// .blkw COUNT [, VALUE] emits a block of words, zero by default
+static bool parse_blkw(Assembler *as, const token_t *name)
+{
+    long count;
+    long value = 0;
+    if (!parse_constant(as, true, &count))
+    {
+        return false;
+    }
+    if (count < 0 || count > MAX_MEMORY)
+    {
+        error_at(as, name->line, name->column, "bad block size %ld", count);
+        return false;
+    }
+    if (as->token.kind == TOKEN_COMMA || as->token.kind == TOKEN_DOLLAR)
+    {
+        if (!parse_word(as, false, &value))
+        {
+            return false;
+        }
+    }
+    emit_block(as, count, value);
+    return true;
+}
+
+// .stringz "TEXT" emits a character per word and a zero word, for PUTS.
+// .stringp "TEXT" packs two characters per word, first in the low byte,
+// then a zero word, for PUTSP.
+static bool parse_string(Assembler *as, const token_t *name)
+{
+    bool packed = name->text[7] == 'p';
+    if (as->token.kind != TOKEN_STRING)
+    {
+        error(as, "expected a string");
+        return false;
+    }
+    char *text = arena_alloc(as->arena, as->token.length);
+    int length = lexer_string(&as->token, text);
+    advance(as);
+
+    long words = packed ? (length + 1) / 2 + 1 : length + 1;
+    uint16_t *p = reserve(as, words);
+    if (!p)
+    {
+        return false;
+    }
+    for (int i = 0; i < length; i += packed ? 2 : 1)
+    {
+        uint16_t word = (unsigned char) text[i];
+        if (packed && i + 1 < length)
+        {
+            word |= (unsigned char) text[i + 1] << 8;
+        }
+        *p++ = htons(word);
+    }
+    *p = 0;
+    return true;
+}
+
+// .incbin "FILE" copies the bytes of a file, taken as big endian words
+// like an image. The name is relative to the directory of the source.
+static bool parse_incbin(Assembler *as, const token_t *name)
+{
+    if (as->token.kind != TOKEN_STRING)
+    {
+        error(as, "expected a file name");
+        return false;
+    }
+    const char *slash = strrchr(as->fileName, '/');
+    int directory = slash ? (int)(slash - as->fileName) + 1 : 0;
+    char *path = arena_alloc(as->arena, directory + as->token.length);
+    int length = lexer_string(&as->token, path + directory);
+    if (path[directory] == '/')
+    {
+        memmove(path, path + directory, length);
+    }
+    else
+    {
+        memcpy(path, as->fileName, directory);
+        length += directory;
+    }
+    path[length] = '\0';
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        error(as, "cannot open file");
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint16_t *p = reserve(as, (size + 1) / 2);
+    if (p)
+    {
+        p[size / 2] = 0;
+        if (fread(p, 1, size, fp) != (size_t) size)
+        {
+            error(as, "cannot read file");
+        }
+    }
+    fclose(fp);
+    advance(as);
+    return p != NULL;
+}
+
+// .equ NAME, VALUE names the value of an expression. The expression is
+// evaluated where the name is used, so it may use labels defined later.
+static bool parse_equ(Assembler *as, const token_t *directive)
+{
+    if (as->token.kind != TOKEN_NAME)
+    {
+        error(as, "expected a name");
+        return false;
+    }
+    token_t name = as->token;
+    advance(as);
+    separator(as, false);
+
+    Position at = position(as);
+    Value value;
+    if (!parse_expression(as, false, &value))
+    {
+        return false;
+    }
+    symbol_t *constant = symtab_intern(as->labels, name.text, name.length);
+    if (constant->defined || constant->imported)
+    {
+        error_at(as, name.line, name.column, constant->defined
+                 ? "'%s' already defined on line %d"
+                 : "'%s' is declared .extern on line %d", constant->name,
+                 constant->line);
+        return false;
+    }
+    as->constants = grow(as, as->constants, as->numConstants,
+                         &as->constantCapacity, sizeof(Position));
+    as->constants[as->numConstants++] = at;
+    constant->expression = as->numConstants;
+    constant->defined = true;
+    constant->line = name.line;
+    return true;
+}
+
+// .macro NAME PARAM, ... starts a macro, which runs to .endm. Parameters
+// are used as \PARAM in the body, and \@ is a number unique to each use
+// of the macro, to make labels with.
+static bool parse_macro(Assembler *as, const token_t *directive)
+{
+    token_t name = as->token;
+    if (name.kind != TOKEN_NAME || name.text[0] == '.')
+    {
+        error(as, "expected a macro name");
+        return false;
+    }
+    if (mnemonic_find(name.text, name.length))
+    {
+        error(as, "a macro cannot be named like an instruction");
+        return false;
+    }
+    symbol_t *symbol = symtab_intern(as->macroNames, name.text, name.length);
+    if (symbol->defined)
+    {
+        error_at(as, name.line, name.column,
+                 "macro '%s' already defined on line %d", symbol->name,
+                 symbol->line);
+        return false;
+    }
+    advance(as);
+
+    Macro macro = {0};
+    int capacity = 0;
+    bool first = true;
+    while (as->token.kind != TOKEN_NEWLINE && as->token.kind != TOKEN_END)
+    {
+        separator(as, first);
+        if (as->token.kind != TOKEN_NAME)
+        {
+            error(as, "expected a parameter name");
+            return false;
+        }
+        macro.params = grow(as, macro.params, macro.numParams, &capacity,
+                            sizeof(token_t));
+        macro.params[macro.numParams++] = as->token;
+        advance(as);
+        first = false;
+    }
+
+    // The body is the lines up to the one starting with .endm
+    macro.body = as->lexer.cursor;
+    macro.line = as->lexer.line;
+    skip_line(as);
+    while (!is_named(&as->token, ".endm"))
+    {
+        if (as->token.kind == TOKEN_END)
+        {
+            error_at(as, directive->line, directive->column,
+                     "missing .endm");
+            return false;
+        }
+        if (is_named(&as->token, ".macro"))
+        {
+            error(as, "macros cannot be defined inside a macro");
+            return false;
+        }
+        skip_line(as);
+    }
+    macro.size = (as->token.text - (as->token.column - 1)) - macro.body;
+    advance(as);
+
+    as->macros = grow(as, as->macros, as->numMacros, &as->macroCapacity,
+                      sizeof(Macro));
+    as->macros[as->numMacros] = macro;
+    symbol->index = as->numMacros++;
+    symbol->defined = true;
+    symbol->line = name.line;
+    return true;
+}
+
+// .endm only ends a macro
+static bool parse_endm(Assembler *as, const token_t *name)
+{
+    error_at(as, name->line, name->column, ".endm without .macro");
+    return false;
+}
+
+// Assembler directives, which all start with a dot
+static const struct
+{
+    const char *name;
+    bool (*parse)(Assembler *as, const token_t *name);
+} directives[] = {
+    {".orig", parse_orig},
+    {".entry", parse_entry},
+    {".fill", parse_fill},
+    {".blkw", parse_blkw},
+    {".stringz", parse_string},
+    {".stringp", parse_string},
+    {".incbin", parse_incbin},
+    {".global", parse_symbols},
+    {".extern", parse_symbols},
+    {".equ", parse_equ},
+    {".macro", parse_macro},
+    {".endm", parse_endm},
+};
+
+// Parse a directive and its operands
+static bool parse_directive(Assembler *as, const token_t *name)
+{
+    for (size_t i = 0; i < sizeof(directives) / sizeof(directives[0]); i++)
+    {
+        if (is_named(name, directives[i].name))
+        {
+            return directives[i].parse(as, name);
+        }
+    }
+    error_at(as, name->line, name->column, "unknown directive '%.*s'",
+             name->length, name->text);
+    return false;
+}
+
+// Copy the body of a macro with the arguments in place of \PARAM and the
+// number of the use in place of \@. Return the size, only counting it
+// when out is NULL.
+static size_t substitute(const Macro *macro, const token_t *args, int use,
+                         char *out)
+{
+    char number[16];
+    int numberLength = snprintf(number, sizeof(number), "%d", use);
+    const char *p = macro->body;
+    const char *end = p + macro->size;
+    size_t n = 0;
+    while (p < end)
+    {
+        const char *text = p++;
+        size_t length = 1;
+        if (*text == '\\' && p < end && *p == '@')
+        {
+            text = number;
+            length = numberLength;
+            p++;
+        }
+        else if (*text == '\\')
+        {
+            const char *q = p;
+            while (q < end && (isalnum((unsigned char) *q) || *q == '_'
+                               || *q == '.'))
+            {
+                q++;
+            }
+            for (int i = 0; i < macro->numParams; i++)
+            {
+                const token_t *param = &macro->params[i];
+                if (param->length == q - p
+                    && strncmp(param->text, p, q - p) == 0)
+                {
+                    text = args[i].text;
+                    length = args[i].length;
+                    p = q;
+                    break;
+                }
+            }
+        }
+        if (out)
+        {
+            memcpy(out + n, text, length);
+        }
+        n += length;
+    }
+    return n;
+}
+
+// Use a macro. Its arguments are the text between commas up to the end of
+// the line. The body is then read with them put in, before the lines
+// after the use.
+static bool expand_macro(Assembler *as, const token_t *name, symbol_t *symbol)
+{
+    const Macro *macro = &as->macros[symbol->index];
+    token_t *args = arena_alloc(as->arena,
+                                (macro->numParams + 1) * sizeof(token_t));
+    int count = 0;
+    while (as->token.kind != TOKEN_NEWLINE && as->token.kind != TOKEN_END)
+    {
+        token_t arg = as->token;
+        arg.length = 0;
+        while (as->token.kind != TOKEN_COMMA
+               && as->token.kind != TOKEN_NEWLINE
+               && as->token.kind != TOKEN_END)
+        {
+            arg.length = (int) (as->token.text + as->token.length - arg.text);
+            advance(as);
+        }
+        if (count < macro->numParams)
+        {
+            args[count] = arg;
+        }
+        count++;
+        if (as->token.kind == TOKEN_COMMA)
+        {
+            advance(as);
+        }
+    }
+    if (count != macro->numParams)
+    {
+        error_at(as, name->line, name->column,
+                 "macro '%s' takes %d argument%s, not %d", symbol->name,
+                 macro->numParams, macro->numParams == 1 ? "" : "s", count);
+        return false;
+    }
+    int depth = as->expansion ? as->expansion->depth + 1 : 1;
+    if (depth > MAX_DEPTH)
+    {
+        error_at(as, name->line, name->column,
+                 "macros nested more than %d deep", MAX_DEPTH);
+        return false;
+    }
+
+    int use = ++as->expansions;
+    size_t size = substitute(macro, args, use, NULL);
+    char *text = arena_alloc(as->arena, size + 1);
+    substitute(macro, args, use, text);
+
+    Expansion *expansion = arena_alloc(as->arena, sizeof(Expansion));
+    expansion->name = symbol->name;
+    expansion->line = name->line;
+    expansion->depth = depth;
+    expansion->caller = as->expansion;
+    expansion->resume = as->lexer;
+    as->expansion = expansion;
+    lexer_init(&as->lexer, text, size);
+    as->lexer.line = macro->line;
+    advance(as);
+    return true;
+}
+
+// Go back to reading after the use of the macro whose body just ended
+static void end_expansion(Assembler *as)
+{
+    as->lexer = as->expansion->resume;
+    as->expansion = as->expansion->caller;
+    advance(as);
+}
+
+// Parse one line: an optional label definition, then an optional
+// instruction, directive or macro, then an optional comment
+static void parse_line(Assembler *as)
+{
+    as->line = as->token.line;
+    if (as->token.kind == TOKEN_NAME)
+    {
+        token_t name = as->token;
+        advance(as);
+        if (as->token.kind == TOKEN_COLON)
+        {
+            define_label(as, &name);
+            advance(as);
+            if (as->token.kind != TOKEN_NAME)
+            {
+                goto end;
+            }
+            name = as->token;
+            advance(as);
+        }
+
+        if (name.text[0] == '.')
+        {
+            if (!parse_directive(as, &name))
+            {
+                skip_line(as);
+                return;
+            }
+            goto end;
+        }
+
+        const mnemonic_t *m = mnemonic_find(name.text, name.length);
+        if (m == NULL)
+        {
+            symbol_t *macro = symtab_find(as->macroNames, name.text,
+                                          name.length);
+            if (macro == NULL)
+            {
+                error_at(as, name.line, name.column,
+                         "unknown instruction '%.*s'", name.length, name.text);
+                skip_line(as);
+            }
+            else if (!expand_macro(as, &name, macro))
+            {
+                skip_line(as);
+            }
+            return;
+        }
+        if (!parse_instruction(as, m))
+        {
+            skip_line(as);
+            return;
+        }
+    }
+
+end:
+    if (as->token.kind != TOKEN_NEWLINE && as->token.kind != TOKEN_END)
+    {
+        error(as, "expected the end of the line");
+    }
+    skip_line(as);
+}
+
+
+// True if a fixup is for an expression, which the assembler evaluates
+// itself, rather than a label
+static bool resolved(const Fixup *fixup)
+{
+    return !fixup->label || fixup->label->expression;
+}
+
+// Evaluate the expression of a fixup now that every label is known and
+// patch the word. Return false on errors, which have been reported.
+static bool resolve(Assembler *as, const Fixup *fixup, Value *value)
+{
+    Position here = position(as);
+    seek(as, &fixup->at);
+    bool ok = parse_expression(as, true, value);
+
+    // In an object only offsets between labels are known
+    bool relative = fields[fixup->field].relative;
+    if (ok && as->relocatable && value->relative != (relative ? 1 : 0))
+    {
+        error_at(as, fixup->at.token.line, fixup->at.token.column,
+                 relative ? "the target must be one label plus or minus "
+                            "a value in an object"
+                 : fixup->field == FIELD_WORD
+                     ? "an address in an object must be a label alone"
+                     : "the value depends on where the object is placed");
+        ok = false;
+    }
+    if (ok)
+    {
+        patch(as, fixup, value->value);
+    }
+    seek(as, &here);
+    return ok;
+}
+
+// Write the code, the labels and the uses of imported labels as an
+// object for xld
+static bool build_object(Assembler *as, object_t *object)
+{
+    size_t count = symtab_count(as->labels);
+    if (count > UINT16_MAX || as->numFixups > UINT16_MAX)
+    {
+        fprintf(as->diagnostics, "%s: too many labels for an object\n",
+                as->fileName);
+        as->errors++;
+        return false;
+    }
+    object->code = arena_alloc(as->arena, (as->count + 1) * sizeof(uint16_t));
+    object->symbols = arena_alloc(as->arena,
+                                  (count + 1) * sizeof(object_symbol_t));
+    object->fixups = arena_alloc(as->arena,
+                                 (as->numFixups + 1) * sizeof(object_fixup_t));
+
+    object->count = as->count;
+    for (int i = 0; i < as->count; i++)
+    {
+        object->code[i] = ntohs(as->code[i + 1]);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        symbol_t *label = symtab_at(as->labels, i);
+        if ((label->defined || label->imported) && !label->expression)
+        {
+            object_symbol_t *symbol = &object->symbols[object->symbol_count];
+            symbol->name = label->name;
+            symbol->value = label->defined ? label->address - as->origin : 0;
+            symbol->flags = (label->defined ? SYMBOL_DEFINED : 0)
+                | (label->exported ? SYMBOL_EXPORT : 0);
+            label->index = object->symbol_count++;
+        }
+    }
+    for (int i = 0; i < as->numFixups; i++)
+    {
+        Fixup *fixup = &as->fixups[i];
+        if (resolved(fixup))
+        {
+            continue;
+        }
+        if (!fixup->label->defined || fixup->field == FIELD_WORD)
+        {
+            object_fixup_t *reloc = &object->fixups[object->fixup_count++];
+            reloc->index = fixup->index - 1;
+            reloc->symbol = fixup->label->index;
+            reloc->kind = fixup->field == FIELD_WORD ? FIXUP_ABS16
+                : fixup->field == FIELD_PC11 ? FIXUP_PC11 : FIXUP_PC9;
+        }
+    }
+
+    return true;
+}
+
+// Order symbols by address, then by name
+static int compare_symbols(const void *a, const void *b)
+{
+    const debugmap_symbol_t *x = a;
+    const debugmap_symbol_t *y = b;
+    if (x->address != y->address)
+    {
+        return x->address < y->address ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Make the debug map of the image: the line each word came from and the
+// address of each label
+static void build_map(Assembler *as, debugmap_t *map)
+{
+    size_t count = symtab_count(as->labels);
+    char *name = arena_alloc(as->arena, strlen(as->fileName) + 1);
+    map->files = arena_alloc(as->arena, sizeof(const char *));
+    map->files[0] = strcpy(name, as->fileName);
+    map->file_count = 1;
+    map->lines = arena_alloc(as->arena,
+                             (as->numLines + 1) * sizeof(debugmap_line_t));
+    map->symbols = arena_alloc(as->arena,
+                               (count + 1) * sizeof(debugmap_symbol_t));
+
+    // Removed words leave entries on the word after them, which the
+    // entry of that word replaces
+    for (int i = 0; i < as->numLines && as->lines[i].index <= as->count; i++)
+    {
+        uint16_t address = as->origin + as->lines[i].index - 1;
+        if (map->line_count > 0
+            && map->lines[map->line_count - 1].address == address)
+        {
+            map->line_count--;
+        }
+        debugmap_line_t *line = &map->lines[map->line_count++];
+        line->address = address;
+        line->file = 0;
+        line->line = as->lines[i].line;
+    }
+    if (as->origin + as->count <= UINT16_MAX)
+    {
+        debugmap_line_t *end = &map->lines[map->line_count++];
+        end->address = as->origin + as->count;
+        end->file = DEBUGMAP_NO_FILE;
+        end->line = 0;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        symbol_t *label = symtab_at(as->labels, i);
+        if (label->defined && !label->expression)
+        {
+            debugmap_symbol_t *symbol = &map->symbols[map->symbol_count++];
+            symbol->address = label->address;
+            symbol->name = label->name;
+        }
+    }
+    qsort(map->symbols, map->symbol_count, sizeof(debugmap_symbol_t),
+          compare_symbols);
+}
+
+// Evaluate the expression of .entry, now that every label has its address
+static bool find_entry(Assembler *as, uint16_t *entry)
+{
+    Value value;
+    seek(as, &as->entry);
+    token_t at = as->token;
+    bool ok = parse_expression(as, true, &value);
+    if (ok && (value.value < 0 || value.value >= MAX_MEMORY))
+    {
+        error_at(as, at.line, at.column, "no address 0x%lx", value.value);
+        ok = false;
+    }
+    as->expansion = NULL;
+    *entry = value.value;
+    return ok;
+}
+
+// Order exported labels by address, then by name
+static int compare_exports(const void *a, const void *b)
+{
+    const image_symbol_t *x = a;
+    const image_symbol_t *y = b;
+    if (x->address != y->address)
+    {
+        return x->address < y->address ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+// Make the image: the words between the gaps .orig skipped as segments,
+// the entry, by default the origin, and the exported labels. Labels are
+// only kept in an image that is a container anyway, so that a plain
+// program stays a legacy image. The code is swapped to host order.
+static void build_image(Assembler *as, image_t *image)
+{
+    uint16_t *code = as->code + 1;
+    for (int i = 0; i < as->count; i++)
+    {
+        code[i] = ntohs(code[i]);
+    }
+
+    image->segments = arena_alloc(as->arena,
+                                  (as->numGaps + 1) * sizeof(image_segment_t));
+    int start = 0;
+    for (int i = 0; i <= as->numGaps; i++)
+    {
+        int end = i < as->numGaps ? as->gaps[i].index - 1 : as->count;
+        if (end > start || image->segment_count == 0)
+        {
+            image_segment_t *segment =
+                &image->segments[image->segment_count++];
+            segment->origin = as->origin + start;
+            segment->count = end - start;
+            segment->words = code + start;
+        }
+        if (i < as->numGaps)
+        {
+            start = end + as->gaps[i].count;
+        }
+    }
+
+    if (!image->has_entry)
+    {
+        image->entry = as->origin;
+    }
+    size_t count = symtab_count(as->labels);
+    image->symbols = arena_alloc(as->arena,
+                                 (count + 1) * sizeof(image_symbol_t));
+    if (!image_is_container(image))
+    {
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        symbol_t *label = symtab_at(as->labels, i);
+        if (label->exported && label->defined && !label->expression)
+        {
+            image_symbol_t *symbol = &image->symbols[image->symbol_count++];
+            symbol->address = label->address;
+            symbol->name = label->name;
+        }
+    }
+    qsort(image->symbols, image->symbol_count, sizeof(image_symbol_t),
+          compare_exports);
+}
+
+// Run the peephole optimizer over the code, then move labels, fixups and
+// label addresses in the data to where the code went
+static void optimize(Assembler *as)
+{
+    int count = as->count;
+    for (size_t i = 0; i < symtab_count(as->labels); i++)
+    {
+        symbol_t *label = symtab_at(as->labels, i);
+        int index = label->address - as->origin;
+        if (label->defined && !label->expression && index < count)
+        {
+            as->flags[index + 1] |= WORD_LABEL;
+        }
+    }
+    for (int i = 0; i < as->numFixups; i++)
+    {
+        Fixup *fixup = &as->fixups[i];
+        if (!resolved(fixup))
+        {
+            if (!fixup->label->defined)
+            {
+                as->flags[fixup->index] |= WORD_EXTERN;
+            }
+        }
+        else if (fixup->field == FIELD_WORD)
+        {
+            // The word may be the address of code no label names
+            int index = ntohs(as->code[fixup->index]) - as->origin;
+            if (index >= 0 && index < count)
+            {
+                as->flags[index + 1] |= WORD_LABEL;
+            }
+        }
+        else if (!fields[fixup->field].relative)
+        {
+            // Evaluated again below, so the optimizer must leave it be
+            as->flags[fixup->index] |= WORD_EXTERN;
+        }
+    }
+
+    uint16_t *code = as->code + 1;
+    int *remap = arena_alloc(as->arena, (count + 1) * sizeof(int));
+    for (int i = 0; i < count; i++)
+    {
+        code[i] = ntohs(code[i]);
+    }
+    as->count = peephole_optimize(code, as->flags + 1, count, as->origin,
+                                  remap);
+    for (int i = 0; i < as->count; i++)
+    {
+        code[i] = htons(code[i]);
+    }
+
+    for (size_t i = 0; i < symtab_count(as->labels); i++)
+    {
+        symbol_t *label = symtab_at(as->labels, i);
+        if (label->defined && !label->expression)
+        {
+            label->address = as->origin + remap[label->address - as->origin];
+        }
+    }
+    for (int i = 0; i < as->numLines; i++)
+    {
+        as->lines[i].index = remap[as->lines[i].index - 1] + 1;
+    }
+    // Gaps grow by what the words before them lost
+    int before = count;
+    int after = as->count;
+    for (int i = 0; i < as->numGaps; i++)
+    {
+        int end = as->gaps[i].index - 1 + as->gaps[i].count;
+        before -= as->gaps[i].count;
+        as->gaps[i].index = remap[as->gaps[i].index - 1] + 1;
+        as->gaps[i].count = end - (as->gaps[i].index - 1);
+        after -= as->gaps[i].count;
+    }
+    // The optimizer moved offsets itself, other values are redone
+    for (int i = 0; i < as->numFixups; i++)
+    {
+        Fixup *fixup = &as->fixups[i];
+        Value value;
+        fixup->index = remap[fixup->index - 1] + 1;
+        if (resolved(fixup) && !fields[fixup->field].relative)
+        {
+            resolve(as, fixup, &value);
+        }
+        else if (!resolved(fixup) && fixup->field == FIELD_WORD
+                 && fixup->label->defined)
+        {
+            as->code[fixup->index] = htons(fixup->label->address);
+        }
+    }
+
+    fprintf(as->diagnostics, "%s: peephole pass saved %d of %d words\n",
+            as->fileName, before - after, before);
+}
+
+// Assemble a source buffer in a single pass
+bool assemble(const char *source, size_t size,
+              const assemble_options_t *options, assembly_t *assembly)
+{
+    memset(assembly, 0, sizeof(assembly_t));
+    Assembler as = {0};
+    as.fileName = options->name;
+    as.arena = &assembly->arena;
+    as.diagnostics = options->diagnostics;
+    as.relocatable = options->relocatable;
+    as.optimize = options->optimize;
+    as.debug = options->debug;
+    as.labels = symtab_create(as.arena);
+    as.macroNames = symtab_create(as.arena);
+    as.origin = ORIGIN;
+    as.capacity = 1024;
+    as.code = arena_alloc(as.arena, as.capacity * sizeof(uint16_t));
+    as.flags = as.optimize ? arena_alloc(as.arena, as.capacity) : NULL;
+
+    lexer_init(&as.lexer, source, size);
+    advance(&as);
+    while (as.token.kind != TOKEN_END || as.expansion)
+    {
+        if (as.token.kind == TOKEN_END)
+        {
+            end_expansion(&as);
+        }
+        else
+        {
+            parse_line(&as);
+        }
+    }
+
+    // Every label used must have been defined by now, unless another
+    // object defines it. Expressions get their final values.
+    for (int i = 0; i < as.numFixups; i++)
+    {
+        Fixup *fixup = &as.fixups[i];
+        Value value;
+        as.expansion = fixup->at.expansion;
+        if (resolved(fixup))
+        {
+            resolve(&as, fixup, &value);
+        }
+        else if (fixup->label->defined)
+        {
+            continue;
+        }
+        else if (!fixup->label->imported)
+        {
+            error_at(&as, fixup->at.token.line, fixup->at.token.column,
+                     "undefined label '%s'", fixup->label->name);
+        }
+        else if (!as.relocatable)
+        {
+            error_at(&as, fixup->at.token.line, fixup->at.token.column,
+                     "label '%s' is .extern, assemble with -c and link",
+                     fixup->label->name);
+        }
+    }
+    as.expansion = NULL;
+    for (size_t i = 0; i < symtab_count(as.labels); i++)
+    {
+        symbol_t *label = symtab_at(as.labels, i);
+        if (label->exported && (!label->defined || label->expression))
+        {
+            error_at(&as, label->line, 1, label->defined
+                     ? "constant '%s' cannot be exported"
+                     : "exported label '%s' is not defined", label->name);
+        }
+    }
+
+    if (as.errors == 0 && as.optimize)
+    {
+        optimize(&as);
+    }
+    if (as.errors == 0 && as.relocatable)
+    {
+        build_object(&as, &assembly->object);
+    }
+    if (as.errors == 0 && as.debug)
+    {
+        build_map(&as, &assembly->map);
+    }
+    if (as.errors == 0 && as.hasEntry)
+    {
+        assembly->image.has_entry = find_entry(&as, &assembly->image.entry);
+    }
+    if (as.errors == 0 && !as.relocatable)
+    {
+        build_image(&as, &assembly->image);
+    }
+
+    assembly->errors = as.errors;
+    return as.errors == 0;
+}
+
+// Free everything an assembly made
+void assembly_free(assembly_t *assembly)
+{
+    arena_free(&assembly->arena);
+    memset(assembly, 0, sizeof(assembly_t));
+}
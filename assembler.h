@@ -0,0 +1,42 @@
+#ifndef ASSEMBLER_H_
+#define ASSEMBLER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "arena.h"
+#include "debugmap.h"
+#include "image.h"
+#include "object.h"
+
+// How to assemble a source
+typedef struct {
+    const char* name;       // file name for messages and the debug map;
+                            // .incbin paths are relative to its directory
+    bool relocatable;       // make an object for xld instead of an image
+    bool optimize;          // run the peephole optimizer
+    bool debug;             // make a debug map of the image
+    FILE* diagnostics;      // where error messages go
+} assemble_options_t;
+
+// What assembling a source made. It all lives in the arena and goes away
+// with assembly_free.
+typedef struct {
+    image_t image;          // the segments, entry and exported labels
+    object_t object;        // the object, when relocatable
+    debugmap_t map;         // the debug map, when asked for
+    int errors;
+    arena_t arena;
+} assembly_t;
+
+// Assemble a source buffer in a single pass, without touching the file
+// system except for .incbin. Return false if there were errors, which
+// have been written to the diagnostics.
+bool assemble(const char* source, size_t size,
+              const assemble_options_t* options, assembly_t* assembly);
+
+// Free everything an assembly made
+void assembly_free(assembly_t* assembly);
+
+#endif  // ASSEMBLER_H_
@@ -0,0 +1,623 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#include "batch.h"
+#include "bits.h"
+#include "fast.h"
+#include "instruction.h"
+
+// Instructions a lane left running alone runs on the fast engine before
+// the batch looks for lanes restarted next to it
+#define SOLO_STEPS      4096
+
+// A 16 bit value per lane, a mask with every bit of a lane set or clear,
+// and the wider forms of both for step counts. The compiler turns these
+// into vector instructions of the target.
+typedef uint16_t lanes_t __attribute__((vector_size(BATCH_LANES * 2)));
+typedef int16_t mask_t __attribute__((vector_size(BATCH_LANES * 2)));
+typedef uint32_t counts_t __attribute__((vector_size(BATCH_LANES * 4)));
+typedef int32_t wide_mask_t __attribute__((vector_size(BATCH_LANES * 4)));
+
+// The bit of each lane
+#if BATCH_LANES == 16
+static const lanes_t lane_bit = {
+    1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+    1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, 1 << 15,
+};
+#else
+static const lanes_t lane_bit = {
+    1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+};
+#endif
+
+// Rotations by 4, 2 and 1 of 8 lanes, for targets without instructions
+// that gather the lanes of a vector
+#if BATCH_LANES == 8 && !defined(__SSE4_1__)
+static const lanes_t rotate[] = {
+    { 4, 5, 6, 7, 0, 1, 2, 3 },
+    { 2, 3, 4, 5, 6, 7, 0, 1 },
+    { 1, 2, 3, 4, 5, 6, 7, 0 },
+};
+#define ROTATIONS   (sizeof(rotate) / sizeof(rotate[0]))
+#endif
+
+// Operations of the batch, as the fast engine decodes them. B_ALONE runs
+// the instruction on each lane on its own.
+typedef enum {
+    B_ADD_REG,
+    B_ADD_IMM,
+    B_AND_REG,
+    B_AND_IMM,
+    B_NOT,
+    B_LEA,
+    B_LD,
+    B_LDI,
+    B_LDR,
+    B_ST,
+    B_STI,
+    B_STR,
+    B_BR,
+    B_JMP,
+    B_JSR,
+    B_JSRR,
+    B_ALONE
+} batch_op_t;
+
+// A decoded instruction, valid while its epoch is that of the batch
+typedef struct {
+    uint32_t epoch;
+    uint16_t imm;       // sign extended immediate or absolute target
+    uint8_t op;         // batch_op_t
+    uint8_t a;          // DR or SR
+    uint8_t b;          // SR1 or base register
+    uint8_t c;          // SR2 or the nzp mask of a branch
+} entry_t;
+
+struct batch {
+    // R0-R7, PC and COND of every lane, indexed by reg_t
+    lanes_t reg[R_COND + 1];
+
+    // Instructions each lane ran since it started, and those it ran in
+    // groups since they were last added in
+    counts_t steps;
+    lanes_t ran;
+
+    int count;
+    x16_t* machines[BATCH_LANES];
+    uint16_t* memory[BATCH_LANES];
+    const uint8_t* pages[BATCH_LANES];
+
+    // A bit per lane: every lane of the batch, lanes that ended, ends
+    // batch_run returned, lanes that ran HALT, lanes to stop at the end
+    // of their block, and lanes whose keyboard interrupts are enabled
+    uint32_t all;
+    uint32_t ended;
+    uint32_t reported;
+    uint32_t halted;
+    uint32_t stopping;
+    uint32_t polling;
+
+    // Runs lanes on their own. It compares every word it runs with what
+    // it decoded, so one cache serves every lane.
+    fast_t* engine;
+
+    // An entry of the current epoch holds the word every lane has at its
+    // address. Entries are dropped one by one when lanes store to them,
+    // and all at once by a new epoch when memory changed otherwise.
+    uint32_t epoch;
+    entry_t code[MAX_MEMORY];
+};
+
+static inline lanes_t splat(uint16_t value) {
+    return (lanes_t) {} + value;
+}
+
+// Take new where the mask is set and old elsewhere
+static inline lanes_t blend(lanes_t old, lanes_t new, mask_t mask) {
+    return (new & (lanes_t) mask) | (old & ~(lanes_t) mask);
+}
+
+// The lanes of a mask as bits
+static inline uint32_t bits_of(mask_t mask) {
+#if defined(__AVX2__)
+    __m256i m = (__m256i) mask;
+    return _mm_movemask_epi8(_mm_packs_epi16(
+        _mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1)));
+#elif defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_packs_epi16((__m128i) mask,
+                                             _mm_setzero_si128()));
+#else
+    lanes_t bits = (lanes_t) mask & lane_bit;
+    for (size_t i = 0; i < ROTATIONS; i++) {
+        bits |= __builtin_shuffle(bits, rotate[i]);
+    }
+    return bits[0];
+#endif
+}
+
+// The mask of a set of lane bits
+static inline mask_t mask_of(uint32_t bits) {
+    return (lane_bit & splat(bits)) != 0;
+}
+
+// The lowest value of any lane
+static inline uint16_t lowest(lanes_t values) {
+#if defined(__AVX2__)
+    __m256i v = (__m256i) values;
+    __m128i low = _mm_min_epu16(_mm256_castsi256_si128(v),
+                                _mm256_extracti128_si256(v, 1));
+    return _mm_extract_epi16(_mm_minpos_epu16(low), 0);
+#elif defined(__SSE4_1__)
+    return _mm_extract_epi16(_mm_minpos_epu16((__m128i) values), 0);
+#else
+    for (size_t i = 0; i < ROTATIONS; i++) {
+        lanes_t other = __builtin_shuffle(values, rotate[i]);
+        values = blend(values, other, other < values);
+    }
+    return values[0];
+#endif
+}
+
+// Condition codes of the results, like update_cond
+static inline lanes_t condition(lanes_t result) {
+    lanes_t sign = blend(splat(FL_POS), splat(FL_NEG), (mask_t) result < 0);
+    return blend(sign, splat(FL_ZRO), result == 0);
+}
+
+// Note whether a lane enabled keyboard interrupts
+static void watch_keyboard(batch_t* batch, int lane) {
+    if (batch->memory[lane][MR_KBSR] & KBSR_IE) {
+        batch->polling |= 1u << lane;
+    } else {
+        batch->polling &= ~(1u << lane);
+    }
+}
+
+// Take the registers of a lane from its machine
+static void load_lane(batch_t* batch, int lane) {
+    const uint16_t* reg = x16_registers(batch->machines[lane]);
+    for (int r = 0; r <= R_COND; r++) {
+        batch->reg[r][lane] = reg[r];
+    }
+    watch_keyboard(batch, lane);
+}
+
+// Add in the instructions the lanes ran in groups
+static void count_steps(batch_t* batch) {
+    batch->steps += __builtin_convertvector(batch->ran, counts_t);
+    batch->ran = (lanes_t) {};
+}
+
+// Give the registers of a lane back to its machine
+static void store_lane(batch_t* batch, int lane) {
+    uint16_t* reg = x16_registers(batch->machines[lane]);
+    for (int r = 0; r <= R_COND; r++) {
+        reg[r] = batch->reg[r][lane];
+    }
+}
+
+// Drop every decoded entry
+static void forget_code(batch_t* batch) {
+    if (++batch->epoch == 0) {
+        memset(batch->code, 0, sizeof(batch->code));
+        batch->epoch = 1;
+    }
+}
+
+// Create a batch over the machines
+batch_t* batch_create(x16_t** machines, int count) {
+    batch_t* batch;
+    if (count < 1 || count > BATCH_LANES
+        || posix_memalign((void**) &batch, _Alignof(batch_t),
+                          sizeof(batch_t)) != 0) {
+        return NULL;
+    }
+    memset(batch, 0, sizeof(batch_t));
+    batch->count = count;
+    batch->all = (1u << count) - 1;
+    for (int i = 0; i < count; i++) {
+        batch->machines[i] = machines[i];
+        batch->memory[i] = x16_memory(machines[i], 0);
+        batch->pages[i] = x16_pages(machines[i]);
+        load_lane(batch, i);
+    }
+    batch->engine = fast_create();
+    batch->epoch = 1;
+    return batch;
+}
+
+// Free the batch
+void batch_free(batch_t* batch) {
+    fast_free(batch->engine);
+    free(batch);
+}
+
+// Decode the instruction stored at address pc
+static void decode(entry_t* e, uint16_t pc, uint16_t word) {
+    uint16_t next = pc + 1;
+    e->a = getbits(word, 9, 3);
+    e->b = getbits(word, 6, 3);
+    e->c = getbits(word, 0, 3);
+    e->imm = 0;
+
+    switch (getopcode(word)) {
+    case OP_ADD:
+    case OP_AND:
+        if (getimmediate(word) == 1) {
+            e->op = getopcode(word) == OP_ADD ? B_ADD_IMM : B_AND_IMM;
+            e->imm = sign_extend(getbits(word, 0, 5), 5);
+        } else {
+            e->op = getopcode(word) == OP_ADD ? B_ADD_REG : B_AND_REG;
+        }
+        break;
+
+    case OP_NOT:
+        e->op = B_NOT;
+        break;
+
+    case OP_BR:
+        e->op = B_BR;
+        e->c = getbits(word, 9, 3);
+        e->imm = next + sign_extend(getbits(word, 0, 9), 9);
+        break;
+
+    case OP_JMP:
+        e->op = getbits(word, 9, 3) == 0 ? B_JMP : B_ALONE;
+        break;
+
+    case OP_JSR:
+        if (getbit(word, 11) == 1) {
+            e->op = B_JSR;
+            e->imm = next + sign_extend(getbits(word, 0, 11), 11);
+        } else {
+            e->op = getbits(word, 9, 2) == 0 ? B_JSRR : B_ALONE;
+        }
+        break;
+
+    case OP_LD:
+    case OP_LDI:
+    case OP_LEA:
+    case OP_ST:
+    case OP_STI:
+        switch (getopcode(word)) {
+        case OP_LD:  e->op = B_LD;  break;
+        case OP_LDI: e->op = B_LDI; break;
+        case OP_LEA: e->op = B_LEA; break;
+        case OP_ST:  e->op = B_ST;  break;
+        default:     e->op = B_STI; break;
+        }
+        e->imm = next + sign_extend(getbits(word, 0, 9), 9);
+        break;
+
+    case OP_LDR:
+    case OP_STR:
+        e->op = getopcode(word) == OP_LDR ? B_LDR : B_STR;
+        e->imm = sign_extend(getbits(word, 0, 6), 6);
+        break;
+
+    default:
+        e->op = B_ALONE;
+        break;
+    }
+}
+
+// Decode the word at pc for the lanes, and keep those that hold the word
+// of the first of them. The entry is kept if every lane holds the word,
+// otherwise it is decoded into scratch.
+static const entry_t* fetch(batch_t* batch, uint16_t pc, uint32_t* lanes,
+                            entry_t* scratch) {
+    uint16_t word = batch->memory[__builtin_ctz(*lanes)][pc];
+    uint32_t same = 0;
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->memory[i][pc] == word) {
+            same |= 1u << i;
+        }
+    }
+    *lanes &= same;
+    entry_t* e = same == batch->all ? &batch->code[pc] : scratch;
+    decode(e, pc, word);
+    e->epoch = batch->epoch;
+    return e;
+}
+
+// Take back a lane that ran on its own. If it may have written memory,
+// what was decoded may be stale.
+static void settle(batch_t* batch, int lane, uint64_t version) {
+    load_lane(batch, lane);
+    if (x16_version(batch->machines[lane]) != version) {
+        forget_code(batch);
+    }
+}
+
+// The lanes ended a basic block: stop those asked to
+static inline void end_block(batch_t* batch, uint32_t lanes) {
+    batch->ended |= lanes & batch->stopping;
+}
+
+// Run one instruction on each of the lanes on its own. Whatever the fast
+// engine runs here ends a block.
+static void step_lanes(batch_t* batch, uint32_t lanes) {
+    for (uint32_t bits = lanes; bits != 0; bits &= bits - 1) {
+        int lane = __builtin_ctz(bits);
+        x16_t* machine = batch->machines[lane];
+        uint64_t version = x16_version(machine);
+        store_lane(batch, lane);
+        if (fast_step(batch->engine, machine) == -1) {
+            batch->halted |= 1u << lane;
+            batch->ended |= 1u << lane;
+        }
+        settle(batch, lane, version);
+    }
+    end_block(batch, lanes);
+}
+
+// End the block of a control transfer, taking keyboard interrupts on the
+// lanes that enabled them. Lanes in idle branch to themselves.
+static void poll(batch_t* batch, uint32_t lanes, uint32_t idle) {
+    for (uint32_t bits = lanes & batch->polling; bits != 0;
+         bits &= bits - 1) {
+        int lane = __builtin_ctz(bits);
+        x16_t* machine = batch->machines[lane];
+        uint64_t version = x16_version(machine);
+        store_lane(batch, lane);
+        x16_interrupt(machine, idle & (1u << lane));
+        settle(batch, lane, version);
+    }
+    end_block(batch, lanes);
+}
+
+// Run the lanes on their own for a while, until they end
+static void run_apart(batch_t* batch, uint32_t lanes, uint32_t budget) {
+    for (; lanes != 0; lanes &= lanes - 1) {
+        int lane = __builtin_ctz(lanes);
+        x16_t* machine = batch->machines[lane];
+        uint64_t version = x16_version(machine);
+        store_lane(batch, lane);
+        uint32_t ran = 0;
+        int count;
+        while (!(batch->ended & (1u << lane)) && ran < SOLO_STEPS
+               && batch->steps[lane] < budget) {
+            uint32_t limit = SOLO_STEPS - ran;
+            if (budget - batch->steps[lane] < limit) {
+                limit = budget - batch->steps[lane];
+            }
+            if (fast_run(batch->engine, machine, limit, &count) == -1) {
+                batch->halted |= 1u << lane;
+                batch->ended |= 1u << lane;
+            }
+            ran += count;
+            batch->steps[lane] += count;
+            if (count < (int) limit) {
+                // Stopped early, so at the end of a block
+                end_block(batch, 1u << lane);
+            } else if (batch->stopping & (1u << lane)) {
+                // The batch finds where the block ends
+                break;
+            }
+        }
+        settle(batch, lane, version);
+    }
+}
+
+// Read the memory of a lane, going through x16_memread only for pages
+// with flags set
+static inline uint16_t load(batch_t* batch, int lane, uint16_t address) {
+    if (batch->pages[lane][address >> PAGE_SHIFT] != 0) {
+        return x16_memread(batch->machines[lane], address);
+    }
+    return batch->memory[lane][address];
+}
+
+// Load for each lane from its address
+static inline lanes_t load_lanes(batch_t* batch, uint32_t lanes,
+                                 lanes_t addresses) {
+    lanes_t values = {};
+    for (; lanes != 0; lanes &= lanes - 1) {
+        int lane = __builtin_ctz(lanes);
+        values[lane] = load(batch, lane, addresses[lane]);
+    }
+    return values;
+}
+
+// Store the value of each lane at its address, dropping what was decoded
+// there
+static inline void store_lanes(batch_t* batch, uint32_t lanes,
+                               lanes_t addresses, lanes_t values) {
+    for (; lanes != 0; lanes &= lanes - 1) {
+        int lane = __builtin_ctz(lanes);
+        uint16_t address = addresses[lane];
+        x16_memwrite(batch->machines[lane], address, values[lane]);
+        batch->code[address].epoch = 0;
+        if (address >> PAGE_SHIFT == MR_KBSR >> PAGE_SHIFT) {
+            watch_keyboard(batch, lane);
+        }
+    }
+}
+
+// Run the lanes of group, which are at pc, together to the end of the
+// basic block, or for quota instructions. Live lanes waiting further down
+// the block join in as it passes them. The pc of the group is written
+// only where it leaves the block. Return what is left of the quota.
+static uint32_t run_group(batch_t* batch, uint16_t pc, mask_t group,
+                          mask_t live_mask, uint32_t quota) {
+    lanes_t* reg = batch->reg;
+    uint32_t lanes = bits_of(group);
+    entry_t scratch;
+    lanes_t result;
+
+    while (quota > 0) {
+        quota--;
+        if (pc >= MMIO_BASE) {
+            // Executing device registers, let the interpreter fetch
+            reg[R_PC] = blend(reg[R_PC], splat(pc), group);
+            step_lanes(batch, lanes);
+            batch->ran -= (lanes_t) group;
+            return quota;
+        }
+        const entry_t* e = &batch->code[pc];
+        if (e->epoch != batch->epoch) {
+            reg[R_PC] = blend(reg[R_PC], splat(pc), group);
+            e = fetch(batch, pc, &lanes, &scratch);
+            group = mask_of(lanes);
+        }
+        uint16_t next = pc + 1;
+        batch->ran -= (lanes_t) group;
+
+        switch (e->op) {
+        case B_ADD_REG:
+            result = reg[e->b] + reg[e->c];
+            break;
+        case B_ADD_IMM:
+            result = reg[e->b] + e->imm;
+            break;
+        case B_AND_REG:
+            result = reg[e->b] & reg[e->c];
+            break;
+        case B_AND_IMM:
+            result = reg[e->b] & e->imm;
+            break;
+        case B_NOT:
+            result = ~reg[e->b];
+            break;
+        case B_LEA:
+            result = splat(e->imm);
+            break;
+        case B_LD:
+            result = load_lanes(batch, lanes, splat(e->imm));
+            break;
+        case B_LDI:
+            result = load_lanes(batch, lanes,
+                                load_lanes(batch, lanes, splat(e->imm)));
+            break;
+        case B_LDR:
+            result = load_lanes(batch, lanes, reg[e->b] + e->imm);
+            break;
+        case B_ST:
+            store_lanes(batch, lanes, splat(e->imm), reg[e->a]);
+            goto stored;
+        case B_STI:
+            store_lanes(batch, lanes, load_lanes(batch, lanes, splat(e->imm)),
+                        reg[e->a]);
+            goto stored;
+        case B_STR:
+            store_lanes(batch, lanes, reg[e->b] + e->imm, reg[e->a]);
+            goto stored;
+        case B_BR: {
+            mask_t taken = ((reg[R_COND] & e->c) != 0) & group;
+            reg[R_PC] = blend(reg[R_PC], blend(splat(next), splat(e->imm),
+                                               taken), group);
+            // A branch to itself idles until an interrupt
+            poll(batch, lanes, e->imm == pc ? bits_of(taken) : 0);
+            return quota;
+        }
+        case B_JMP:
+            reg[R_PC] = blend(reg[R_PC], reg[e->b], group);
+            poll(batch, lanes, 0);
+            return quota;
+        case B_JSR:
+            reg[R_R7] = blend(reg[R_R7], splat(next), group);
+            reg[R_PC] = blend(reg[R_PC], splat(e->imm), group);
+            poll(batch, lanes, 0);
+            return quota;
+        case B_JSRR:
+            // The return address is written before the base is read
+            reg[R_R7] = blend(reg[R_R7], splat(next), group);
+            reg[R_PC] = blend(reg[R_PC], reg[e->b], group);
+            poll(batch, lanes, 0);
+            return quota;
+        default:
+            // Traps and whatever the fast engine leaves to the interpreter
+            reg[R_PC] = blend(reg[R_PC], splat(pc), group);
+            step_lanes(batch, lanes);
+            return quota;
+        }
+        reg[e->a] = blend(reg[e->a], result, group);
+        reg[R_COND] = blend(reg[R_COND], condition(result), group);
+
+    stored:
+        pc = next;
+        group |= (reg[R_PC] == splat(pc)) & live_mask;
+        lanes = bits_of(group);
+    }
+    reg[R_PC] = blend(reg[R_PC], splat(pc), group);
+    return 0;
+}
+
+// Run the live lanes for up to quota instructions each, a group at a time,
+// until one of them ends
+static void run_lanes(batch_t* batch, uint32_t live, uint32_t quota) {
+    mask_t live_mask = mask_of(live);
+    while (quota > 0 && (batch->ended & live) == 0) {
+        // The lanes at the lowest pc go next
+        uint16_t pc = lowest(blend(splat(0xffff), batch->reg[R_PC],
+                                   live_mask));
+        mask_t group = (batch->reg[R_PC] == splat(pc)) & live_mask;
+        quota = run_group(batch, pc, group, live_mask, quota);
+    }
+}
+
+// Run the lanes until one of them ends
+int batch_run(batch_t* batch, uint32_t budget) {
+    for (;;) {
+        count_steps(batch);
+        batch->ended |= batch->all & bits_of(__builtin_convertvector(
+            batch->steps >= budget, mask_t));
+        uint32_t unreported = batch->ended & ~batch->reported;
+        uint32_t live = batch->all & ~batch->ended;
+        if (unreported != 0 || live == 0) {
+            for (int i = 0; i < batch->count; i++) {
+                store_lane(batch, i);
+            }
+            if (unreported == 0) {
+                return -1;
+            }
+            batch->reported |= unreported & -unreported;
+            return __builtin_ctz(unreported);
+        }
+
+        // No lane may pass the budget, nor run more between counts than
+        // the lanes of ran hold
+        uint32_t quota = UINT16_MAX;
+        for (uint32_t bits = live; bits != 0; bits &= bits - 1) {
+            int lane = __builtin_ctz(bits);
+            if (budget - batch->steps[lane] < quota) {
+                quota = budget - batch->steps[lane];
+            }
+        }
+        if ((live & (live - 1)) == 0) {
+            // A lane left alone runs faster on the fast engine
+            run_apart(batch, live, budget);
+        } else {
+            run_lanes(batch, live, quota);
+        }
+    }
+}
+
+// Start an ended lane again from the state of its machine
+void batch_restart(batch_t* batch, int lane) {
+    uint32_t bit = 1u << lane;
+    batch->steps[lane] = 0;
+    batch->ended &= ~bit;
+    batch->reported &= ~bit;
+    batch->halted &= ~bit;
+    batch->stopping &= ~bit;
+    load_lane(batch, lane);
+    forget_code(batch);
+}
+
+// Stop a lane at the end of the basic block it is running
+void batch_stop(batch_t* batch, int lane) {
+    batch->stopping |= 1u << lane;
+}
+
+// Instructions a lane ran since it started
+uint32_t batch_steps(batch_t* batch, int lane) {
+    return batch->steps[lane];
+}
+
+// True if a lane ended by running HALT
+bool batch_halted(batch_t* batch, int lane) {
+    return batch->halted & (1u << lane);
+}
@@ -0,0 +1,60 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "x16.h"
+
+// Machines a batch runs side by side, one per 16 bit lane of the widest
+// vectors the target surely has: 256 bits with AVX2, else 128 bits
+#ifdef __AVX2__
+#define BATCH_LANES     16
+#else
+#define BATCH_LANES     8
+#endif
+
+// The batched engine runs up to BATCH_LANES machines that hold the same
+// program, typically with different input. Registers R0-R7, PC and COND
+// live in vectors with one lane per machine. The lanes at the lowest PC,
+// which is where lanes that went separate ways meet again, run the basic
+// block there together under a mask, picking up lanes that wait further
+// down the block. ALU operations and control transfers are vector
+// operations; loads and stores go lane by lane to the memory of each
+// machine; traps and whatever else the fast engine leaves to the
+// interpreter run lane by lane. A lane left running alone runs on the
+// fast engine, which is quicker for one machine.
+//
+// Each lane runs as it would on the fast engine, instruction for
+// instruction, and ends where the fast engine would return: at HALT, at
+// the end of the block in which it was stopped, or once it has run the
+// budget. Watchpoints and breakpoints are not checked.
+typedef struct batch batch_t;
+
+// Create a batch over count machines, at most BATCH_LANES, with each lane
+// starting from the state of its machine. The machines must outlive the
+// batch, and change between runs only to restart their lane.
+batch_t* batch_create(x16_t** machines, int count);
+
+// Free the batch, but not its machines
+void batch_free(batch_t* batch);
+
+// Run the lanes until one of them ends. Return that lane, or -1 once no
+// lane is left running. Each end is returned once, and the machines hold
+// the state of their lanes whenever this returns.
+int batch_run(batch_t* batch, uint32_t budget);
+
+// Start an ended lane again from the state of its machine, for instance
+// after resetting it to run another input. Its steps count from zero.
+void batch_restart(batch_t* batch, int lane);
+
+// Stop a lane at the end of the basic block it is running. Meant for the
+// console hooks of its machine, for instance once its input is exhausted.
+void batch_stop(batch_t* batch, int lane);
+
+// Instructions a lane ran since it started
+uint32_t batch_steps(batch_t* batch, int lane);
+
+// True if a lane ended by running HALT
+bool batch_halted(batch_t* batch, int lane);
+
+#endif  // BATCH_H_
@@ -0,0 +1,558 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "cfg.h"
+#include "disasm.h"
+#include "instruction.h"
+
+// Room for a made up label, like sub_3000
+#define NAME_SIZE 12
+
+// Words of memory
+#define MEMORY_WORDS 0x10000u
+
+// Data words on each .fill line of a listing
+#define FILL_WORDS 8
+
+// Find the address a pc relative instruction points at. Return false for
+// an instruction without one. The address may be outside memory, since
+// offsets do not wrap around in xas.
+static bool pc_target(uint16_t address, uint16_t word, long* target) {
+    switch (getopcode(word)) {
+    case OP_BR:
+    case OP_LD:
+    case OP_LDI:
+    case OP_ST:
+    case OP_STI:
+    case OP_LEA:
+        *target = address + 1L + (int16_t) sign_extend(getbits(word, 0, 9), 9);
+        return true;
+    case OP_JSR:
+        *target = address + 1L
+            + (int16_t) sign_extend(getbits(word, 0, 11), 11);
+        return getbit(word, 11) == 1;
+    default:
+        *target = -1;
+        return false;
+    }
+}
+
+// Whether control can go on to the next word after the instruction
+static bool falls_through(uint16_t word) {
+    switch (getopcode(word)) {
+    case OP_BR:
+        return getbits(word, 9, 3) != (FL_NEG | FL_ZRO | FL_POS);
+    case OP_JMP:
+    case OP_RTI:
+        return false;
+    case OP_CAS:
+        // Other encodings are illegal and raise an exception
+        return getbits(word, 3, 3) == 0;
+    case OP_TRAP:
+        return getbits(word, 0, 8) != TRAP_HALT;
+    default:
+        return true;
+    }
+}
+
+// Whether the instruction ends a basic block: it branches, calls or
+// stops. A br without conditions never branches.
+static bool ends_block(uint16_t word) {
+    switch (getopcode(word)) {
+    case OP_BR:
+        return getbits(word, 9, 3) != 0;
+    case OP_JSR:
+        return true;
+    default:
+        return !falls_through(word);
+    }
+}
+
+// Whether xas assembles the text disassemble gives for the word back into
+// the same word. Bits the instruction ignores must be as xas sets them.
+static bool canonical(uint16_t word) {
+    switch (getopcode(word)) {
+    case OP_ADD:
+    case OP_AND:
+        return getimmediate(word) == 1 || getbits(word, 3, 2) == 0;
+    case OP_NOT:
+        return getbits(word, 0, 6) == 0x3f;
+    case OP_JMP:
+        return (word & 0x0e3f) == 0;
+    case OP_JSR:
+        return getbit(word, 11) == 1 || (word & 0x063f) == 0;
+    case OP_TRAP:
+        return getbits(word, 8, 4) == 0;
+    case OP_RTI:
+        return word == emit_rti();
+    case OP_CAS:
+        return getbits(word, 3, 3) == 0;
+    default:
+        return true;
+    }
+}
+
+static bool in_image(const cfg_t* cfg, long address) {
+    return address >= cfg->origin && address < cfg->origin + (long) cfg->count
+        && (cfg->flags[address - cfg->origin] & CFG_PRESENT);
+}
+
+// Mark a word with flags and queue it if control reaches it for the
+// first time
+static void reach(cfg_t* cfg, uint16_t* queue, uint32_t* queued,
+                  long address, uint8_t flags) {
+    if (!in_image(cfg, address)) {
+        return;
+    }
+    uint8_t* f = &cfg->flags[address - cfg->origin];
+    *f |= flags;
+    if (!(*f & CFG_CODE)) {
+        *f |= CFG_CODE;
+        queue[(*queued)++] = address;
+    }
+}
+
+// Follow control flow from the entry and mark code, leaders, entries and
+// the words operands point at
+static void find_code(cfg_t* cfg) {
+    uint16_t* queue = (uint16_t*) malloc((cfg->count + 1) * sizeof(uint16_t));
+    uint32_t queued = 0;
+    reach(cfg, queue, &queued, cfg->entry, CFG_ENTRY | CFG_LEADER);
+    while (queued > 0) {
+        uint16_t address = queue[--queued];
+        uint16_t word = cfg->words[address - cfg->origin];
+        long target;
+        if (pc_target(address, word, &target)) {
+            if (in_image(cfg, target)) {
+                cfg->flags[target - cfg->origin] |= CFG_TARGET;
+            }
+            if (getopcode(word) == OP_JSR) {
+                reach(cfg, queue, &queued, target, CFG_ENTRY | CFG_LEADER);
+            } else if (getopcode(word) != OP_BR) {
+                if (in_image(cfg, target)) {
+                    cfg->flags[target - cfg->origin] |= CFG_DATA;
+                }
+            } else if (getbits(word, 9, 3) != 0) {
+                reach(cfg, queue, &queued, target, CFG_LEADER);
+            }
+        }
+        if (falls_through(word)) {
+            reach(cfg, queue, &queued, address + 1L,
+                  ends_block(word) ? CFG_LEADER : 0);
+        }
+    }
+    free(queue);
+}
+
+// Block of a code word, or CFG_NONE
+static int block_at(const cfg_t* cfg, long address) {
+    if (!in_image(cfg, address)
+        || !(cfg->flags[address - cfg->origin] & CFG_CODE)) {
+        return CFG_NONE;
+    }
+    return cfg->block_of[address - cfg->origin];
+}
+
+// Split the code into basic blocks and link each to the blocks after it
+static void find_blocks(cfg_t* cfg) {
+    cfg->blocks = (cfg_block_t*) calloc(cfg->count + 1, sizeof(cfg_block_t));
+    for (uint32_t i = 0; i < cfg->count; i++) {
+        if (!(cfg->flags[i] & CFG_CODE)) {
+            continue;
+        }
+        if (i == 0 || !(cfg->flags[i - 1] & CFG_CODE)
+            || ends_block(cfg->words[i - 1])) {
+            cfg->flags[i] |= CFG_LEADER;
+        }
+        if (cfg->flags[i] & CFG_LEADER) {
+            cfg_block_t* block = &cfg->blocks[cfg->block_count++];
+            block->start = cfg->origin + i;
+            block->function = CFG_NONE;
+            block->call = CFG_NONE;
+        }
+        cfg->blocks[cfg->block_count - 1].count++;
+        cfg->block_of[i] = cfg->block_count - 1;
+    }
+
+    for (int i = 0; i < cfg->block_count; i++) {
+        cfg_block_t* block = &cfg->blocks[i];
+        uint16_t last = block->start + block->count - 1;
+        uint16_t word = cfg->words[last - cfg->origin];
+        long target;
+        bool relative = pc_target(last, word, &target);
+        block->taken = relative && getopcode(word) == OP_BR
+            ? block_at(cfg, target) : CFG_NONE;
+        block->next = falls_through(word) ? block_at(cfg, last + 1L)
+                                          : CFG_NONE;
+    }
+}
+
+// Function with the entry, by binary search since entries are in order
+static int function_at(const cfg_t* cfg, long entry) {
+    int low = 0;
+    int high = cfg->function_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (cfg->functions[middle].entry < entry) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < cfg->function_count && cfg->functions[low].entry == entry) {
+        return low;
+    }
+    return CFG_NONE;
+}
+
+// Give each block to the first function that reaches it without calls,
+// and mark back edges found by a depth first walk of each function
+static void find_functions(cfg_t* cfg) {
+    cfg->functions = (cfg_function_t*) calloc(cfg->count + 1,
+                                              sizeof(cfg_function_t));
+    for (uint32_t i = 0; i < cfg->count; i++) {
+        if (cfg->flags[i] & CFG_ENTRY) {
+            cfg_function_t* function = &cfg->functions[cfg->function_count++];
+            function->entry = cfg->origin + i;
+            function->block = cfg->block_of[i];
+        }
+    }
+
+    // 0 not seen, 1 on the walk, 2 done. The stack holds a block and how
+    // many of its edges have been followed.
+    uint8_t* state = (uint8_t*) calloc(cfg->block_count + 1, 1);
+    int* stack = (int*) malloc((cfg->block_count + 1) * 2 * sizeof(int));
+    for (int f = 0; f < cfg->function_count; f++) {
+        int root = cfg->functions[f].block;
+        if (state[root] != 0) {
+            continue;
+        }
+        state[root] = 1;
+        cfg->blocks[root].function = f;
+        stack[0] = root;
+        stack[1] = 0;
+        int depth = 1;
+        while (depth > 0) {
+            int b = stack[2 * (depth - 1)];
+            int edge = stack[2 * (depth - 1) + 1]++;
+            cfg_block_t* block = &cfg->blocks[b];
+            if (edge > 1) {
+                state[b] = 2;
+                depth--;
+                continue;
+            }
+            int to = edge == 0 ? block->taken : block->next;
+            if (to == CFG_NONE) {
+                continue;
+            }
+            if (state[to] == 1) {
+                *(edge == 0 ? &block->taken_back : &block->next_back) = true;
+                cfg->flags[cfg->blocks[to].start - cfg->origin] |= CFG_LOOP;
+            } else if (state[to] == 0 && cfg->blocks[to].function == CFG_NONE
+                       && !(cfg->flags[cfg->blocks[to].start - cfg->origin]
+                            & CFG_ENTRY)) {
+                state[to] = 1;
+                cfg->blocks[to].function = f;
+                stack[2 * depth] = to;
+                stack[2 * depth + 1] = 0;
+                depth++;
+            }
+        }
+    }
+    free(stack);
+    free(state);
+
+    for (int i = 0; i < cfg->block_count; i++) {
+        cfg_block_t* block = &cfg->blocks[i];
+        uint16_t last = block->start + block->count - 1;
+        uint16_t word = cfg->words[last - cfg->origin];
+        long target;
+        if (getopcode(word) == OP_JSR && pc_target(last, word, &target)) {
+            block->call = function_at(cfg, target);
+        }
+    }
+}
+
+// Label each word that needs one, from the map or the exported labels if
+// they name the word
+static void find_labels(cfg_t* cfg, const debugmap_t* map) {
+    const image_t* image = cfg->image;
+    for (int i = 0; i < image->symbol_count; i++) {
+        uint16_t address = image->symbols[i].address;
+        if (in_image(cfg, address) && !cfg->labels[address - cfg->origin]) {
+            cfg->labels[address - cfg->origin] = image->symbols[i].name;
+        }
+    }
+
+    cfg->names = (char*) malloc((size_t) cfg->count * NAME_SIZE + 1);
+    for (uint32_t i = 0; i < cfg->count; i++) {
+        uint16_t address = cfg->origin + i;
+        const debugmap_symbol_t* symbol = map ? debugmap_symbol(map, address)
+                                              : NULL;
+        char* name = cfg->names + (size_t) i * NAME_SIZE;
+        if (!(cfg->flags[i] & CFG_PRESENT)) {
+            continue;
+        } else if (symbol != NULL && symbol->address == address) {
+            cfg->labels[i] = symbol->name;
+        } else if (cfg->labels[i] != NULL) {
+            continue;
+        } else if (address == cfg->entry) {
+            cfg->labels[i] = strcpy(name, "start");
+        } else if (cfg->flags[i] & CFG_ENTRY) {
+            snprintf(name, NAME_SIZE, "sub_%04x", address);
+            cfg->labels[i] = name;
+        } else if ((cfg->flags[i] & CFG_TARGET)
+                   && !(cfg->flags[i] & CFG_CODE)) {
+            snprintf(name, NAME_SIZE, "D_%04x", address);
+            cfg->labels[i] = name;
+        } else if (cfg->flags[i] & (CFG_TARGET | CFG_LEADER)) {
+            snprintf(name, NAME_SIZE, "L_%04x", address);
+            cfg->labels[i] = name;
+        }
+    }
+}
+
+// Words of a segment that fit in memory
+static uint32_t segment_words(const image_segment_t* segment) {
+    uint32_t room = MEMORY_WORDS - segment->origin;
+    return segment->count < room ? segment->count : room;
+}
+
+// Analyze an image
+void cfg_build(cfg_t* cfg, const image_t* image, const debugmap_t* map) {
+    memset(cfg, 0, sizeof(cfg_t));
+    cfg->image = image;
+
+    // The segments go in one span of memory, with the gaps marked absent
+    uint32_t low = MEMORY_WORDS;
+    uint32_t high = 0;
+    for (int i = 0; i < image->segment_count; i++) {
+        const image_segment_t* segment = &image->segments[i];
+        if (segment_words(segment) > 0) {
+            low = segment->origin < low ? segment->origin : low;
+            if (segment->origin + segment_words(segment) > high) {
+                high = segment->origin + segment_words(segment);
+            }
+        }
+    }
+    if (high == 0) {
+        low = image->segment_count > 0 ? image->segments[0].origin : 0;
+        high = low;
+    }
+    cfg->origin = low;
+    cfg->count = high - low;
+    cfg->words = (uint16_t*) calloc(cfg->count + 1, sizeof(uint16_t));
+    cfg->flags = (uint8_t*) calloc(cfg->count + 1, 1);
+    cfg->labels = (const char**) calloc(cfg->count + 1, sizeof(char*));
+    cfg->block_of = (int*) calloc(cfg->count + 1, sizeof(int));
+    for (int i = 0; i < image->segment_count; i++) {
+        const image_segment_t* segment = &image->segments[i];
+        uint32_t offset = segment->origin - low;
+        memcpy(cfg->words + offset, segment->words,
+               segment_words(segment) * sizeof(uint16_t));
+        memset(cfg->flags + offset, CFG_PRESENT, segment_words(segment));
+    }
+    cfg->entry = image->has_entry ? image->entry : cfg->origin;
+    if (cfg->count == 0) {
+        return;
+    }
+    find_code(cfg);
+    find_blocks(cfg);
+    find_functions(cfg);
+    find_labels(cfg, map);
+}
+
+// Free what cfg_build allocated
+void cfg_free(cfg_t* cfg) {
+    free(cfg->words);
+    free(cfg->flags);
+    free(cfg->labels);
+    free(cfg->names);
+    free(cfg->block_of);
+    free(cfg->blocks);
+    free(cfg->functions);
+    memset(cfg, 0, sizeof(cfg_t));
+}
+
+// Write the text of a code word as xas takes it, with a label for the
+// address a pc relative operand points at. A word xas would not assemble
+// back the same is written as .fill with its text as a comment.
+static void format_code(const cfg_t* cfg, uint16_t address, char* out,
+                        size_t size) {
+    uint16_t word = cfg->words[address - cfg->origin];
+    char text[DISASM_MAX];
+    disassemble(word, text);
+    long target;
+    bool relative = pc_target(address, word, &target);
+    if (!canonical(word) || (relative && (target < 0 || target > 0xffff))) {
+        snprintf(out, size, ".fill  0x%04x              # %s", word, text);
+    } else if (getopcode(word) == OP_TRAP && strcmp(text, "-") == 0) {
+        snprintf(out, size, "trap   $%d", getbits(word, 0, 8));
+    } else if (relative) {
+        // The offset is the last operand
+        *strrchr(text, '$') = '\0';
+        if (in_image(cfg, target) && cfg->labels[target - cfg->origin]) {
+            snprintf(out, size, "%s%s", text,
+                     cfg->labels[target - cfg->origin]);
+        } else {
+            snprintf(out, size, "%s0x%04lx", text, target);
+        }
+    } else {
+        snprintf(out, size, "%s", text);
+    }
+}
+
+// Names of the functions a function calls, each once
+static void write_callees(const cfg_t* cfg, int function, FILE* fp) {
+    const char* separator = "# calls ";
+    for (int i = 0; i < cfg->block_count; i++) {
+        const cfg_block_t* block = &cfg->blocks[i];
+        if (block->function != function || block->call == CFG_NONE) {
+            continue;
+        }
+        bool seen = false;
+        for (int j = 0; j < i && !seen; j++) {
+            seen = cfg->blocks[j].function == function
+                && cfg->blocks[j].call == block->call;
+        }
+        if (!seen) {
+            uint16_t entry = cfg->functions[block->call].entry;
+            fprintf(fp, "%s%s", separator, cfg->labels[entry - cfg->origin]);
+            separator = ", ";
+        }
+    }
+    if (strcmp(separator, ", ") == 0) {
+        fprintf(fp, "\n");
+    }
+}
+
+// Write a listing xas assembles back into the image
+void cfg_write_listing(const cfg_t* cfg, FILE* fp) {
+    fprintf(fp, "# %d functions, %d basic blocks\n", cfg->function_count,
+            cfg->block_count);
+    const image_t* image = cfg->image;
+    for (int i = 0; i < image->symbol_count; i++) {
+        uint16_t address = image->symbols[i].address;
+        if (in_image(cfg, address)
+            && cfg->labels[address - cfg->origin] == image->symbols[i].name) {
+            fprintf(fp, "        .global %s\n", image->symbols[i].name);
+        }
+    }
+    fprintf(fp, "        .orig  0x%04x\n", cfg->origin);
+    if (image->has_entry && in_image(cfg, cfg->entry)) {
+        fprintf(fp, "        .entry %s\n",
+                cfg->labels[cfg->entry - cfg->origin]);
+    } else if (image->has_entry) {
+        fprintf(fp, "        .entry 0x%04x\n", cfg->entry);
+    }
+    uint32_t i = 0;
+    while (i < cfg->count) {
+        uint16_t address = cfg->origin + i;
+        const char* label = cfg->labels[i];
+        if (!(cfg->flags[i] & CFG_PRESENT)) {
+            // A gap between segments
+            while (!(cfg->flags[i] & CFG_PRESENT)) {
+                i++;
+            }
+            fprintf(fp, "\n        .orig  0x%04x\n", cfg->origin + i);
+            continue;
+        }
+        if (cfg->flags[i] & CFG_ENTRY) {
+            fprintf(fp, "\n# function %s\n", label);
+            write_callees(cfg, function_at(cfg, address), fp);
+        } else if (label != NULL) {
+            fprintf(fp, "\n");
+        }
+        if (label != NULL) {
+            fprintf(fp, "%s:%s\n", label,
+                    cfg->flags[i] & CFG_LOOP ? "    # loop" : "");
+        }
+
+        if (cfg->flags[i] & CFG_CODE) {
+            char text[128];
+            format_code(cfg, address, text, sizeof(text));
+            fprintf(fp, "        %s\n", text);
+            i++;
+            continue;
+        }
+
+        // Data up to the next label or code
+        fprintf(fp, "        .fill  0x%04x", cfg->words[i]);
+        for (i++; i < cfg->count
+             && (cfg->flags[i] & (CFG_PRESENT | CFG_CODE)) == CFG_PRESENT
+             && cfg->labels[i] == NULL; i++) {
+            bool wrap = (i - (address - cfg->origin)) % FILL_WORDS == 0;
+            fprintf(fp, wrap ? "\n        .fill  0x%04x" : ", 0x%04x",
+                    cfg->words[i]);
+        }
+        fprintf(fp, "\n");
+    }
+}
+
+// Write text inside a Graphviz string
+static void write_escaped(FILE* fp, const char* text) {
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fputc('\\', fp);
+        }
+        fputc(*text, fp);
+    }
+}
+
+static void write_block(const cfg_t* cfg, int b, FILE* fp) {
+    const cfg_block_t* block = &cfg->blocks[b];
+    fprintf(fp, "    b%d [label=\"", b);
+    const char* label = cfg->labels[block->start - cfg->origin];
+    if (label != NULL) {
+        write_escaped(fp, label);
+        fprintf(fp, ":\\l");
+    }
+    for (int i = 0; i < block->count; i++) {
+        char text[128];
+        format_code(cfg, block->start + i, text, sizeof(text));
+        fprintf(fp, "0x%04x  ", block->start + i);
+        write_escaped(fp, text);
+        fprintf(fp, "\\l");
+    }
+    fprintf(fp, "\"%s];\n", cfg->flags[block->start - cfg->origin] & CFG_LOOP
+            ? ", color=red" : "");
+}
+
+// Write the blocks as a Graphviz digraph
+void cfg_write_dot(const cfg_t* cfg, FILE* fp) {
+    fprintf(fp, "digraph cfg {\n");
+    fprintf(fp, "    node [shape=box, fontname=\"monospace\"];\n");
+    for (int f = 0; f < cfg->function_count; f++) {
+        fprintf(fp, "    subgraph cluster_%d {\n    label=\"", f);
+        write_escaped(fp, cfg->labels[cfg->functions[f].entry - cfg->origin]);
+        fprintf(fp, "\";\n");
+        for (int b = 0; b < cfg->block_count; b++) {
+            if (cfg->blocks[b].function == f) {
+                write_block(cfg, b, fp);
+            }
+        }
+        fprintf(fp, "    }\n");
+    }
+    for (int b = 0; b < cfg->block_count; b++) {
+        if (cfg->blocks[b].function == CFG_NONE) {
+            write_block(cfg, b, fp);
+        }
+    }
+
+    for (int b = 0; b < cfg->block_count; b++) {
+        const cfg_block_t* block = &cfg->blocks[b];
+        if (block->taken != CFG_NONE) {
+            fprintf(fp, "    b%d -> b%d [label=\"taken\"%s];\n", b,
+                    block->taken, block->taken_back ? ", color=red" : "");
+        }
+        if (block->next != CFG_NONE) {
+            fprintf(fp, "    b%d -> b%d%s;\n", b, block->next,
+                    block->next_back ? " [color=red]" : "");
+        }
+        if (block->call != CFG_NONE) {
+            fprintf(fp, "    b%d -> b%d [style=dashed, label=\"call\"];\n",
+                    b, cfg->functions[block->call].block);
+        }
+    }
+    fprintf(fp, "}\n");
+}
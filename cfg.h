@@ -0,0 +1,82 @@
+#ifndef CFG_H_
+#define CFG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "debugmap.h"
+#include "image.h"
+
+// Control flow recovery for an image. Starting at the entry, it follows
+// branches, jsr calls and fall through to tell code from data, splits
+// the code into basic blocks, groups the blocks into functions, one for
+// the entry and one for each jsr target, and marks the targets of back
+// edges as loop headers. xod -a writes the result as a listing xas can
+// assemble back into the same image, and xod -c as a Graphviz graph.
+
+// What the analysis found out about a word
+enum {
+    CFG_CODE = 1 << 0,      // control flow reaches it
+    CFG_LEADER = 1 << 1,    // starts a basic block
+    CFG_TARGET = 1 << 2,    // a pc relative operand points at it
+    CFG_ENTRY = 1 << 3,     // the entry or the target of a jsr
+    CFG_DATA = 1 << 4,      // loaded, stored or its address taken
+    CFG_LOOP = 1 << 5,      // a back edge goes to it
+    CFG_PRESENT = 1 << 6,   // a segment of the image has it
+};
+
+// No block or function
+#define CFG_NONE (-1)
+
+typedef struct {
+    uint16_t start;         // address of the first word
+    uint16_t count;         // words in the block
+    int function;           // the first function that reaches the block
+    int taken;              // block a branch at the end goes to
+    int next;               // block after it, when it falls through or
+                            // a call returns
+    int call;               // function a jsr at the end calls
+    bool taken_back;        // the edges close a loop
+    bool next_back;
+} cfg_block_t;
+
+typedef struct {
+    uint16_t entry;
+    int block;              // block at the entry
+} cfg_function_t;
+
+typedef struct {
+    const image_t* image;
+    uint16_t origin;        // of the lowest segment
+    uint32_t count;         // words up to the end of the highest segment
+    uint16_t* words;        // the segments in place, zero in the gaps
+    uint16_t entry;         // where the analysis starts
+    uint8_t* flags;         // CFG_ flags of each word
+    const char** labels;    // label of each word, or NULL if it needs none
+    char* names;            // labels made up for words the map does not
+                            // name
+    int* block_of;          // block of each code word
+    cfg_block_t* blocks;
+    int block_count;
+    cfg_function_t* functions;
+    int function_count;
+} cfg_t;
+
+// Analyze an image, which must outlive the analysis. Labels come from the
+// map or the exported labels of the image where they name a word, and
+// are made up elsewhere; map may be NULL.
+void cfg_build(cfg_t* cfg, const image_t* image, const debugmap_t* map);
+
+// Free what cfg_build allocated
+void cfg_free(cfg_t* cfg);
+
+// Write a listing with labels in place of pc relative offsets, data as
+// .fill, .orig for each segment, and comments on functions, calls and
+// loops
+void cfg_write_listing(const cfg_t* cfg, FILE* fp);
+
+// Write the basic blocks as a Graphviz digraph, a cluster per function,
+// with calls dashed and back edges in red
+void cfg_write_dot(const cfg_t* cfg, FILE* fp);
+
+#endif  // CFG_H_
@@ -108,6 +108,8 @@ int execute_instruction(x16_t *machine)
             x16_set(machine, R_PC, x16_reg(machine, R_PC)
             + offsetSext);
         }
+        // A branch to itself idles until an interrupt
+        x16_interrupt(machine, branching && x16_pc(machine) == pc);
                 break;
     }
     case OP_JMP: {
@@ -119,6 +121,7 @@ int execute_instruction(x16_t *machine)
         } else {
             x16_set(machine, R_PC, x16_reg(machine, baseR));
         }
+        x16_interrupt(machine, false);
     }
     break;
     case OP_JSR: {
@@ -134,6 +137,7 @@ int execute_instruction(x16_t *machine)
             int16_t offsetSext = sign_extend(pcOffset11, 11);
             x16_set(machine, R_PC, x16_pc(machine) + offsetSext);
         }
+        x16_interrupt(machine, false);
     }
     break;
     case OP_LD: {
@@ -216,13 +220,43 @@ int execute_instruction(x16_t *machine)
     }
     break;
     case OP_TRAP:
+    {
             // Execute the trap
-            return trap(machine, instruction);
-    case OP_RES:
+            int rv = trap(machine, instruction);
+            if (rv == 0) {
+                x16_interrupt(machine, false);
+            }
+            return rv;
+    }
     case OP_RTI:
+            // Return from interrupt, a privilege violation in user mode
+            if (!x16_rti(machine)) {
+                abort();
+            }
+            x16_interrupt(machine, false);
+            break;
+    case OP_CAS:
+        if (getbits(instruction, 3, 3) == 0) {
+            // Swap in SR if the word at BaseR holds DR, which gets the
+            // old word. Z if it was swapped, P if not.
+            reg_t dst = getdr(instruction);
+            uint16_t expected = x16_reg(machine, dst);
+            bool swapped = x16_cas(machine,
+                                   x16_reg(machine, getsr1(instruction)),
+                                   &expected,
+                                   x16_reg(machine, getsr2(instruction)));
+            x16_set(machine, dst, expected);
+            x16_set(machine, R_COND, swapped ? FL_ZRO : FL_POS);
+            break;
+        }
+        // Other encodings are reserved
+        // fall through
     default:
-            // Bad codes, never used
-            abort();
+            // Reserved, handled by the OS if it installed a handler
+            if (!x16_exception(machine, VECTOR_ILLEGAL)) {
+                abort();
+            }
+            break;
     }
     return 0;
 }
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include "debug.h"
+#include "debugmap.h"
+#include "disasm.h"
+#include "fast.h"
+#include "history.h"
+#include "instruction.h"
+#include "io.h"
+#include "snapshot.h"
+#include "x16.h"
+
+#define MAX_COMMAND 256
+
+// Set by SIGINT to return from a running guest to the prompt
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_interrupt(int signal) {
+    interrupted = 1;
+}
+
+static const char* register_names[] = {
+    "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND",
+    "PSR", "SSP", "USP"
+};
+
+static void help() {
+    printf("ADDR is a number in decimal or 0x hex, or a label from the debug "
+           "map\n"
+           "b ADDR          set a breakpoint\n"
+           "d ADDR          delete a breakpoint\n"
+           "w ADDR [r|w|rw] watch memory, writes by default\n"
+           "u ADDR          remove a watchpoint\n"
+           "s [N]           step N instructions\n"
+           "c               continue\n"
+           "rs [N]          step N instructions backwards\n"
+           "rw ADDR         go back to the last write of ADDR\n"
+           "r               show registers\n"
+           "x ADDR [N]      examine N words of memory\n"
+           "save FILE       save a snapshot to resume with x16 -R\n"
+           "l [ADDR] [N]    disassemble N instructions\n"
+           "q               quit\n"
+           "An empty line repeats the last command.\n");
+}
+
+// Parse an address in decimal or 0x hex. Return false if malformed
+static bool parse_number(const char* text, long* value) {
+    char* end;
+    if (text == NULL) {
+        return false;
+    }
+    *value = strtol(text, &end, 0);
+    return *end == '\0' && *value >= 0 && *value < MAX_MEMORY;
+}
+
+// Parse an address, which may also be a label of the debug map
+static bool parse_address(const debugmap_t* map, const char* text,
+                          long* value) {
+    uint16_t address;
+    if (parse_number(text, value)) {
+        return true;
+    }
+    if (text != NULL && map != NULL && debugmap_find(map, text, &address)) {
+        *value = address;
+        return true;
+    }
+    return false;
+}
+
+static void print_registers(x16_t* machine) {
+    for (int i = 0; i < MAX_REGISTERS; i++) {
+        printf("%-4s 0x%04x%s", register_names[i], x16_reg(machine, i),
+               i % 5 == 4 ? "\n" : "   ");
+    }
+    printf("%-4s 0x%04x   %-4s 0x%04x   %-4s 0x%04x\n",
+           register_names[R_PSR], x16_psr(machine),
+           register_names[R_SAVED_SSP], x16_reg(machine, R_SAVED_SSP),
+           register_names[R_SAVED_USP], x16_reg(machine, R_SAVED_USP));
+}
+
+// Print memory without going through the device registers
+static void print_memory(x16_t* machine, uint16_t address, int count) {
+    for (int i = 0; i < count; i++) {
+        uint16_t at = address + i;
+        if (i % 8 == 0) {
+            printf("0x%04x:", at);
+        }
+        printf(" %04x", *x16_memory(machine, at));
+        if (i % 8 == 7 || i == count - 1) {
+            printf("\n");
+        }
+    }
+}
+
+// Print one instruction the way xod lists it, with its label if the
+// debug map has one
+static void list_instruction(x16_t* machine, fast_t* engine,
+                             const debugmap_t* map, uint16_t address) {
+    uint16_t instruction = *x16_memory(machine, address);
+    char* text = decode(instruction);
+    char symbol[MAX_COMMAND];
+    debugmap_format(map, address, symbol, sizeof(symbol));
+    printf("%s%c0x%04x%s%s: ", address == x16_pc(machine) ? "=>" : "  ",
+           fast_has_break(engine, address) ? '*' : ' ', address,
+           symbol[0] ? " " : "", symbol);
+    print_instruction(instruction);
+    printf(" : %s\n", text);
+    free(text);
+}
+
+// Execute one instruction, stepping over a breakpoint under the PC
+static int step(history_t* history) {
+    int count;
+    int rv = history_run(history, 1, &count);
+    if (rv == FAST_BREAK) {
+        rv = history_run(history, 1, &count);
+    }
+    return rv;
+}
+
+// Tell the user why the guest stopped
+static void report(x16_t* machine, fast_t* engine, const debugmap_t* map,
+                   history_t* history, int rv) {
+    uint16_t address;
+    int kind;
+    const char* file;
+    uint32_t line;
+    printf("[%llu] ", (unsigned long long) history_now(history));
+    if (rv == -1) {
+        printf("Program halted\n");
+        return;
+    }
+    if (x16_watch_hit(machine, &address, &kind)) {
+        printf("Watchpoint: 0x%04x %s, now 0x%04x\n", address,
+               kind == WATCH_READ ? "read" : "written",
+               *x16_memory(machine, address));
+    } else if (rv == FAST_BREAK) {
+        printf("Breakpoint at 0x%04x\n", x16_pc(machine));
+    } else if (interrupted) {
+        printf("Interrupted\n");
+    }
+    list_instruction(machine, engine, map, x16_pc(machine));
+    if (map != NULL && debugmap_line(map, x16_pc(machine), &file, &line)) {
+        printf("   at %s:%u\n", file, line);
+    }
+}
+
+// Run the guest with the terminal set up for it
+static int resume(x16_t* machine, history_t* history, long steps,
+                  bool forever) {
+    int count;
+    int rv = 0;
+    interrupted = 0;
+    disable_input_buffering();
+
+    // Continuing starts with a single step to get off a breakpoint
+    if (forever) {
+        steps = 1;
+    }
+    for (long i = 0; i < steps && rv == 0; i++) {
+        rv = step(history);
+        if (x16_watch_pending(machine) || interrupted) {
+            break;
+        }
+    }
+    while (forever && rv == 0 && !x16_watch_pending(machine) && !interrupted) {
+        rv = history_run(history, MAX_MEMORY, &count);
+    }
+    restore_input_buffering();
+    return rv;
+}
+
+// Save the pages written since the programs were loaded, and the
+// registers
+static void save(x16_t* machine, const char* path) {
+    snapshot_t snapshot;
+    snapshot_take(&snapshot, machine);
+    FILE* fp = fopen(path, "wb");
+    bool written = fp != NULL && snapshot_write(fp, &snapshot);
+    if (fp == NULL || fclose(fp) != 0 || !written) {
+        printf("Can't write %s\n", path);
+    } else {
+        printf("Saved %d pages\n", snapshot.page_count);
+    }
+    snapshot_free(&snapshot);
+}
+
+// Run the machine under the debugger
+int debug_run(x16_t* machine, const debugmap_t* map) {
+    fast_t* engine = fast_create();
+    history_t* history = history_create(machine, engine,
+                                        DEFAULT_CHECKPOINT_INTERVAL);
+    char line[MAX_COMMAND];
+    char last[MAX_COMMAND] = "";
+    bool halted = false;
+
+    signal(SIGINT, on_interrupt);
+    restore_input_buffering();
+    list_instruction(machine, engine, map, x16_pc(machine));
+
+    for (;;) {
+        printf("(x16) ");
+        fflush(stdout);
+        if (fgets(line, sizeof(line), stdin) == NULL) {
+            break;
+        }
+        if (strspn(line, " \t\n") == strlen(line)) {
+            snprintf(line, sizeof(line), "%s", last);
+        } else {
+            snprintf(last, sizeof(last), "%s", line);
+        }
+
+        char* command = strtok(line, " \t\n");
+        char* arg1 = strtok(NULL, " \t\n");
+        char* arg2 = strtok(NULL, " \t\n");
+        long address;
+        long count;
+        uint64_t when;
+        if (command == NULL) {
+            continue;
+        }
+
+        if (strcmp(command, "q") == 0) {
+            break;
+        } else if (strcmp(command, "h") == 0) {
+            help();
+        } else if (strcmp(command, "r") == 0) {
+            print_registers(machine);
+        } else if (strcmp(command, "b") == 0 || strcmp(command, "d") == 0) {
+            if (!parse_address(map, arg1, &address)) {
+                printf("Bad address\n");
+                continue;
+            }
+            fast_set_break(engine, address, command[0] == 'b');
+        } else if (strcmp(command, "w") == 0 || strcmp(command, "u") == 0) {
+            int kinds = WATCH_WRITE;
+            if (!parse_address(map, arg1, &address)) {
+                printf("Bad address\n");
+                continue;
+            }
+            if (command[0] == 'u') {
+                kinds = 0;
+            } else if (arg2 != NULL && strcmp(arg2, "r") == 0) {
+                kinds = WATCH_READ;
+            } else if (arg2 != NULL && strcmp(arg2, "rw") == 0) {
+                kinds = WATCH_READ | WATCH_WRITE;
+            }
+            x16_watch(machine, address, kinds);
+        } else if (strcmp(command, "x") == 0) {
+            if (!parse_address(map, arg1, &address)) {
+                printf("Bad address\n");
+                continue;
+            }
+            if (!parse_number(arg2, &count)) {
+                count = 8;
+            }
+            print_memory(machine, address, count);
+        } else if (strcmp(command, "l") == 0) {
+            if (!parse_address(map, arg1, &address)) {
+                address = x16_pc(machine);
+            }
+            if (!parse_number(arg2, &count)) {
+                count = 10;
+            }
+            for (long i = 0; i < count; i++) {
+                list_instruction(machine, engine, map, address + i);
+            }
+        } else if (strcmp(command, "s") == 0 || strcmp(command, "c") == 0) {
+            if (halted) {
+                printf("The program is not running\n");
+                continue;
+            }
+            if (!parse_number(arg1, &count)) {
+                count = 1;
+            }
+            int rv = resume(machine, history, count, command[0] == 'c');
+            halted = rv == -1;
+            report(machine, engine, map, history, rv);
+        } else if (strcmp(command, "rs") == 0) {
+            if (!parse_number(arg1, &count)) {
+                count = 1;
+            }
+            when = history_now(history);
+            when = when > (uint64_t) count ? when - count : 0;
+            if (!history_seek(history, when)) {
+                printf("Not recorded that far back\n");
+                continue;
+            }
+            halted = false;
+            report(machine, engine, map, history, 0);
+        } else if (strcmp(command, "rw") == 0) {
+            if (!parse_address(map, arg1, &address)) {
+                printf("Bad address\n");
+                continue;
+            }
+            if (!history_last_write(history, address, &when)
+                || !history_seek(history, when)) {
+                printf("No recorded write to 0x%04lx\n", address);
+                continue;
+            }
+            halted = false;
+            report(machine, engine, map, history, 0);
+        } else if (strcmp(command, "save") == 0) {
+            if (arg1 == NULL) {
+                printf("Save to which file?\n");
+                continue;
+            }
+            save(machine, arg1);
+        } else {
+            printf("Unknown command: %s (h for help)\n", command);
+        }
+    }
+
+    history_free(history);
+    fast_free(engine);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef DEBUG_H_
+#define DEBUG_H_
+
+#include "debugmap.h"
+#include "x16.h"
+
+// Run the machine under an interactive debugger that reads commands from
+// stdin. The guest runs on the fast engine; breakpoints are marked in its
+// decoded instructions and watchpoints in the page map of the machine.
+// With a debug map, which may be NULL, addresses are shown with labels
+// and source lines, and labels can be used as addresses.
+// Return 0 when the guest halts or the user quits.
+int debug_run(x16_t* machine, const debugmap_t* map);
+
+#endif  // DEBUG_H_
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "debugmap.h"
+
+// Words in the header
+#define HEADER_WORDS    10
+
+// Words in each kind of table entry
+#define FILE_WORDS      2
+#define LINE_WORDS      4
+#define SYMBOL_WORDS    3
+
+// Words of the tables after the header
+static size_t table_words(size_t files, size_t lines, size_t symbols) {
+    return FILE_WORDS * files + LINE_WORDS * lines + SYMBOL_WORDS * symbols;
+}
+
+// Copy a name into the string table and store its offset as 2 words
+static uint16_t* put_name(uint16_t* p, char* names, size_t* offset,
+                          const char* name) {
+    size_t length = strlen(name) + 1;
+    memcpy(names + *offset, name, length);
+    *p++ = htons(*offset >> 16);
+    *p++ = htons(*offset & 0xffff);
+    *offset += length;
+    return p;
+}
+
+// Write a map to a file in one go
+bool debugmap_write(FILE* fp, const debugmap_t* map) {
+    size_t strings = 0;
+    for (int i = 0; i < map->file_count; i++) {
+        strings += strlen(map->files[i]) + 1;
+    }
+    for (uint32_t i = 0; i < map->symbol_count; i++) {
+        strings += strlen(map->symbols[i].name) + 1;
+    }
+    strings = (strings + 1) & ~1;
+
+    size_t words = HEADER_WORDS + strings / 2
+        + table_words(map->file_count, map->line_count, map->symbol_count);
+    uint16_t* buffer = (uint16_t*) calloc(words, sizeof(uint16_t));
+    uint16_t* p = buffer;
+    *p++ = htons(DEBUGMAP_MAGIC_HI);
+    *p++ = htons(DEBUGMAP_MAGIC_LO);
+    *p++ = htons(DEBUGMAP_VERSION);
+    *p++ = htons(map->file_count);
+    *p++ = htons(map->line_count >> 16);
+    *p++ = htons(map->line_count & 0xffff);
+    *p++ = htons(map->symbol_count >> 16);
+    *p++ = htons(map->symbol_count & 0xffff);
+    *p++ = htons(strings >> 16);
+    *p++ = htons(strings & 0xffff);
+
+    char* names = (char*) (p + table_words(map->file_count, map->line_count,
+                                           map->symbol_count));
+    size_t offset = 0;
+    for (int i = 0; i < map->file_count; i++) {
+        p = put_name(p, names, &offset, map->files[i]);
+    }
+    for (uint32_t i = 0; i < map->line_count; i++) {
+        const debugmap_line_t* line = &map->lines[i];
+        *p++ = htons(line->address);
+        *p++ = htons(line->file);
+        *p++ = htons(line->line >> 16);
+        *p++ = htons(line->line & 0xffff);
+    }
+    for (uint32_t i = 0; i < map->symbol_count; i++) {
+        *p++ = htons(map->symbols[i].address);
+        p = put_name(p, names, &offset, map->symbols[i].name);
+    }
+
+    bool ok = fwrite(buffer, sizeof(uint16_t), words, fp) == words;
+    free(buffer);
+    return ok;
+}
+
+// Read a map file
+bool debugmap_read(const char* path, debugmap_t* map, const char** error) {
+    memset(map, 0, sizeof(debugmap_t));
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        *error = "cannot open file";
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint16_t* buffer = (uint16_t*) malloc(size + 1);
+    size_t words = fread(buffer, 1, size, fp) / 2;
+    fclose(fp);
+
+    for (size_t i = 0; i < words; i++) {
+        buffer[i] = ntohs(buffer[i]);
+    }
+    uint16_t* h = buffer;
+    if (words < HEADER_WORDS || h[0] != DEBUGMAP_MAGIC_HI
+        || h[1] != DEBUGMAP_MAGIC_LO) {
+        *error = "not a debug map";
+        free(buffer);
+        return false;
+    }
+    if (h[2] != DEBUGMAP_VERSION) {
+        *error = "unsupported debug map version";
+        free(buffer);
+        return false;
+    }
+    map->file_count = h[3];
+    map->line_count = (uint32_t) h[4] << 16 | h[5];
+    map->symbol_count = (uint32_t) h[6] << 16 | h[7];
+    size_t strings = (size_t) h[8] << 16 | h[9];
+    if (words != HEADER_WORDS + strings / 2 + table_words(map->file_count,
+                                                          map->line_count,
+                                                          map->symbol_count)
+        || strings % 2 != 0) {
+        *error = "truncated debug map";
+        free(buffer);
+        return false;
+    }
+
+    // The names were byte swapped along with everything else
+    uint16_t* p = buffer + HEADER_WORDS;
+    uint16_t* names = p + table_words(map->file_count, map->line_count,
+                                      map->symbol_count);
+    map->strings = (char*) malloc(strings + 1);
+    for (size_t i = 0; i < strings / 2; i++) {
+        uint16_t word = htons(names[i]);
+        memcpy(map->strings + 2 * i, &word, 2);
+    }
+    map->strings[strings] = '\0';
+
+    map->files = (const char**) calloc(map->file_count + 1, sizeof(char*));
+    map->lines = (debugmap_line_t*) calloc(map->line_count + 1,
+                                           sizeof(debugmap_line_t));
+    map->symbols = (debugmap_symbol_t*) calloc(map->symbol_count + 1,
+                                               sizeof(debugmap_symbol_t));
+    bool ok = true;
+    for (int i = 0; i < map->file_count; i++, p += FILE_WORDS) {
+        size_t name = (size_t) p[0] << 16 | p[1];
+        ok &= name < strings;
+        map->files[i] = map->strings + (name < strings ? name : 0);
+    }
+    for (uint32_t i = 0; i < map->line_count; i++, p += LINE_WORDS) {
+        debugmap_line_t* line = &map->lines[i];
+        line->address = p[0];
+        line->file = p[1];
+        line->line = (uint32_t) p[2] << 16 | p[3];
+        ok &= line->file < map->file_count || line->file == DEBUGMAP_NO_FILE;
+        ok &= i == 0 || line->address > map->lines[i - 1].address;
+    }
+    for (uint32_t i = 0; i < map->symbol_count; i++, p += SYMBOL_WORDS) {
+        size_t name = (size_t) p[1] << 16 | p[2];
+        map->symbols[i].address = p[0];
+        map->symbols[i].name = map->strings + (name < strings ? name : 0);
+        ok &= name < strings;
+        ok &= i == 0 || p[0] >= map->symbols[i - 1].address;
+    }
+
+    free(buffer);
+    if (!ok) {
+        *error = "malformed debug map";
+        debugmap_free(map);
+    }
+    return ok;
+}
+
+// Free a map filled in by debugmap_read or debugmap_merge
+void debugmap_free(debugmap_t* map) {
+    free(map->files);
+    free(map->lines);
+    free(map->symbols);
+    free(map->strings);
+    memset(map, 0, sizeof(debugmap_t));
+}
+
+// Order lines by address, putting the end of one map before a line of
+// the next map at the same address
+static int compare_lines(const void* a, const void* b) {
+    const debugmap_line_t* x = (const debugmap_line_t*) a;
+    const debugmap_line_t* y = (const debugmap_line_t*) b;
+    if (x->address != y->address) {
+        return (x->address > y->address) - (x->address < y->address);
+    }
+    return (y->file == DEBUGMAP_NO_FILE) - (x->file == DEBUGMAP_NO_FILE);
+}
+
+// Order symbols by address
+static int compare_symbols(const void* a, const void* b) {
+    const debugmap_symbol_t* x = (const debugmap_symbol_t*) a;
+    const debugmap_symbol_t* y = (const debugmap_symbol_t*) b;
+    return (x->address > y->address) - (x->address < y->address);
+}
+
+// Copy a name into the strings of a merged map
+static const char* copy_name(char** p, const char* name) {
+    size_t length = strlen(name) + 1;
+    char* copy = memcpy(*p, name, length);
+    *p += length;
+    return copy;
+}
+
+// Combine the maps of images loaded side by side
+void debugmap_merge(debugmap_t* map, const debugmap_t* maps, int count) {
+    memset(map, 0, sizeof(debugmap_t));
+    size_t strings = 0;
+    for (int i = 0; i < count; i++) {
+        map->file_count += maps[i].file_count;
+        map->line_count += maps[i].line_count;
+        map->symbol_count += maps[i].symbol_count;
+        for (int j = 0; j < maps[i].file_count; j++) {
+            strings += strlen(maps[i].files[j]) + 1;
+        }
+        for (uint32_t j = 0; j < maps[i].symbol_count; j++) {
+            strings += strlen(maps[i].symbols[j].name) + 1;
+        }
+    }
+    map->strings = (char*) malloc(strings + 1);
+    map->files = (const char**) calloc(map->file_count + 1, sizeof(char*));
+    map->lines = (debugmap_line_t*) calloc(map->line_count + 1,
+                                           sizeof(debugmap_line_t));
+    map->symbols = (debugmap_symbol_t*) calloc(map->symbol_count + 1,
+                                               sizeof(debugmap_symbol_t));
+
+    // File indexes of each map move up past the files of the maps before
+    char* p = map->strings;
+    uint16_t files = 0;
+    uint32_t lines = 0;
+    uint32_t symbols = 0;
+    for (int i = 0; i < count; i++) {
+        const debugmap_t* from = &maps[i];
+        for (int j = 0; j < from->file_count; j++) {
+            map->files[files + j] = copy_name(&p, from->files[j]);
+        }
+        for (uint32_t j = 0; j < from->line_count; j++) {
+            debugmap_line_t line = from->lines[j];
+            if (line.file != DEBUGMAP_NO_FILE) {
+                line.file += files;
+            }
+            map->lines[lines++] = line;
+        }
+        for (uint32_t j = 0; j < from->symbol_count; j++) {
+            map->symbols[symbols].address = from->symbols[j].address;
+            map->symbols[symbols++].name = copy_name(&p,
+                                                     from->symbols[j].name);
+        }
+        files += from->file_count;
+    }
+
+    // Lines must go strictly up, so where one map ends at the address
+    // another starts, the start wins
+    qsort(map->lines, lines, sizeof(debugmap_line_t), compare_lines);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < lines; i++) {
+        uint16_t address = map->lines[i].address;
+        if (kept > 0 && map->lines[kept - 1].address == address) {
+            kept--;
+        }
+        map->lines[kept++] = map->lines[i];
+    }
+    map->line_count = kept;
+    qsort(map->symbols, symbols, sizeof(debugmap_symbol_t), compare_symbols);
+}
+
+// Name of the map of an image
+char* debugmap_path(const char* image) {
+    const char* extension = ".dbg";
+    const char* dot = strrchr(image, '.');
+    const char* slash = strrchr(image, '/');
+    size_t length = dot && (!slash || dot > slash) ? (size_t) (dot - image)
+                                                   : strlen(image);
+    char* path = (char*) malloc(length + strlen(extension) + 1);
+    memcpy(path, image, length);
+    strcpy(path + length, extension);
+    return path;
+}
+
+// Index of the line entry covering the address, or -1
+static long find_line(const debugmap_t* map, uint16_t address) {
+    // First entry past the address, then the one before it
+    uint32_t low = 0;
+    uint32_t high = map->line_count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (map->lines[middle].address <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == 0 || map->lines[low - 1].file == DEBUGMAP_NO_FILE) {
+        return -1;
+    }
+    return low - 1;
+}
+
+// Find the source line a word came from
+bool debugmap_line(const debugmap_t* map, uint16_t address,
+                   const char** file, uint32_t* line) {
+    long i = find_line(map, address);
+    if (i < 0) {
+        return false;
+    }
+    *file = map->files[map->lines[i].file];
+    *line = map->lines[i].line;
+    return true;
+}
+
+// Find the last symbol at or before the address
+const debugmap_symbol_t* debugmap_symbol(const debugmap_t* map,
+                                         uint16_t address) {
+    uint32_t low = 0;
+    uint32_t high = map->symbol_count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (map->symbols[middle].address <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+    const debugmap_symbol_t* symbol = &map->symbols[low - 1];
+    if (symbol->address != address && find_line(map, address) < 0) {
+        return NULL;
+    }
+    return symbol;
+}
+
+// Find the address of a symbol by name
+bool debugmap_find(const debugmap_t* map, const char* name,
+                   uint16_t* address) {
+    for (uint32_t i = 0; i < map->symbol_count; i++) {
+        if (strcmp(map->symbols[i].name, name) == 0) {
+            *address = map->symbols[i].address;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Write the address as <label> or <label+offset>
+void debugmap_format(const debugmap_t* map, uint16_t address, char* out,
+                     size_t size) {
+    const debugmap_symbol_t* symbol = map ? debugmap_symbol(map, address)
+                                          : NULL;
+    if (symbol == NULL) {
+        out[0] = '\0';
+    } else if (symbol->address == address) {
+        snprintf(out, size, "<%s>", symbol->name);
+    } else {
+        snprintf(out, size, "<%s+%d>", symbol->name,
+                 address - symbol->address);
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef DEBUGMAP_H_
+#define DEBUGMAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A debug map goes next to an image and tells where each word came from
+// in the source and where each label is. xas writes one with -g, named
+// after the image with a .dbg extension; x16 and xod use it to show
+// labels and source lines along with addresses.
+//
+// On disk everything is stored as big endian 16 bit words, like images:
+//
+//   "X1" "6D"              magic
+//   version                DEBUGMAP_VERSION
+//   files                  entries in the file table
+//   lines                  entries in the line table, as 2 words
+//   symbols                entries in the symbol table, as 2 words
+//   strings                bytes of names, a multiple of 2, as 2 words
+//   file[files]            name offset as 2 words
+//   line[lines]            address, file index, line number as 2 words
+//   symbol[symbols]        address, name offset as 2 words
+//   names                  NUL terminated, padded with NUL to a word
+//
+// Lines and symbols are sorted by address, so a lookup is a binary
+// search. A line entry covers the words from its address up to the next
+// entry; the last entry has file DEBUGMAP_NO_FILE and marks the end.
+#define DEBUGMAP_MAGIC_HI   0x5831
+#define DEBUGMAP_MAGIC_LO   0x3644
+#define DEBUGMAP_VERSION    1
+#define DEBUGMAP_NO_FILE    0xffff
+
+typedef struct {
+    uint16_t address;       // first word that came from the line
+    uint16_t file;          // index into the files, or DEBUGMAP_NO_FILE
+    uint32_t line;
+} debugmap_line_t;
+
+typedef struct {
+    uint16_t address;
+    const char* name;
+} debugmap_symbol_t;
+
+typedef struct {
+    const char** files;
+    uint16_t file_count;
+    debugmap_line_t* lines;
+    uint32_t line_count;
+    debugmap_symbol_t* symbols;
+    uint32_t symbol_count;
+    char* strings;          // names of a map that was read
+} debugmap_t;
+
+// Write a map to a file in one go. Return false on errors.
+bool debugmap_write(FILE* fp, const debugmap_t* map);
+
+// Read a map file. Return false and set error to a message if the file
+// cannot be read or is malformed.
+bool debugmap_read(const char* path, debugmap_t* map, const char** error);
+
+// Free a map filled in by debugmap_read or debugmap_merge
+void debugmap_free(debugmap_t* map);
+
+// Combine the maps of images loaded side by side into one map with its
+// own copy of the names. The images must not overlap.
+void debugmap_merge(debugmap_t* map, const debugmap_t* maps, int count);
+
+// Name of the map of an image: the image name with a .dbg extension.
+// The caller frees it.
+char* debugmap_path(const char* image);
+
+// Find the source line a word came from. Return false if the map does
+// not cover the address.
+bool debugmap_line(const debugmap_t* map, uint16_t address,
+                   const char** file, uint32_t* line);
+
+// Find the last symbol at or before the address, for a word the map
+// covers or the exact address of a symbol. Return NULL if there is none.
+const debugmap_symbol_t* debugmap_symbol(const debugmap_t* map,
+                                         uint16_t address);
+
+// Find the address of a symbol by name. Return false if there is none
+bool debugmap_find(const debugmap_t* map, const char* name,
+                   uint16_t* address);
+
+// Write the address as <label> or <label+offset> into out, or an empty
+// string if no symbol covers it or there is no map
+void debugmap_format(const debugmap_t* map, uint16_t address, char* out,
+                     size_t size);
+
+#endif  // DEBUGMAP_H_
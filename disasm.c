@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "disasm.h"
+#include "instruction.h"
+
+// How the operands of an opcode are laid out
+typedef enum {
+    OPERANDS_ALU,           // dst, src1, then src2 or imm5
+    OPERANDS_NOT,           // dst, src1
+    OPERANDS_BRANCH,        // condition in the name, then offset9
+    OPERANDS_BASE,          // base register
+    OPERANDS_JSR,           // offset11, or a base register for jsrr
+    OPERANDS_PC,            // register, offset9
+    OPERANDS_BASE_OFFSET,   // register, base register, offset6
+    OPERANDS_TRAP,          // the vector picks the name
+    OPERANDS_RTI,           // none, if the other bits are clear
+    OPERANDS_CAS,           // register, base register, register, if
+                            // bits 5 to 3 are clear
+    OPERANDS_VALUE          // the word is a value
+} operands_t;
+
+// The name of each opcode, padded to where the operands start, and how
+// its operands are laid out. Opcodes whose name depends on the other bits
+// have none.
+static const struct {
+    const char* name;
+    operands_t operands;
+} opcodes[16] = {
+    [OP_BR]   = { NULL,      OPERANDS_BRANCH },
+    [OP_ADD]  = { "add    ", OPERANDS_ALU },
+    [OP_LD]   = { "ld     ", OPERANDS_PC },
+    [OP_ST]   = { "st     ", OPERANDS_PC },
+    [OP_JSR]  = { NULL,      OPERANDS_JSR },
+    [OP_AND]  = { "and    ", OPERANDS_ALU },
+    [OP_LDR]  = { "ldr    ", OPERANDS_BASE_OFFSET },
+    [OP_STR]  = { "str    ", OPERANDS_BASE_OFFSET },
+    [OP_RTI]  = { NULL,      OPERANDS_RTI },
+    [OP_NOT]  = { "not    ", OPERANDS_NOT },
+    [OP_LDI]  = { "ldi    ", OPERANDS_PC },
+    [OP_STI]  = { "sti    ", OPERANDS_PC },
+    [OP_JMP]  = { "jmp    ", OPERANDS_BASE },
+    [OP_CAS]  = { NULL,      OPERANDS_CAS },
+    [OP_LEA]  = { "lea    ", OPERANDS_PC },
+    [OP_TRAP] = { NULL,      OPERANDS_TRAP },
+};
+
+// Branch names by condition, n z p being bits 2 1 0
+static const char* branches[8] = {
+    "br     ", "brp    ", "brz    ", "brzp   ",
+    "brn    ", "brnp   ", "brnz   ", "brnzp  ",
+};
+
+// Trap names by vector, starting at TRAP_GETC
+static const char* traps[] = {
+    "getc", "putc", "puts", "enter", "putsp", "halt",
+};
+
+// Append a string
+static char* put_string(char* out, const char* text) {
+    size_t length = strlen(text);
+    memcpy(out, text, length);
+    return out + length;
+}
+
+// Append a register as %rN
+static char* put_register(char* out, uint16_t reg) {
+    *out++ = '%';
+    *out++ = 'r';
+    *out++ = '0' + reg;
+    return out;
+}
+
+// Append a number in decimal
+static char* put_decimal(char* out, int value) {
+    char digits[8];
+    int count = 0;
+    unsigned int magnitude = value < 0 ? 0u - value : (unsigned int) value;
+    if (value < 0) {
+        *out++ = '-';
+    }
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+// Append a number in lowercase hex, without leading zeros
+static char* put_hex(char* out, unsigned int value) {
+    static const char hex[] = "0123456789abcdef";
+    int shift = 28;
+    while (shift > 0 && (value >> shift) == 0) {
+        shift -= 4;
+    }
+    for (; shift >= 0; shift -= 4) {
+        *out++ = hex[(value >> shift) & 0xf];
+    }
+    return out;
+}
+
+// Append an immediate or offset as $N
+static char* put_immediate(char* out, int value) {
+    *out++ = '$';
+    return put_decimal(out, value);
+}
+
+// Append a value the word does not decode as an instruction
+static char* put_value(char* out, uint16_t instruction) {
+    out = put_string(out, "val    0x");
+    return put_hex(out, instruction);
+}
+
+// Write the assembler text of an instruction into out
+size_t disassemble(uint16_t instruction, char* out) {
+    char* p = out;
+    opcode_t opcode = getopcode(instruction);
+    uint16_t reg = getbits(instruction, 9, 3);
+    uint16_t base = getbits(instruction, 6, 3);
+
+    if (opcodes[opcode].name != NULL) {
+        p = put_string(p, opcodes[opcode].name);
+    }
+    switch (opcodes[opcode].operands) {
+    case OPERANDS_ALU:
+        p = put_register(p, reg);
+        p = put_string(p, ", ");
+        p = put_register(p, base);
+        p = put_string(p, ", ");
+        if (getimmediate(instruction) == 1) {
+            p = put_immediate(p, (int16_t) sign_extend(
+                getbits(instruction, 0, 5), 5));
+        } else {
+            p = put_register(p, getbits(instruction, 0, 3));
+        }
+        break;
+
+    case OPERANDS_NOT:
+        p = put_register(p, reg);
+        p = put_string(p, ", ");
+        p = put_register(p, base);
+        break;
+
+    case OPERANDS_BRANCH:
+        p = put_string(p, branches[reg]);
+        p = put_immediate(p, (int16_t) sign_extend(
+            getbits(instruction, 0, 9), 9));
+        break;
+
+    case OPERANDS_BASE:
+        p = put_register(p, base);
+        break;
+
+    case OPERANDS_JSR:
+        if (getbit(instruction, 11) == 1) {
+            p = put_string(p, "jsr    ");
+            p = put_immediate(p, (int16_t) sign_extend(
+                getbits(instruction, 0, 11), 11));
+        } else {
+            p = put_string(p, "jsrr   ");
+            p = put_register(p, base);
+        }
+        break;
+
+    case OPERANDS_PC:
+        p = put_register(p, reg);
+        p = put_string(p, ", ");
+        p = put_immediate(p, (int16_t) sign_extend(
+            getbits(instruction, 0, 9), 9));
+        break;
+
+    case OPERANDS_BASE_OFFSET:
+        p = put_register(p, reg);
+        p = put_string(p, ", ");
+        p = put_register(p, base);
+        p = put_string(p, ", ");
+        p = put_immediate(p, (int16_t) sign_extend(
+            getbits(instruction, 0, 6), 6));
+        break;
+
+    case OPERANDS_TRAP: {
+        uint16_t vec = getbits(instruction, 0, 8);
+        p = put_string(p, vec >= TRAP_GETC && vec <= TRAP_HALT
+                       ? traps[vec - TRAP_GETC] : "-");
+        break;
+    }
+
+    case OPERANDS_RTI:
+        p = instruction == emit_rti() ? put_string(p, "rti")
+                                      : put_value(p, instruction);
+        break;
+
+    case OPERANDS_CAS:
+        if (getbits(instruction, 3, 3) != 0) {
+            p = put_value(p, instruction);
+            break;
+        }
+        p = put_string(p, "cas    ");
+        p = put_register(p, reg);
+        p = put_string(p, ", ");
+        p = put_register(p, base);
+        p = put_string(p, ", ");
+        p = put_register(p, getbits(instruction, 0, 3));
+        break;
+
+    case OPERANDS_VALUE:
+        p = put_value(p, instruction);
+        break;
+    }
+
+    *p = '\0';
+    return p - out;
+}
+
+// Decode an instruction into assembler text
+char* decode(uint16_t instruction) {
+    char text[DISASM_MAX];
+    disassemble(instruction, text);
+    return strdup(text);
+}
@@ -0,0 +1,19 @@
+#ifndef DISASM_H_
+#define DISASM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Room disassemble needs for the longest text and its terminating NUL
+#define DISASM_MAX 32
+
+// Write the assembler text of an instruction into out, which has room
+// for DISASM_MAX bytes, and return its length. Nothing is allocated, so
+// it suits disassembling whole images.
+size_t disassemble(uint16_t instruction, char* out);
+
+// Decode an instruction into its assembler text. The returned string is
+// allocated on the heap and must be freed by the caller.
+char* decode(uint16_t instruction);
+
+#endif  // DISASM_H_
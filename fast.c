@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "analysis.h"
+#include "bits.h"
+#include "control.h"
+#include "fast.h"
+#include "instruction.h"
+#include "trap.h"
+#include "x16.h"
+
+// Operations of the fast engine. F_NONE marks an entry that has not been
+// decoded yet. F_SLOW hands the instruction to the reference interpreter,
+// which is used for anything the fast path does not model. F_BREAK
+// replaces the operation of an entry that has a breakpoint on it.
+typedef enum {
+    F_NONE = 0,
+    F_ADD_REG,
+    F_ADD_IMM,
+    F_AND_REG,
+    F_AND_IMM,
+    F_NOT,
+    F_BR,
+    F_JMP,
+    F_JSR,
+    F_JSRR,
+    F_LD,
+    F_LDI,
+    F_LDR,
+    F_LEA,
+    F_ST,
+    F_STI,
+    F_STR,
+    F_TRAP,
+    F_SLOW,
+    F_BREAK
+} fast_op_t;
+
+// A predecoded instruction. PC-relative operands are resolved to an
+// absolute address because each entry belongs to exactly one address.
+typedef struct {
+    uint16_t word;      // instruction word this entry was decoded from
+    uint8_t op;         // fast_op_t
+    uint8_t a;          // DR or SR
+    uint8_t b;          // SR1 or base register
+    uint8_t c;          // SR2, the nzp mask of a branch, or for a store
+                        // whether it must invalidate what it writes
+    uint16_t imm;       // sign extended immediate or absolute target
+} decoded_t;
+
+struct fast {
+    decoded_t code[MAX_MEMORY];
+
+    // One bit per address that has a breakpoint
+    uint8_t breaks[MAX_MEMORY / 8];
+
+    // Address of the breakpoint execution last stopped at, or -1
+    int stopped_at;
+
+    // Edge coverage map or NULL, and the hashed previous branch target
+    uint8_t* coverage;
+    uint16_t previous;
+
+    // Static analysis the decode cache trusts instead of comparing every
+    // word it runs, or NULL
+    const analysis_t* analysis;
+};
+
+// Create a fast engine with an empty decode cache
+fast_t* fast_create() {
+    fast_t* engine = (fast_t*) malloc(sizeof(fast_t));
+    memset(engine, 0, sizeof(fast_t));
+    engine->stopped_at = -1;
+    return engine;
+}
+
+// Free all resources consumed by the engine
+void fast_free(fast_t* engine) {
+    free(engine);
+}
+
+// Decode the instruction stored at address pc
+static void predecode(decoded_t* d, uint16_t pc, uint16_t instruction) {
+    uint16_t next = pc + 1;
+    d->word = instruction;
+    d->a = getbits(instruction, 9, 3);
+    d->b = getbits(instruction, 6, 3);
+    d->c = getbits(instruction, 0, 3);
+    d->imm = 0;
+
+    switch (getopcode(instruction)) {
+    case OP_ADD:
+    case OP_AND:
+        if (getimmediate(instruction) == 1) {
+            d->op = getopcode(instruction) == OP_ADD ? F_ADD_IMM : F_AND_IMM;
+            d->imm = sign_extend(getbits(instruction, 0, 5), 5);
+        } else {
+            d->op = getopcode(instruction) == OP_ADD ? F_ADD_REG : F_AND_REG;
+        }
+        break;
+
+    case OP_NOT:
+        d->op = F_NOT;
+        break;
+
+    case OP_BR:
+        d->op = F_BR;
+        d->c = getbits(instruction, 9, 3);
+        d->imm = next + sign_extend(getbits(instruction, 0, 9), 9);
+        break;
+
+    case OP_JMP:
+        // The interpreter reads the base register with a wider mask, so
+        // leave nonstandard encodings to it
+        d->op = getbits(instruction, 9, 3) == 0 ? F_JMP : F_SLOW;
+        break;
+
+    case OP_JSR:
+        if (getbit(instruction, 11) == 1) {
+            d->op = F_JSR;
+            d->imm = next + sign_extend(getbits(instruction, 0, 11), 11);
+        } else {
+            d->op = getbits(instruction, 9, 2) == 0 ? F_JSRR : F_SLOW;
+        }
+        break;
+
+    case OP_LD:
+    case OP_LDI:
+    case OP_LEA:
+    case OP_ST:
+    case OP_STI:
+        switch (getopcode(instruction)) {
+        case OP_LD:  d->op = F_LD;  break;
+        case OP_LDI: d->op = F_LDI; break;
+        case OP_LEA: d->op = F_LEA; break;
+        case OP_ST:  d->op = F_ST;  break;
+        default:     d->op = F_STI; break;
+        }
+        d->imm = next + sign_extend(getbits(instruction, 0, 9), 9);
+        d->c = 0;
+        break;
+
+    case OP_LDR:
+    case OP_STR:
+        d->op = getopcode(instruction) == OP_LDR ? F_LDR : F_STR;
+        d->imm = sign_extend(getbits(instruction, 0, 6), 6);
+        d->c = 0;
+        break;
+
+    case OP_TRAP:
+        d->op = F_TRAP;
+        break;
+
+    default:
+        d->op = F_SLOW;
+        break;
+    }
+}
+
+// Apply the analysis to an entry: a store that may write code invalidates
+// what it writes. Running a word the analysis did not find means it
+// missed a path, so stop trusting it and compare words again.
+static void trust(fast_t* engine, decoded_t* d, uint16_t pc) {
+    uint8_t flags = engine->analysis->flags[pc];
+    if (!(flags & ANALYSIS_CODE)) {
+        engine->analysis = NULL;
+    } else if (d->op == F_ST || d->op == F_STI || d->op == F_STR) {
+        d->c = !(flags & ANALYSIS_STORE_DATA);
+    }
+}
+
+// Decode the cache entry for address pc, marking breakpoints
+static void decode_entry(fast_t* engine, uint16_t pc, uint16_t instruction) {
+    decoded_t* d = &engine->code[pc];
+    predecode(d, pc, instruction);
+    if (engine->analysis != NULL) {
+        trust(engine, d, pc);
+    }
+    if (engine->breaks[pc >> 3] & (1 << (pc & 7))) {
+        d->op = F_BREAK;
+    }
+}
+
+// Set or clear a breakpoint
+void fast_set_break(fast_t* engine, uint16_t address, bool on) {
+    if (on) {
+        engine->breaks[address >> 3] |= 1 << (address & 7);
+    } else {
+        engine->breaks[address >> 3] &= ~(1 << (address & 7));
+    }
+    // Decode again on the next visit
+    engine->code[address].op = F_NONE;
+}
+
+// True if the address has a breakpoint
+bool fast_has_break(fast_t* engine, uint16_t address) {
+    return engine->breaks[address >> 3] & (1 << (address & 7));
+}
+
+// Trust a static analysis of the machine instead of comparing words
+void fast_set_analysis(fast_t* engine, const analysis_t* analysis) {
+    engine->analysis = analysis;
+    for (int i = 0; i < MAX_MEMORY; i++) {
+        engine->code[i].op = F_NONE;
+    }
+}
+
+// Record edge coverage into the map
+void fast_set_coverage(fast_t* engine, uint8_t* map) {
+    engine->coverage = map;
+    engine->previous = 0;
+}
+
+// Count the edge from the previous branch target to this one
+static inline void edge(fast_t* engine, uint16_t target) {
+    uint16_t current = target * 0x9e37;
+    engine->coverage[current ^ engine->previous]++;
+    engine->previous = current >> 1;
+}
+
+// Set the condition register from a result, like update_cond
+static inline void set_cc(uint16_t* reg, uint16_t result) {
+    if (result == 0) {
+        reg[R_COND] = FL_ZRO;
+    } else if (is_negative(result)) {
+        reg[R_COND] = FL_NEG;
+    } else {
+        reg[R_COND] = FL_POS;
+    }
+}
+
+// Read memory, going through x16_memread only for pages with flags set.
+// A watchpoint hit on the slow path ends the block.
+static inline uint16_t load(x16_t* machine, const uint8_t* pages,
+                            uint16_t* mem, uint16_t address, bool* end) {
+    if (pages[address >> PAGE_SHIFT] != 0) {
+        uint16_t val = x16_memread(machine, address);
+        *end = *end || x16_watch_pending(machine);
+        return val;
+    }
+    return x16_shared_read(&mem[address]);
+}
+
+// Write memory, ending the block if a watchpoint was hit. A store the
+// analysis could not place forgets what was decoded at the address.
+static inline void store(fast_t* engine, x16_t* machine,
+                         const uint8_t* pages, const decoded_t* d,
+                         uint16_t address, uint16_t val, bool* end) {
+    x16_memwrite(machine, address, val);
+    if (d->c) {
+        engine->code[address].op = F_NONE;
+    }
+    if (pages[address >> PAGE_SHIFT] != 0) {
+        *end = *end || x16_watch_pending(machine);
+    }
+}
+
+// Entering an interrupt or exception handler pushes the PSR and PC where
+// no analysis can see, so forget what was decoded there
+static void forget_stack(fast_t* engine, const uint16_t* reg) {
+    if (engine->analysis != NULL) {
+        engine->code[reg[R_R6]].op = F_NONE;
+        engine->code[(uint16_t) (reg[R_R6] + 1)].op = F_NONE;
+    }
+}
+
+// Poll for an interrupt at the end of a block
+static inline void poll(fast_t* engine, x16_t* machine, const uint16_t* reg,
+                        bool idle) {
+    if (x16_interrupt(machine, idle)) {
+        forget_stack(engine, reg);
+    }
+}
+
+// Execute until the end of a basic block or until limit instructions
+// have run, whichever comes first
+int fast_run(fast_t* engine, x16_t* machine, int limit, int* count) {
+    uint16_t* mem = x16_memory(machine, 0);
+    uint16_t* reg = x16_registers(machine);
+    const uint8_t* pages = x16_pages(machine);
+    decoded_t scratch;
+    bool taken;
+    int executed = 0;
+    int rv = 0;
+    bool end = false;
+
+    // Words are compared with what was decoded unless the analysis says
+    // they cannot have changed
+    bool trusted = engine->analysis != NULL;
+
+    // Execution resumes past the breakpoint it last stopped at
+    int resume = engine->stopped_at;
+    engine->stopped_at = -1;
+
+    while (!end && executed < limit) {
+        uint16_t pc = reg[R_PC];
+        executed++;
+        if (pc >= MMIO_BASE) {
+            // Executing device registers, let the interpreter fetch
+            rv = execute_instruction(machine);
+            forget_stack(engine, reg);
+            break;
+        }
+
+        decoded_t* d = &engine->code[pc];
+        uint16_t word = x16_shared_read(&mem[pc]);
+        if (d->op == F_NONE || (!trusted && d->word != word)) {
+            decode_entry(engine, pc, word);
+            trusted = engine->analysis != NULL;
+        }
+        reg[R_PC] = pc + 1;
+
+    dispatch:
+        switch (d->op) {
+        case F_ADD_REG:
+            reg[d->a] = reg[d->b] + reg[d->c];
+            set_cc(reg, reg[d->a]);
+            break;
+        case F_ADD_IMM:
+            reg[d->a] = reg[d->b] + d->imm;
+            set_cc(reg, reg[d->a]);
+            break;
+        case F_AND_REG:
+            reg[d->a] = reg[d->b] & reg[d->c];
+            set_cc(reg, reg[d->a]);
+            break;
+        case F_AND_IMM:
+            reg[d->a] = reg[d->b] & d->imm;
+            set_cc(reg, reg[d->a]);
+            break;
+        case F_NOT:
+            reg[d->a] = ~reg[d->b];
+            set_cc(reg, reg[d->a]);
+            break;
+        case F_BR:
+            taken = d->c & reg[R_COND];
+            if (taken) {
+                reg[R_PC] = d->imm;
+                if (engine->coverage != NULL) {
+                    edge(engine, reg[R_PC]);
+                }
+            }
+            if (x16_shared_read(&mem[MR_KBSR]) & KBSR_IE) {
+                // A branch to itself idles until an interrupt
+                poll(engine, machine, reg, taken && d->imm == pc);
+            }
+            end = true;
+            break;
+        case F_JMP:
+            reg[R_PC] = reg[d->b];
+            if (engine->coverage != NULL) {
+                edge(engine, reg[R_PC]);
+            }
+            if (x16_shared_read(&mem[MR_KBSR]) & KBSR_IE) {
+                poll(engine, machine, reg, false);
+            }
+            end = true;
+            break;
+        case F_JSR:
+            reg[R_R7] = reg[R_PC];
+            reg[R_PC] = d->imm;
+            if (engine->coverage != NULL) {
+                edge(engine, reg[R_PC]);
+            }
+            if (x16_shared_read(&mem[MR_KBSR]) & KBSR_IE) {
+                poll(engine, machine, reg, false);
+            }
+            end = true;
+            break;
+        case F_JSRR:
+            reg[R_R7] = reg[R_PC];
+            reg[R_PC] = reg[d->b];
+            if (engine->coverage != NULL) {
+                edge(engine, reg[R_PC]);
+            }
+            if (x16_shared_read(&mem[MR_KBSR]) & KBSR_IE) {
+                poll(engine, machine, reg, false);
+            }
+            end = true;
+            break;
+        case F_LD:
+            reg[d->a] = load(machine, pages, mem, d->imm, &end);
+            set_cc(reg, reg[d->a]);
+            break;
+        case F_LDI:
+            reg[d->a] = load(machine, pages, mem,
+                load(machine, pages, mem, d->imm, &end), &end);
+            set_cc(reg, reg[d->a]);
+            break;
+        case F_LDR:
+            reg[d->a] = load(machine, pages, mem, reg[d->b] + d->imm,
+                &end);
+            set_cc(reg, reg[d->a]);
+            break;
+        case F_LEA:
+            reg[d->a] = d->imm;
+            set_cc(reg, reg[d->a]);
+            break;
+        case F_ST:
+            store(engine, machine, pages, d, d->imm, reg[d->a], &end);
+            break;
+        case F_STI:
+            store(engine, machine, pages, d,
+                load(machine, pages, mem, d->imm, &end), reg[d->a], &end);
+            break;
+        case F_STR:
+            store(engine, machine, pages, d, reg[d->b] + d->imm, reg[d->a],
+                &end);
+            break;
+        case F_TRAP:
+            rv = trap(machine, d->word);
+            if (rv == 0 && (x16_shared_read(&mem[MR_KBSR]) & KBSR_IE)) {
+                poll(engine, machine, reg, false);
+            }
+            end = true;
+            break;
+        case F_BREAK:
+            if (executed == 1 && pc == resume) {
+                // Resuming, so run the instruction under the breakpoint
+                predecode(&scratch, pc, d->word);
+                if (engine->analysis != NULL) {
+                    trust(engine, &scratch, pc);
+                }
+                d = &scratch;
+                goto dispatch;
+            }
+            // Stop in front of the breakpoint
+            reg[R_PC] = pc;
+            executed--;
+            engine->stopped_at = pc;
+            rv = FAST_BREAK;
+            end = true;
+            break;
+        case F_SLOW:
+        default:
+            reg[R_PC] = pc;
+            if (engine->analysis != NULL && getopcode(d->word) == OP_CAS) {
+                // The interpreter does not tell the cache what it writes
+                engine->code[reg[d->b]].op = F_NONE;
+            }
+            rv = execute_instruction(machine);
+            forget_stack(engine, reg);
+            end = true;
+            break;
+        }
+    }
+
+    *count = executed;
+    return rv;
+}
+
+// Execute one basic block
+int fast_run_block(fast_t* engine, x16_t* machine, int* count) {
+    return fast_run(engine, machine, MAX_MEMORY, count);
+}
+
+// Execute a single instruction
+int fast_step(fast_t* engine, x16_t* machine) {
+    int count;
+    return fast_run(engine, machine, 1, &count);
+}
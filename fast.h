@@ -0,0 +1,61 @@
+#ifndef FAST_H_
+#define FAST_H_
+
+#include "analysis.h"
+#include "x16.h"
+
+// The fast execution engine. Every guest word is decoded once into a
+// compact form and reused until the word in memory changes, so self
+// modifying code keeps working. Execution proceeds a basic block at a
+// time: a block ends after any instruction that may transfer control.
+typedef struct fast fast_t;
+
+// Create a fast engine with an empty decode cache
+fast_t* fast_create();
+
+// Free all resources consumed by the engine
+void fast_free(fast_t* engine);
+
+// Returned when execution stops in front of a breakpoint. Running again
+// from there executes the instruction under the breakpoint.
+#define FAST_BREAK  1
+
+// Execute one basic block of the machine. The number of instructions
+// executed is stored in count. Execution also stops early after an
+// access that hits a watchpoint. Return 0 on success, -1 for HALT or
+// FAST_BREAK at a breakpoint
+int fast_run_block(fast_t* engine, x16_t* machine, int* count);
+
+// Execute until the end of a basic block or until limit instructions have
+// run. The number executed is stored in count. Return as fast_run_block
+int fast_run(fast_t* engine, x16_t* machine, int limit, int* count);
+
+// Execute a single instruction. Return 0 on success, -1 for HALT or
+// FAST_BREAK at a breakpoint
+int fast_step(fast_t* engine, x16_t* machine);
+
+// Set or clear a breakpoint. The mark lives in the decoded entry of the
+// address, so code without breakpoints runs at full speed.
+void fast_set_break(fast_t* engine, uint16_t address, bool on);
+
+// True if the address has a breakpoint
+bool fast_has_break(fast_t* engine, uint16_t address);
+
+// Trust a static analysis of the machine, or stop trusting one when
+// analysis is NULL. Instead of comparing each word it runs with what was
+// decoded, the engine only invalidates what stores the analysis could not
+// place write. Running a word the analysis did not find as code stops
+// trusting it. The analysis must outlive its use, and anything that
+// writes memory behind the back of the engine, other than its own
+// interrupts, needs the analysis set again. Drops the decode cache.
+void fast_set_analysis(fast_t* engine, const analysis_t* analysis);
+
+// Size of an edge coverage map
+#define COVERAGE_MAP_SIZE   (1 << 16)
+
+// Record edge coverage into the map, AFL style, or stop recording when
+// map is NULL. Every taken BR, JMP and JSR bumps the counter at the hash
+// of the previous and current target. Also starts a new trace.
+void fast_set_coverage(fast_t* engine, uint8_t* map);
+
+#endif   // FAST_H_
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include "fast.h"
+#include "fuzz.h"
+
+// File descriptors afl-fuzz uses to talk to the fork server
+#define FORKSRV_FD              198
+
+// Inputs a persistent child runs before it is replaced
+#define PERSISTENT_ITERATIONS   10000
+
+// Largest input that is read
+#define MAX_INPUT               (1 << 20)
+
+// afl-fuzz looks for this string to enable persistent mode
+const char x16_afl_persistent[] = "##SIG_AFL_PERSISTENT##";
+
+// Keystrokes of the current input
+typedef struct {
+    uint8_t* data;
+    size_t length;
+    size_t position;
+    bool exhausted;     // the guest asked for more keys than the input has
+} keys_t;
+
+static int keys_ready(void* ctx) {
+    keys_t* keys = (keys_t*) ctx;
+    if (keys->position == keys->length) {
+        keys->exhausted = true;
+        return 0;
+    }
+    return 1;
+}
+
+static int keys_get(void* ctx) {
+    keys_t* keys = (keys_t*) ctx;
+    if (keys->position == keys->length) {
+        keys->exhausted = true;
+        return 0;
+    }
+    return keys->data[keys->position++];
+}
+
+static void keys_put(void* ctx, int c) {
+    // Guest output is not needed while fuzzing
+}
+
+// Read the next input, from the start of the file or of stdin
+static size_t read_input(const char* input, uint8_t* buf) {
+    int fd = STDIN_FILENO;
+    if (input != NULL) {
+        fd = open(input, O_RDONLY);
+        if (fd < 0) {
+            perror(input);
+            exit(1);
+        }
+    } else {
+        // afl-fuzz rewrites the file behind stdin for each input
+        lseek(fd, 0, SEEK_SET);
+    }
+
+    size_t length = 0;
+    ssize_t n;
+    while (length < MAX_INPUT
+           && (n = read(fd, buf + length, MAX_INPUT - length)) > 0) {
+        length += n;
+    }
+    if (input != NULL) {
+        close(fd);
+    }
+    return length;
+}
+
+// Run one input on a machine reset to the baseline. Return as fast_run
+static int run_one(fast_t* engine, x16_t* machine, x16_t* baseline,
+                   uint8_t* map, keys_t* keys, const char* input,
+                   long budget) {
+    x16_reset_to(machine, baseline);
+    keys->length = read_input(input, keys->data);
+    keys->position = 0;
+    keys->exhausted = false;
+    fast_set_coverage(engine, map);
+
+    long steps = 0;
+    int count;
+    int rv = 0;
+    while (rv == 0 && steps < budget && !keys->exhausted) {
+        rv = fast_run_block(engine, machine, &count);
+        steps += count;
+    }
+    return rv;
+}
+
+// Serve afl-fuzz. Children run inputs persistently and stop themselves
+// after each one; the server resumes a stopped child for the next input.
+static void serve(fast_t* engine, x16_t* machine, x16_t* baseline,
+                  uint8_t* map, keys_t* keys, const char* input,
+                  long budget) {
+    pid_t child = -1;
+    bool stopped = false;
+    int status;
+    uint32_t killed;
+
+    while (read(FORKSRV_FD, &killed, 4) == 4) {
+        if (stopped && killed) {
+            // afl-fuzz killed the stopped child on a timeout
+            stopped = false;
+            waitpid(child, &status, 0);
+        }
+
+        if (stopped) {
+            kill(child, SIGCONT);
+            stopped = false;
+        } else {
+            child = fork();
+            if (child < 0) {
+                perror("fork");
+                exit(1);
+            }
+            if (child == 0) {
+                close(FORKSRV_FD);
+                close(FORKSRV_FD + 1);
+                for (int i = 0; i < PERSISTENT_ITERATIONS; i++) {
+                    if (i > 0) {
+                        raise(SIGSTOP);
+                    }
+                    run_one(engine, machine, baseline, map, keys, input,
+                            budget);
+                }
+                _exit(0);
+            }
+        }
+
+        if (write(FORKSRV_FD + 1, &child, 4) != 4) {
+            exit(1);
+        }
+        if (waitpid(child, &status, WUNTRACED) < 0) {
+            exit(1);
+        }
+        stopped = WIFSTOPPED(status);
+        if (write(FORKSRV_FD + 1, &status, 4) != 4) {
+            exit(1);
+        }
+    }
+}
+
+// Run the loaded machine under a coverage guided fuzzer
+int fuzz_run(x16_t* machine, const char* input, long budget) {
+    uint8_t* map = NULL;
+    const char* shm = getenv("__AFL_SHM_ID");
+    if (shm != NULL) {
+        map = (uint8_t*) shmat(atoi(shm), NULL, 0);
+        if (map == (void*) -1) {
+            perror("shmat");
+            return 1;
+        }
+    } else {
+        map = (uint8_t*) calloc(COVERAGE_MAP_SIZE, 1);
+    }
+
+    fast_t* engine = fast_create();
+    x16_t* baseline = x16_create();
+    x16_reset_to(baseline, machine);
+    keys_t keys = {0};
+    keys.data = (uint8_t*) malloc(MAX_INPUT);
+    x16_io_t io = { keys_ready, keys_get, keys_put, &keys };
+    x16_set_io(machine, &io);
+
+    uint32_t hello = 0;
+    if (write(FORKSRV_FD + 1, &hello, 4) == 4) {
+        serve(engine, machine, baseline, map, &keys, input, budget);
+    } else {
+        // Not under afl-fuzz, run the input once
+        int rv = run_one(engine, machine, baseline, map, &keys, input,
+                         budget);
+        int edges = 0;
+        for (int i = 0; i < COVERAGE_MAP_SIZE; i++) {
+            edges += map[i] != 0;
+        }
+        fprintf(stderr, "%d edges covered, %s\n", edges,
+                rv == -1 ? "halted" : keys.exhausted
+                ? "input exhausted" : "budget exhausted");
+    }
+
+    x16_set_io(machine, x16_console());
+    free(keys.data);
+    x16_free(baseline);
+    fast_free(engine);
+    if (shm == NULL) {
+        free(map);
+    }
+    return 0;
+}
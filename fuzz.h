@@ -0,0 +1,19 @@
+#ifndef FUZZ_H_
+#define FUZZ_H_
+
+#include "x16.h"
+
+// Default number of instructions a single fuzz input may run for
+#define DEFAULT_FUZZ_BUDGET     10000000
+
+// Run the loaded machine as the target of a coverage guided fuzzer. Each
+// input is fed to the guest as keystrokes, read from the input file or
+// from stdin when input is NULL. Edge coverage is recorded into the AFL
+// shared memory map named by __AFL_SHM_ID.
+//
+// Under afl-fuzz this acts as a persistent fork server: one child runs
+// many inputs, resetting the machine in place between them. Run by hand,
+// it executes a single input and reports the edges it covered.
+int fuzz_run(x16_t* machine, const char* input, long budget);
+
+#endif  // FUZZ_H_
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+#include "tape.h"
+
+// Number of checkpoints kept. Older ones are dropped along with the
+// journal entries and input events that only they needed.
+#define MAX_CHECKPOINTS 16
+
+// Registers and memory at a point in time
+typedef struct {
+    uint64_t when;
+    uint16_t registers[MAX_STATE_REGISTERS];
+    uint16_t* memory;
+    size_t journal;         // journal length when taken
+    size_t cursor;          // tape position when taken
+} checkpoint_t;
+
+struct history {
+    x16_t* machine;
+    fast_t* engine;
+    long interval;
+    uint64_t now;
+
+    x16_journal_t journal;
+    tape_t tape;
+    tape_head_t head;
+    x16_io_t io;
+
+    checkpoint_t checkpoints[MAX_CHECKPOINTS];
+    int count;
+};
+
+// Forget everything older than the oldest checkpoint
+static void trim(history_t* history) {
+    checkpoint_t* oldest = &history->checkpoints[0];
+    size_t entries = oldest->journal;
+    size_t events = oldest->cursor;
+
+    memmove(history->journal.entries, history->journal.entries + entries,
+            (history->journal.count - entries) * sizeof(x16_undo_t));
+    history->journal.count -= entries;
+    memmove(history->tape.events, history->tape.events + events,
+            (history->tape.count - events) * sizeof(tape_event_t));
+    history->tape.count -= events;
+    history->head.cursor -= events;
+
+    for (int i = 0; i < history->count; i++) {
+        history->checkpoints[i].journal -= entries;
+        history->checkpoints[i].cursor -= events;
+    }
+}
+
+// Take a checkpoint of the current state
+static void checkpoint(history_t* history) {
+    checkpoint_t* checkpoints = history->checkpoints;
+    uint16_t* memory = NULL;
+
+    if (history->count == MAX_CHECKPOINTS) {
+        // Recycle the memory of the oldest checkpoint
+        memory = checkpoints[0].memory;
+        memmove(checkpoints, checkpoints + 1,
+                (MAX_CHECKPOINTS - 1) * sizeof(checkpoint_t));
+        history->count--;
+        trim(history);
+    } else {
+        memory = (uint16_t*) malloc(MAX_MEMORY * sizeof(uint16_t));
+    }
+
+    checkpoint_t* c = &checkpoints[history->count++];
+    c->when = history->now;
+    c->memory = memory;
+    c->journal = history->journal.count;
+    c->cursor = history->head.cursor;
+    memcpy(c->registers, x16_registers(history->machine),
+           sizeof(c->registers));
+    memcpy(c->memory, x16_memory(history->machine, 0),
+           MAX_MEMORY * sizeof(uint16_t));
+}
+
+// Start recording the machine
+history_t* history_create(x16_t* machine, fast_t* engine, long interval) {
+    history_t* history = (history_t*) calloc(1, sizeof(history_t));
+    history->machine = machine;
+    history->engine = engine;
+    history->interval = interval;
+
+    history->head.tape = &history->tape;
+    history->head.live = x16_console();
+    tape_io(&history->head, &history->io);
+    x16_set_io(machine, &history->io);
+    x16_set_journal(machine, &history->journal);
+
+    checkpoint(history);
+    return history;
+}
+
+// Stop recording and free all resources
+void history_free(history_t* history) {
+    x16_set_io(history->machine, x16_console());
+    x16_set_journal(history->machine, NULL);
+    for (int i = 0; i < history->count; i++) {
+        free(history->checkpoints[i].memory);
+    }
+    x16_journal_free(&history->journal);
+    tape_free(&history->tape);
+    free(history);
+}
+
+// Execute one block, taking a checkpoint first when one is due
+int history_run(history_t* history, int limit, int* count) {
+    checkpoint_t* newest = &history->checkpoints[history->count - 1];
+    if (history->now - newest->when >= (uint64_t) history->interval) {
+        checkpoint(history);
+    }
+
+    history->journal.clock = history->now;
+    int rv = fast_run(history->engine, history->machine, limit, count);
+    history->now += *count;
+    return rv;
+}
+
+// Number of instructions executed so far
+uint64_t history_now(history_t* history) {
+    return history->now;
+}
+
+// Run forward to the given instruction without output or stops
+static void replay(history_t* history, uint64_t when) {
+    uint16_t address;
+    int kind;
+    int count;
+    bool mute = history->head.mute;
+    history->head.mute = true;
+
+    while (history->now < when) {
+        uint64_t left = when - history->now;
+        int limit = left < MAX_MEMORY ? (int) left : MAX_MEMORY;
+        int rv = history_run(history, limit, &count);
+
+        // Watchpoints already fired the first time through
+        while (x16_watch_hit(history->machine, &address, &kind)) {
+        }
+        if (rv == -1) {
+            break;
+        }
+    }
+    history->head.mute = mute;
+}
+
+// Go back to the state just before instruction number when executed
+bool history_seek(history_t* history, uint64_t when) {
+    if (when >= history->now) {
+        replay(history, when);
+        return true;
+    }
+
+    int i = history->count - 1;
+    while (i >= 0 && history->checkpoints[i].when > when) {
+        i--;
+    }
+    if (i < 0) {
+        return false;
+    }
+
+    // Restore the checkpoint and drop everything after it, except the
+    // recorded input which is needed to replay
+    checkpoint_t* c = &history->checkpoints[i];
+    memcpy(x16_memory(history->machine, 0), c->memory,
+           MAX_MEMORY * sizeof(uint16_t));
+    x16_rehash(history->machine);
+    memcpy(x16_registers(history->machine), c->registers,
+           sizeof(c->registers));
+    history->journal.count = c->journal;
+    history->head.cursor = c->cursor;
+    history->now = c->when;
+    while (history->count > i + 1) {
+        free(history->checkpoints[--history->count].memory);
+    }
+
+    replay(history, when);
+    return true;
+}
+
+// True if any journal entry from index first on is for the address
+static bool wrote(history_t* history, size_t first, uint16_t address) {
+    for (size_t i = first; i < history->journal.count; i++) {
+        if (history->journal.entries[i].address == address) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Find the last instruction that wrote the address
+bool history_last_write(history_t* history, uint16_t address,
+                        uint64_t* when) {
+    // The journal knows the block the write happened in
+    size_t i = history->journal.count;
+    while (i > 0 && history->journal.entries[i - 1].address != address) {
+        i--;
+    }
+    if (i == 0) {
+        return false;
+    }
+    uint64_t block = history->journal.entries[i - 1].when;
+    uint64_t now = history->now;
+
+    // Step through that block to find the instruction, then return
+    bool found = false;
+    uint16_t watched;
+    int kind;
+    int count;
+    history_seek(history, block);
+    while (!found && history->now < now) {
+        size_t first = history->journal.count;
+        bool mute = history->head.mute;
+        history->head.mute = true;
+        int rv = history_run(history, 1, &count);
+        history->head.mute = mute;
+        while (x16_watch_hit(history->machine, &watched, &kind)) {
+        }
+        if (count == 1 && wrote(history, first, address)) {
+            *when = history->now - 1;
+            found = true;
+        } else if (rv == -1) {
+            break;
+        }
+    }
+    history_seek(history, now);
+    return found;
+}
@@ -0,0 +1,40 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "fast.h"
+#include "x16.h"
+
+// Default number of instructions between checkpoints
+#define DEFAULT_CHECKPOINT_INTERVAL     1000000
+
+// Time travel for a machine. While the machine runs through history_run,
+// registers and memory are checkpointed every interval instructions, the
+// old value of every memory write is journaled and all console input is
+// recorded. Going back restores the nearest checkpoint and replays the
+// short window from there to the wanted instruction.
+typedef struct history history_t;
+
+// Start recording the machine, which runs on the given engine
+history_t* history_create(x16_t* machine, fast_t* engine, long interval);
+
+// Stop recording and free all resources
+void history_free(history_t* history);
+
+// Execute until the end of a basic block or until limit instructions
+// have run. The number executed is stored in count. Return as fast_run
+int history_run(history_t* history, int limit, int* count);
+
+// Number of instructions executed so far
+uint64_t history_now(history_t* history);
+
+// Go back to the state just before instruction number when executed.
+// Return false if that is before the oldest checkpoint kept.
+bool history_seek(history_t* history, uint64_t when);
+
+// Find the last instruction that wrote the address. Its number is stored
+// in when. Return false if no write is recorded.
+bool history_last_write(history_t* history, uint16_t address, uint64_t* when);
+
+#endif  // HISTORY_H_
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "image.h"
+
+// Words in the header of a container
+#define HEADER_WORDS    8
+
+// Words in each kind of table entry
+#define SEGMENT_WORDS   3
+#define SYMBOL_WORDS    3
+
+// Words of the CRC at the end
+#define CRC_WORDS       2
+
+// Words of memory, which segments of a container must fit in
+#define MEMORY_WORDS    0x10000
+
+// CRC-32 of each nibble, for the reflected polynomial 0xedb88320
+static const uint32_t crc_nibbles[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+// CRC-32 of some bytes
+uint32_t image_crc32(const void* data, size_t size) {
+    const uint8_t* p = (const uint8_t*) data;
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= p[i];
+        crc = (crc >> 4) ^ crc_nibbles[crc & 0xf];
+        crc = (crc >> 4) ^ crc_nibbles[crc & 0xf];
+    }
+    return ~crc;
+}
+
+// Whether an image has to be a container
+bool image_is_container(const image_t* image) {
+    return image->segment_count != 1 || image->has_entry
+        || image->symbol_count > 0;
+}
+
+// Write the origin and words of the only segment
+static bool write_legacy(FILE* fp, const image_t* image) {
+    const image_segment_t* segment = &image->segments[0];
+    size_t words = segment->count + 1;
+    uint16_t* buffer = (uint16_t*) malloc(words * sizeof(uint16_t));
+    buffer[0] = htons(segment->origin);
+    for (uint32_t i = 0; i < segment->count; i++) {
+        buffer[i + 1] = htons(segment->words[i]);
+    }
+    bool ok = fwrite(buffer, sizeof(uint16_t), words, fp) == words;
+    free(buffer);
+    return ok;
+}
+
+// Copy a name into the string table and store its offset as 2 words
+static uint16_t* put_name(uint16_t* p, char* names, size_t* offset,
+                          const char* name) {
+    size_t length = strlen(name) + 1;
+    memcpy(names + *offset, name, length);
+    *p++ = htons(*offset >> 16);
+    *p++ = htons(*offset & 0xffff);
+    *offset += length;
+    return p;
+}
+
+// Write an image in one go
+bool image_write(FILE* fp, const image_t* image) {
+    if (!image_is_container(image)) {
+        return write_legacy(fp, image);
+    }
+
+    size_t strings = 0;
+    size_t code = 0;
+    for (int i = 0; i < image->symbol_count; i++) {
+        strings += strlen(image->symbols[i].name) + 1;
+    }
+    strings = (strings + 1) & ~1;
+    for (int i = 0; i < image->segment_count; i++) {
+        code += image->segments[i].count;
+    }
+
+    size_t words = HEADER_WORDS + SEGMENT_WORDS * image->segment_count
+        + SYMBOL_WORDS * image->symbol_count + code + strings / 2 + CRC_WORDS;
+    uint16_t* buffer = (uint16_t*) calloc(words, sizeof(uint16_t));
+    uint16_t* p = buffer;
+    *p++ = htons(IMAGE_MAGIC_HI);
+    *p++ = htons(IMAGE_MAGIC_LO);
+    *p++ = htons(IMAGE_VERSION);
+    *p++ = htons(image->entry);
+    *p++ = htons(image->segment_count);
+    *p++ = htons(image->symbol_count);
+    *p++ = htons(strings >> 16);
+    *p++ = htons(strings & 0xffff);
+
+    for (int i = 0; i < image->segment_count; i++) {
+        *p++ = htons(image->segments[i].origin);
+        *p++ = htons(image->segments[i].count >> 16);
+        *p++ = htons(image->segments[i].count & 0xffff);
+    }
+    char* names = (char*) (buffer + words - CRC_WORDS - strings / 2);
+    size_t offset = 0;
+    for (int i = 0; i < image->symbol_count; i++) {
+        *p++ = htons(image->symbols[i].address);
+        p = put_name(p, names, &offset, image->symbols[i].name);
+    }
+    for (int i = 0; i < image->segment_count; i++) {
+        const image_segment_t* segment = &image->segments[i];
+        for (uint32_t j = 0; j < segment->count; j++) {
+            *p++ = htons(segment->words[j]);
+        }
+    }
+
+    size_t size = (words - CRC_WORDS) * sizeof(uint16_t);
+    uint32_t crc = image_crc32(buffer, size);
+    buffer[words - 2] = htons(crc >> 16);
+    buffer[words - 1] = htons(crc & 0xffff);
+
+    bool ok = fwrite(buffer, sizeof(uint16_t), words, fp) == words;
+    free(buffer);
+    return ok;
+}
+
+// Order segments by origin
+static int compare_segments(const void* a, const void* b) {
+    const image_segment_t* x = (const image_segment_t*) a;
+    const image_segment_t* y = (const image_segment_t*) b;
+    return (x->origin > y->origin) - (x->origin < y->origin);
+}
+
+// Parse a container, whose words have been swapped to host order
+static bool parse_container(const uint16_t* h, size_t words,
+                            const uint8_t* bytes, image_t* image,
+                            const char** error) {
+    if (words < HEADER_WORDS + CRC_WORDS) {
+        *error = "truncated image";
+        return false;
+    }
+    if (h[2] != IMAGE_VERSION) {
+        *error = "unsupported image version";
+        return false;
+    }
+    image->has_entry = true;
+    image->entry = h[3];
+    image->segment_count = h[4];
+    image->symbol_count = h[5];
+    size_t strings = (size_t) h[6] << 16 | h[7];
+
+    // The tables must fit before the words can be counted
+    size_t tables = HEADER_WORDS + SEGMENT_WORDS * image->segment_count
+        + SYMBOL_WORDS * image->symbol_count;
+    if (tables + strings / 2 + CRC_WORDS > words || strings % 2 != 0) {
+        *error = "truncated image";
+        return false;
+    }
+    size_t code = 0;
+    const uint16_t* p = h + HEADER_WORDS;
+    for (int i = 0; i < image->segment_count; i++, p += SEGMENT_WORDS) {
+        code += (size_t) p[1] << 16 | p[2];
+    }
+    if (tables + code + strings / 2 + CRC_WORDS != words) {
+        *error = "truncated image";
+        return false;
+    }
+    uint32_t crc = (uint32_t) h[words - 2] << 16 | h[words - 1];
+    if (image_crc32(bytes, (words - CRC_WORDS) * 2) != crc) {
+        *error = "image checksum does not match";
+        return false;
+    }
+
+    image->segments = (image_segment_t*) calloc(image->segment_count + 1,
+                                                sizeof(image_segment_t));
+    image->symbols = (image_symbol_t*) calloc(image->symbol_count + 1,
+                                              sizeof(image_symbol_t));
+    uint16_t* storage = (uint16_t*) image->storage;
+    uint16_t* segment_words = storage + tables;
+    char* names = (char*) (storage + words);
+    memcpy(names, bytes + 2 * (words - CRC_WORDS - strings / 2), strings);
+    names[strings] = '\0';
+
+    bool ok = true;
+    p = h + HEADER_WORDS;
+    for (int i = 0; i < image->segment_count; i++, p += SEGMENT_WORDS) {
+        image_segment_t* segment = &image->segments[i];
+        segment->origin = p[0];
+        segment->count = (uint32_t) p[1] << 16 | p[2];
+        segment->words = segment_words;
+        segment_words += segment->count;
+        ok &= segment->origin + segment->count <= MEMORY_WORDS;
+    }
+    for (int i = 0; i < image->symbol_count; i++, p += SYMBOL_WORDS) {
+        size_t name = (size_t) p[1] << 16 | p[2];
+        image->symbols[i].address = p[0];
+        image->symbols[i].name = names + (name < strings ? name : strings);
+        ok &= name < strings;
+    }
+    if (!ok) {
+        *error = "malformed image";
+        return false;
+    }
+
+    image_segment_t* sorted = (image_segment_t*) malloc(
+        (image->segment_count + 1) * sizeof(image_segment_t));
+    memcpy(sorted, image->segments,
+           image->segment_count * sizeof(image_segment_t));
+    qsort(sorted, image->segment_count, sizeof(image_segment_t),
+          compare_segments);
+    for (int i = 1; i < image->segment_count; i++) {
+        ok &= sorted[i - 1].origin + sorted[i - 1].count <= sorted[i].origin;
+    }
+    free(sorted);
+    if (!ok) {
+        *error = "image segments overlap";
+    }
+    return ok;
+}
+
+// Parse an image of either format
+bool image_parse(const void* data, size_t size, image_t* image,
+                 const char** error) {
+    memset(image, 0, sizeof(image_t));
+    const uint8_t* bytes = (const uint8_t*) data;
+    size_t words = size / 2;
+    if (words < 1) {
+        *error = "no origin";
+        return false;
+    }
+
+    // The words in host order, then room for the names of a container
+    uint16_t* h = (uint16_t*) malloc(words * sizeof(uint16_t) + size + 1);
+    memcpy(h, bytes, words * sizeof(uint16_t));
+    for (size_t i = 0; i < words; i++) {
+        h[i] = ntohs(h[i]);
+    }
+    image->storage = h;
+
+    if (words >= 2 && h[0] == IMAGE_MAGIC_HI && h[1] == IMAGE_MAGIC_LO) {
+        if (!parse_container(h, words, bytes, image, error)) {
+            image_free(image);
+            return false;
+        }
+        return true;
+    }
+
+    image->segments = (image_segment_t*) calloc(1, sizeof(image_segment_t));
+    image->segment_count = 1;
+    image->segments[0].origin = h[0];
+    image->segments[0].count = words - 1;
+    image->segments[0].words = h + 1;
+    return true;
+}
+
+// Read an image file of either format
+bool image_read(const char* path, image_t* image, const char** error) {
+    memset(image, 0, sizeof(image_t));
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        *error = "cannot open file";
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    void* data = malloc(size + 1);
+    size_t read = fread(data, 1, size, fp);
+    fclose(fp);
+    bool ok = image_parse(data, read, image, error);
+    free(data);
+    return ok;
+}
+
+// Free an image filled in by image_parse or image_read
+void image_free(image_t* image) {
+    free(image->segments);
+    free(image->symbols);
+    free(image->storage);
+    memset(image, 0, sizeof(image_t));
+}
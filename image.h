@@ -0,0 +1,81 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A program image: segments of words to load into memory, where to start
+// and the addresses of the labels it exports.
+//
+// A legacy image is an origin word followed by the words of a single
+// segment, and the machine starts at its default PC. A container holds
+// any number of segments and everything else. On disk everything is
+// stored as big endian 16 bit words:
+//
+//   "X1" "6I"              magic
+//   version                IMAGE_VERSION
+//   entry                  PC to start at
+//   segments               entries in the segment table
+//   symbols                entries in the symbol table
+//   strings                bytes of names, a multiple of 2, as 2 words
+//   segment[segments]      origin, words as 2 words
+//   symbol[symbols]        address, name offset as 2 words
+//   words                  of each segment in turn
+//   names                  NUL terminated, padded with NUL to a word
+//   crc                    CRC-32 of the bytes before it, as 2 words
+//
+// Segments must fit in memory and may not overlap. A legacy image that
+// starts with the magic cannot be told apart from a container, so its
+// origin must not be 0x5831 when the next word is 0x3649.
+#define IMAGE_MAGIC_HI      0x5831
+#define IMAGE_MAGIC_LO      0x3649
+#define IMAGE_VERSION       1
+
+typedef struct {
+    uint16_t origin;
+    uint32_t count;         // words, which may run past the end of
+                            // memory in a legacy image
+    uint16_t* words;        // in host order
+} image_segment_t;
+
+typedef struct {
+    uint16_t address;
+    const char* name;
+} image_symbol_t;
+
+typedef struct {
+    bool has_entry;         // false for a legacy image
+    uint16_t entry;
+    image_segment_t* segments;
+    uint16_t segment_count;
+    image_symbol_t* symbols;
+    uint16_t symbol_count;
+    void* storage;          // memory of an image that was read
+} image_t;
+
+// Whether an image has to be a container: it has several segments, an
+// entry or symbols
+bool image_is_container(const image_t* image);
+
+// Write an image in one go, as a legacy image when it does not have to
+// be a container so that older tools still read it. Return false on
+// errors.
+bool image_write(FILE* fp, const image_t* image);
+
+// Parse an image of either format from the bytes of a file. Return false
+// and set error to a message if it is malformed.
+bool image_parse(const void* data, size_t size, image_t* image,
+                 const char** error);
+
+// Read an image file of either format
+bool image_read(const char* path, image_t* image, const char** error);
+
+// Free an image filled in by image_parse or image_read
+void image_free(image_t* image);
+
+// CRC-32 of some bytes, as zlib and PNG compute it
+uint32_t image_crc32(const void* data, size_t size);
+
+#endif  // IMAGE_H_
@@ -116,11 +116,21 @@ uint16_t emit_str(reg_t src, reg_t base, uint16_t offset) {
     return (OP_STR << 12) | (src << 9) | (base << 6) | (offset & 0x3f);
 }
 
+// Emit a CAS instruction
+uint16_t emit_cas(reg_t dst, reg_t base, reg_t src) {
+    return (OP_CAS << 12) | (dst << 9) | (base << 6) | src;
+}
+
 // Emit a TRAP instruction
 uint16_t emit_trap(trap_t vec) {
     return (OP_TRAP << 12) | (vec & 0xff);
 }
 
+// Emit an RTI instruction
+uint16_t emit_rti() {
+    return OP_RTI << 12;
+}
+
 // Emit a value
 uint16_t emit_value(uint16_t val) {
     return val;
@@ -15,12 +15,12 @@ typedef enum {
     OP_AND,             // bitwise and
     OP_LDR,             // load register
     OP_STR,             // store register
-    OP_RTI,             // unused
+    OP_RTI,             // return from interrupt
     OP_NOT,             // bitwise not
     OP_LDI,             // load indirect
     OP_STI,             // store indirect
     OP_JMP,             // jump
-    OP_RES,             // reserved (unused)
+    OP_CAS,             // compare and swap, atomically
     OP_LEA,             // load effective address
     OP_TRAP             // execute trap
 } opcode_t;
@@ -98,9 +98,15 @@ uint16_t emit_sti(reg_t src, uint16_t offset);
 // Emit a STR instruction
 uint16_t emit_str(reg_t src, reg_t base, uint16_t offset);
 
+// Emit a CAS instruction
+uint16_t emit_cas(reg_t dst, reg_t base, reg_t src);
+
 // Emit a TRAP instruction
 uint16_t emit_trap(trap_t vec);
 
+// Emit an RTI instruction
+uint16_t emit_rti();
+
 // Emit a value
 uint16_t emit_value(uint16_t val);
 
@@ -0,0 +1,205 @@
+#include <stdbool.h>
+#include <string.h>
+#include "lexer.h"
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_name_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+        || c == '.';
+}
+
+static bool is_name(char c) {
+    return is_name_start(c) || is_digit(c);
+}
+
+static int hex_digit(char c) {
+    if (is_digit(c)) {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Start reading tokens from the source
+void lexer_init(lexer_t* lexer, const char* source, size_t size) {
+    lexer->cursor = source;
+    lexer->end = source + size;
+    lexer->line_start = source;
+    lexer->line = 1;
+}
+
+// Read the digits of a decimal or 0x hex number
+static bool scan_number(lexer_t* lexer, long* value) {
+    const char* p = lexer->cursor;
+    const char* end = lexer->end;
+    long n = 0;
+
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')
+        && hex_digit(p[2]) >= 0) {
+        p += 2;
+        while (p < end && hex_digit(*p) >= 0 && n <= 0xffffff) {
+            n = n * 16 + hex_digit(*p++);
+        }
+    } else if (p < end && is_digit(*p)) {
+        while (p < end && is_digit(*p) && n <= 0xffffff) {
+            n = n * 10 + (*p++ - '0');
+        }
+    } else {
+        return false;
+    }
+
+    // A number runs into no letters and has a sane size
+    if (p < end && is_name(*p)) {
+        return false;
+    }
+    lexer->cursor = p;
+    *value = n;
+    return true;
+}
+
+// Make the rest of a bad token part of it, so the next one starts clean
+static void skip_name(lexer_t* lexer) {
+    while (lexer->cursor < lexer->end && is_name(*lexer->cursor)) {
+        lexer->cursor++;
+    }
+}
+
+// Read the next token
+void lexer_next(lexer_t* lexer, token_t* token) {
+    const char* end = lexer->end;
+
+    // Skip blanks and comments
+    while (lexer->cursor < end) {
+        if (is_blank(*lexer->cursor)) {
+            lexer->cursor++;
+        } else if (*lexer->cursor == '#') {
+            while (lexer->cursor < end && *lexer->cursor != '\n') {
+                lexer->cursor++;
+            }
+        } else {
+            break;
+        }
+    }
+
+    const char* start = lexer->cursor;
+    token->text = start;
+    token->line = lexer->line;
+    token->column = (int) (start - lexer->line_start) + 1;
+    token->value = 0;
+    token->message = NULL;
+
+    if (start == end) {
+        token->kind = TOKEN_END;
+        token->length = 0;
+        return;
+    }
+
+    char c = *lexer->cursor++;
+    if (c == '\n') {
+        token->kind = TOKEN_NEWLINE;
+        lexer->line++;
+        lexer->line_start = lexer->cursor;
+    } else if (c == ',') {
+        token->kind = TOKEN_COMMA;
+    } else if (c == ':') {
+        token->kind = TOKEN_COLON;
+    } else if (is_name_start(c)) {
+        token->kind = TOKEN_NAME;
+        skip_name(lexer);
+    } else if (c == '%') {
+        const char* p = lexer->cursor;
+        if (end - p >= 2 && (p[0] == 'r' || p[0] == 'R')
+            && p[1] >= '0' && p[1] <= '7' && (end - p == 2 || !is_name(p[2]))) {
+            token->kind = TOKEN_REGISTER;
+            token->value = p[1] - '0';
+            lexer->cursor += 2;
+        } else {
+            token->kind = TOKEN_ERROR;
+            token->message = "expected a register %r0 to %r7";
+            skip_name(lexer);
+        }
+    } else if (c == '"') {
+        const char* p = lexer->cursor;
+        while (p < end && *p != '"' && *p != '\n') {
+            p += *p == '\\' && p + 1 < end && p[1] != '\n' ? 2 : 1;
+        }
+        if (p < end && *p == '"') {
+            token->kind = TOKEN_STRING;
+            lexer->cursor = p + 1;
+        } else {
+            token->kind = TOKEN_ERROR;
+            token->message = "missing closing quote";
+            lexer->cursor = p;
+        }
+    } else if (c == '$') {
+        token->kind = TOKEN_DOLLAR;
+    } else if (is_digit(c)) {
+        lexer->cursor--;
+        if (scan_number(lexer, &token->value)) {
+            token->kind = TOKEN_NUMBER;
+        } else {
+            token->kind = TOKEN_ERROR;
+            token->message = "malformed number";
+            skip_name(lexer);
+        }
+    } else if (c == '<' || c == '>') {
+        // Shifts are the only operators of two characters
+        if (lexer->cursor < end && *lexer->cursor == c) {
+            token->kind = TOKEN_OPERATOR;
+            token->value = c;
+            lexer->cursor++;
+        } else {
+            token->kind = TOKEN_ERROR;
+            token->message = c == '<' ? "expected <<" : "expected >>";
+        }
+    } else if (c != '\0' && strchr("+-*/%&|^~()", c) != NULL) {
+        token->kind = TOKEN_OPERATOR;
+        token->value = c;
+    } else {
+        token->kind = TOKEN_ERROR;
+        token->message = "unexpected character";
+    }
+    token->length = (int) (lexer->cursor - start);
+}
+
+// Decode the characters of a string token
+int lexer_string(const token_t* token, char* out) {
+    const char* p = token->text + 1;
+    const char* end = token->text + token->length - 1;
+    int n = 0;
+    while (p < end) {
+        char c = *p++;
+        if (c == '\\') {
+            c = *p++;
+            switch (c) {
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 'e':
+                c = 27;
+                break;
+            case '0':
+                c = '\0';
+                break;
+            }
+        }
+        out[n++] = c;
+    }
+    return n;
+}
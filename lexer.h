@@ -0,0 +1,52 @@
+#ifndef LEXER_H_
+#define LEXER_H_
+
+#include <stddef.h>
+
+// Kinds of tokens in assembly source
+typedef enum {
+    TOKEN_END = 0,      // end of the source
+    TOKEN_NEWLINE,
+    TOKEN_NAME,         // mnemonic or label
+    TOKEN_REGISTER,     // %r0 to %r7
+    TOKEN_NUMBER,       // decimal or 0x hex number
+    TOKEN_DOLLAR,       // $ in front of an immediate
+    TOKEN_OPERATOR,     // + - * / % & | ^ ~ ( ), and << and >> as < and >
+    TOKEN_STRING,       // in double quotes, with C escapes
+    TOKEN_COMMA,
+    TOKEN_COLON,
+    TOKEN_ERROR         // malformed input, described by message
+} token_kind_t;
+
+// A token. The text points into the source, which is never copied.
+typedef struct {
+    token_kind_t kind;
+    const char* text;
+    int length;
+    int line;           // 1 based
+    int column;         // 1 based
+    long value;         // register number, value of a number or the
+                        // character of an operator
+    const char* message;
+} token_t;
+
+// Splits a source buffer into tokens. Comments run from # to the end of
+// the line and are skipped along with blanks.
+typedef struct {
+    const char* cursor;
+    const char* end;
+    const char* line_start;
+    int line;
+} lexer_t;
+
+// Start reading tokens from the source
+void lexer_init(lexer_t* lexer, const char* source, size_t size);
+
+// Read the next token
+void lexer_next(lexer_t* lexer, token_t* token);
+
+// Decode the characters of a string token into out, which has room for
+// token->length bytes. Return the number of characters.
+int lexer_string(const token_t* token, char* out);
+
+#endif  // LEXER_H_
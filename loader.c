@@ -0,0 +1,24 @@
+#include "loader.h"
+
+// Words of a segment that fit in memory
+uint32_t loader_words(const image_segment_t* segment) {
+    uint32_t count = segment->count;
+    if (count > MAX_MEMORY - segment->origin) {
+        count = MAX_MEMORY - segment->origin;
+    }
+    return count;
+}
+
+// Load an image into a machine
+void loader_load(x16_t* machine, const image_t* image) {
+    for (int i = 0; i < image->segment_count; i++) {
+        const image_segment_t* segment = &image->segments[i];
+        uint32_t count = loader_words(segment);
+        for (uint32_t j = 0; j < count; j++) {
+            x16_memwrite(machine, segment->origin + j, segment->words[j]);
+        }
+    }
+    if (image->has_entry) {
+        x16_set(machine, R_PC, image->entry);
+    }
+}
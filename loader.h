@@ -0,0 +1,20 @@
+#ifndef LOADER_H_
+#define LOADER_H_
+
+#include <stdint.h>
+#include "image.h"
+#include "x16.h"
+
+// Loading program images into a machine, the one way every tool does it:
+// the words of each segment go to memory from its origin, and the machine
+// starts at the entry of a container. A legacy image keeps whatever PC
+// the machine had, its default one when fresh.
+
+// Words of a segment that fit in memory. Those past the end are dropped.
+uint32_t loader_words(const image_segment_t* segment);
+
+// Load an image into a machine. Words are written like the guest writes
+// them, so the fingerprint, dirty pages and version stay right.
+void loader_load(x16_t* machine, const image_t* image);
+
+#endif  // LOADER_H_
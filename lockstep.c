@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "control.h"
+#include "debugmap.h"
+#include "disasm.h"
+#include "fast.h"
+#include "lockstep.h"
+#include "tape.h"
+#include "x16.h"
+
+// One of the two machines in a lockstep run
+typedef struct {
+    x16_t* machine;
+    tape_head_t head;
+    x16_journal_t journal;
+    x16_io_t io;
+} side_t;
+
+static const char* register_names[MAX_STATE_REGISTERS] = {
+    "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND",
+    "PSR", "SSP", "USP", "POLL"
+};
+
+// Attach the tape head and journal of a side to its machine
+static void attach(side_t* side) {
+    tape_io(&side->head, &side->io);
+    x16_set_io(side->machine, &side->io);
+    x16_set_journal(side->machine, &side->journal);
+}
+
+// Put the machine back on the console
+static void detach(side_t* side) {
+    x16_set_io(side->machine, x16_console());
+    x16_set_journal(side->machine, NULL);
+    x16_journal_free(&side->journal);
+}
+
+// True if registers, memory and console input agree on both sides
+static bool agree(side_t* f, side_t* r) {
+    return memcmp(x16_registers(f->machine), x16_registers(r->machine),
+                  sizeof(uint16_t) * MAX_STATE_REGISTERS) == 0
+        && x16_fingerprint(f->machine) == x16_fingerprint(r->machine)
+        && f->head.cursor == r->head.cursor
+        && !r->head.overrun && !f->head.overrun;
+}
+
+// Report the instruction at pc as the first one the engines disagree on
+static void report(side_t* f, side_t* r, const debugmap_t* map,
+                   uint16_t pc, uint16_t word, int frv, int rrv,
+                   unsigned long long retired) {
+    char bits[20];
+    char symbol[256];
+    const char* file;
+    uint32_t line;
+    int n = 0;
+    for (int i = 15; i >= 0; i--) {
+        bits[n++] = '0' + ((word >> i) & 1);
+        if (i % 4 == 0 && i > 0) {
+            bits[n++] = ' ';
+        }
+    }
+    bits[n] = '\0';
+
+    char* text = decode(word);
+    fprintf(stderr, "lockstep: engines diverged after %llu instructions\n",
+            retired);
+    debugmap_format(map, pc, symbol, sizeof(symbol));
+    fprintf(stderr, "  0x%04x%s%s: %s : %s\n", pc, symbol[0] ? " " : "",
+            symbol, bits, text);
+    free(text);
+    if (map != NULL && debugmap_line(map, pc, &file, &line)) {
+        fprintf(stderr, "  at %s:%u\n", file, line);
+    }
+
+    uint16_t* freg = x16_registers(f->machine);
+    uint16_t* rreg = x16_registers(r->machine);
+    for (int i = 0; i < MAX_STATE_REGISTERS; i++) {
+        if (freg[i] != rreg[i]) {
+            fprintf(stderr, "  %-4s fast 0x%04x reference 0x%04x\n",
+                    register_names[i], freg[i], rreg[i]);
+        }
+    }
+    if (x16_fingerprint(f->machine) != x16_fingerprint(r->machine)) {
+        fprintf(stderr, "  memory fast 0x%08x reference 0x%08x\n",
+                x16_fingerprint(f->machine), x16_fingerprint(r->machine));
+    }
+    if (frv != rrv) {
+        fprintf(stderr, "  status fast %d reference %d\n", frv, rrv);
+    }
+    if (f->head.cursor != r->head.cursor || r->head.overrun) {
+        fprintf(stderr, "  console input consumed differently\n");
+    }
+}
+
+// Roll a diverging block back and replay it an instruction at a time
+static void locate(fast_t* engine, side_t* f, side_t* r,
+                   const debugmap_t* map, const analysis_t* analysis,
+                   const uint16_t* saved, size_t cursor, int count,
+                   unsigned long long retired) {
+    x16_journal_undo(f->machine, &f->journal);
+    x16_journal_undo(r->machine, &r->journal);
+
+    // What was decoded from words the block wrote is stale now
+    fast_set_analysis(engine, analysis);
+    memcpy(x16_registers(f->machine), saved,
+           sizeof(uint16_t) * MAX_STATE_REGISTERS);
+    memcpy(x16_registers(r->machine), saved,
+           sizeof(uint16_t) * MAX_STATE_REGISTERS);
+
+    // Every event of the block is on the tape already
+    f->head.cursor = r->head.cursor = cursor;
+    f->head.live = NULL;
+    f->head.overrun = r->head.overrun = false;
+
+    uint16_t start = saved[R_PC];
+    for (int i = 0; i < count; i++) {
+        uint16_t pc = x16_pc(f->machine);
+        uint16_t word = *x16_memory(f->machine, pc);
+        int frv = fast_step(engine, f->machine);
+        int rrv = execute_instruction(r->machine);
+        if (frv != rrv || !agree(f, r)) {
+            report(f, r, map, pc, word, frv, rrv, retired + i);
+            return;
+        }
+        if (frv != 0) {
+            break;
+        }
+    }
+
+    fprintf(stderr, "lockstep: engines diverged in the block at 0x%04x after "
+            "%llu instructions, but stepping it did not reproduce it\n",
+            start, retired);
+}
+
+// Run both engines side by side until HALT or the first divergence
+int lockstep_run(x16_t* fast_machine, x16_t* ref_machine,
+                 const debugmap_t* map, const analysis_t* analysis) {
+    fast_t* engine = fast_create();
+    fast_set_analysis(engine, analysis);
+    tape_t tape = {0};
+    side_t f = {0};
+    side_t r = {0};
+
+    // The fast side reads the console and records it; the reference side
+    // replays the recording and stays silent
+    f.machine = fast_machine;
+    f.head.tape = &tape;
+    f.head.live = x16_console();
+    r.machine = ref_machine;
+    r.head.tape = &tape;
+    r.head.mute = true;
+    attach(&f);
+    attach(&r);
+
+    unsigned long long retired = 0;
+    int result = 0;
+    for (;;) {
+        uint16_t saved[MAX_STATE_REGISTERS];
+        memcpy(saved, x16_registers(fast_machine), sizeof(saved));
+
+        // Both sides consumed the whole tape, so only the coming block's
+        // events need to be kept
+        tape.count = 0;
+        f.head.cursor = r.head.cursor = 0;
+        size_t cursor = 0;
+        f.journal.count = 0;
+        r.journal.count = 0;
+
+        int count;
+        int frv = fast_run_block(engine, fast_machine, &count);
+        int rrv = 0;
+        int n = 0;
+        while (n < count && rrv == 0) {
+            rrv = execute_instruction(ref_machine);
+            n++;
+        }
+
+        if (frv != rrv || n != count || !agree(&f, &r)) {
+            locate(engine, &f, &r, map, analysis, saved, cursor, count,
+                   retired);
+            result = 1;
+            break;
+        }
+        retired += count;
+        if (frv != 0) {
+            break;
+        }
+    }
+
+    detach(&f);
+    detach(&r);
+    tape_free(&tape);
+    fast_free(engine);
+    return result;
+}
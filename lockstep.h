@@ -0,0 +1,21 @@
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+
+#include "analysis.h"
+#include "debugmap.h"
+#include "x16.h"
+
+// Run the fast engine on one machine and the reference interpreter on
+// another, feeding both the same console input. The two machines must
+// hold the same image. After every basic block the registers and memory
+// fingerprints are compared; on the first mismatch the block is rolled
+// back and replayed one instruction at a time to find the diverging
+// instruction, which is reported on stderr along with its label and
+// source line if the debug map, which may be NULL, has them. The fast
+// engine trusts the analysis of the image unless it is NULL, which
+// checks the analysis along with the engine.
+// Return 0 when both engines halt in agreement or 1 on divergence.
+int lockstep_run(x16_t* fast_machine, x16_t* ref_machine,
+                 const debugmap_t* map, const analysis_t* analysis);
+
+#endif  // LOCKSTEP_H_
@@ -5,105 +5,475 @@
 #include <signal.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include "analysis.h"
+#include "assembler.h"
 #include "instruction.h"
 #include "x16.h"
 #include "io.h"
 #include "control.h"
+#include "debug.h"
+#include "debugmap.h"
+#include "fast.h"
+#include "fuzz.h"
+#include "image.h"
+#include "loader.h"
+#include "lockstep.h"
+#include "rollout.h"
+#include "smp.h"
+#include "snapshot.h"
 
 
-// Read Image File. Return 0 on success or -1 for failure
-static int read_image_file(x16_t* machine, FILE* fp) {
-    // The origin tells us where in memory to place the image
-    uint16_t origin;
-    if (fread(&origin, sizeof(origin), 1, fp) <= 0) {
+// Read an image file of either format. Return 0 on success or -1 for
+// failure, which has been reported.
+static int read_image(const char* image_path, image_t* image) {
+    const char* error = "no words";
+    bool ok = image_read(image_path, image, &error);
+    uint32_t words = 0;
+    for (int i = 0; ok && i < image->segment_count; i++) {
+        words += image->segments[i].count;
+    }
+    if (!ok || words == 0) {
+        fprintf(stderr, "Failed to read image: %s: %s\n", image_path, error);
+        image_free(image);
         return -1;
     }
-    // Swap to host format
-    origin = ntohs(origin);
+    return 0;
+}
 
-    // we know the maximum file size so we only need one fread
-    uint16_t max_read = UINT16_MAX - origin;
-    uint16_t* p = x16_memory(machine, origin);
-    size_t read = fread(p, sizeof(uint16_t), max_read, fp);
-    if (read <= 0) {
-        return -1;    // nothing read, or some error in fread
-    }
+// Whether a file is a source to assemble rather than an image
+static bool is_source(const char* path) {
+    const char* extension = ".x16s";
+    size_t length = strlen(path);
+    return length > strlen(extension)
+        && strcmp(path + length - strlen(extension), extension) == 0;
+}
 
-    // swap each 16 bit value to host format
-    while (read-- > 0) {
-        *p = ntohs(*p);
-        ++p;
+// Assemble a source file in memory, along with its debug map. Errors go
+// to stderr. Return 0 on success or -1 for failure.
+static int assemble_file(const char* source_path, assembly_t* assembly) {
+    FILE* fp = fopen(source_path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to read source: %s\n", source_path);
+        return -1;
     }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char* source = (char*) malloc(size + 1);
+    size_t read = fread(source, 1, size, fp);
+    fclose(fp);
 
+    assemble_options_t options = {
+        .name = source_path,
+        .debug = true,
+        .diagnostics = stderr,
+    };
+    bool ok = assemble(source, read, &options, assembly);
+    free(source);
+    if (!ok) {
+        assembly_free(assembly);
+        return -1;
+    }
     return 0;
 }
 
-// Read Image into memory. Return 0 on success or -1 for failure.
-static int read_image(x16_t* machine, const char* image_path) {
-    FILE* fp = fopen(image_path, "rb");
-    if (fp == NULL) {
+// An image or source given on the command line
+typedef struct {
+    const char* path;
+    bool from_source;
+    assembly_t assembly;    // of a source, which owns the image and map
+    image_t image;
+    debugmap_t map;
+    bool have_map;
+} program_t;
+
+// Read an image and its debug map if xas -g wrote one, or assemble a
+// source. Return 0 on success or -1 for failure, which has been reported.
+static int read_program(const char* path, program_t* program) {
+    memset(program, 0, sizeof(program_t));
+    program->path = path;
+    program->from_source = is_source(path);
+    if (program->from_source) {
+        if (assemble_file(path, &program->assembly) != 0) {
+            return -1;
+        }
+        program->image = program->assembly.image;
+        program->map = program->assembly.map;
+        program->have_map = true;
+        return 0;
+    }
+    if (read_image(path, &program->image) != 0) {
         return -1;
     }
-    int rv = read_image_file(machine, fp);
-    fclose(fp);
+    const char* error;
+    char* map_path = debugmap_path(path);
+    program->have_map = debugmap_read(map_path, &program->map, &error);
+    free(map_path);
+    return 0;
+}
+
+static void free_program(program_t* program) {
+    if (program->from_source) {
+        assembly_free(&program->assembly);
+        return;
+    }
+    image_free(&program->image);
+    if (program->have_map) {
+        debugmap_free(&program->map);
+    }
+}
+
+// A segment of one of the programs, for finding overlaps
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    int program;
+} extent_t;
+
+static int compare_extents(const void* a, const void* b) {
+    const extent_t* x = (const extent_t*) a;
+    const extent_t* y = (const extent_t*) b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+// Check that no two programs load words at the same address. Return 0 if
+// they do not, or -1 after reporting the first overlap.
+static int check_overlap(const program_t* programs, int count) {
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        total += programs[i].image.segment_count;
+    }
+    extent_t* extents = (extent_t*) malloc((total + 1) * sizeof(extent_t));
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const image_t* image = &programs[i].image;
+        for (int j = 0; j < image->segment_count; j++) {
+            const image_segment_t* segment = &image->segments[j];
+            extents[n].start = segment->origin;
+            extents[n].end = segment->origin + loader_words(segment);
+            extents[n++].program = i;
+        }
+    }
+    qsort(extents, n, sizeof(extent_t), compare_extents);
+
+    int rv = 0;
+    for (int i = 1; i < n; i++) {
+        if (extents[i].start < extents[i - 1].end) {
+            fprintf(stderr, "Images overlap at 0x%04x: %s and %s\n",
+                    extents[i].start, programs[extents[i - 1].program].path,
+                    programs[extents[i].program].path);
+            rv = -1;
+            break;
+        }
+    }
+    free(extents);
     return rv;
 }
 
+// Load every program in order, so the entry of the last container wins,
+// then the start PC if one was given
+static void load_programs(x16_t* machine, const program_t* programs,
+                          int count, long start) {
+    for (int i = 0; i < count; i++) {
+        loader_load(machine, &programs[i].image);
+    }
+    if (start >= 0) {
+        x16_set(machine, R_PC, start);
+    }
+
+    // Snapshots hold the pages that differ from the programs
+    x16_mark_clean(machine);
+}
+
+// Parse the start PC, a number or a label of a debug map or exported by a
+// container. Return -1 if it is neither.
+static long parse_start(const char* text, const program_t* programs,
+                        int count, const debugmap_t* map) {
+    char* end;
+    long value = strtol(text, &end, 0);
+    if (*text != '\0' && *end == '\0') {
+        return value >= 0 && value < MAX_MEMORY ? value : -1;
+    }
+    uint16_t address;
+    if (map != NULL && debugmap_find(map, text, &address)) {
+        return address;
+    }
+    for (int i = 0; i < count; i++) {
+        const image_t* image = &programs[i].image;
+        for (int j = 0; j < image->symbol_count; j++) {
+            if (strcmp(image->symbols[j].name, text) == 0) {
+                return image->symbols[j].address;
+            }
+        }
+    }
+    return -1;
+}
+
 static void usage() {
-    printf("Usage: x16 [-l] image-file1\n");
+    printf("Usage: x16 [-l] [-f | -V | -d | -A] [-s pc] [-R snapshot] "
+           "file...\n"
+           "       x16 [-f] -c cores [-s pc] file...\n"
+           "       x16 -F [-n steps] [-s pc] file... [input-file]\n"
+           "       x16 -B dir [-f] [-n steps] [-s pc] file...\n"
+           "Each file is an image, or a source ending in .x16s that is\n"
+           "assembled and run directly. Files are loaded in order and may\n"
+           "not overlap. The machine starts at the pc given with -s, a\n"
+           "number or a label, else at the entry of the last file that has\n"
+           "one, else at 0x3000. -A prints what static analysis finds\n"
+           "about the code and stores of the files instead of running.\n"
+           "-c runs that many cores sharing memory, each on a thread.\n"
+           "-R resumes from a snapshot the debugger saved over the same\n"
+           "files. -B runs the files once for each input file in dir,\n"
+           "many machines side by side, or one at a time with -f.\n");
     exit(1);
 }
 
+// Run on the terminal under the debugger, checked against the reference
+// machine if there is one, or on the chosen engine and number of cores.
+// The fast engine trusts the analysis if there is one.
+static int run(x16_t* machine, x16_t* reference, const debugmap_t* map,
+               const analysis_t* analysis, bool debug, bool use_fast,
+               int cores) {
+    // Set up signal handler to clean up TTY state on SIGINT
+    signal(SIGINT, handle_interrupt);
+
+    // Disable so we can read keystrokes without newline
+    disable_input_buffering();
+
+    // Execute the emulation till we see a halt or some error occurs
+    int status = 0;
+    if (debug) {
+        status = debug_run(machine, map);
+    } else if (reference != NULL) {
+        status = lockstep_run(machine, reference, map, analysis);
+        x16_free(reference);
+    } else if (cores > 1) {
+        status = smp_run(machine, cores, use_fast);
+    } else if (use_fast) {
+        fast_t* engine = fast_create();
+        fast_set_analysis(engine, analysis);
+        int count;
+        for (;;) {
+            if (LOG) {
+                // Log each instruction, so go one at a time
+                x16_print(machine);
+                if (fast_step(engine, machine) != 0) {
+                    break;
+                }
+            } else if (fast_run_block(engine, machine, &count) != 0) {
+                break;
+            }
+        }
+        fast_free(engine);
+    } else {
+        for (;;) {
+            if (LOG) {
+                x16_print(machine);
+            }
+            if (execute_instruction(machine) != 0) {
+                break;
+            }
+        }
+    }
+
+    // Restore TTY state
+    restore_input_buffering();
+    return status;
+}
+
 int main(int argc, char** argv) {
     int ch;
-    while ((ch = getopt(argc, argv, "l")) != -1) {
+    bool use_fast = false;
+    bool validate = false;
+    bool debug = false;
+    bool fuzz = false;
+    bool report = false;
+    long budget = DEFAULT_FUZZ_BUDGET;
+    char* start_text = NULL;
+    int cores = 1;
+    char* snapshot_path = NULL;
+    char* rollout_dir = NULL;
+    while ((ch = getopt(argc, argv, "lfVdFAn:s:c:R:B:")) != -1) {
         switch (ch) {
         case 'l':
             LOG = 1;
             break;
 
+        case 'f':
+            // Run the fast engine instead of the interpreter
+            use_fast = true;
+            break;
+
+        case 'V':
+            // Run the fast engine checked against the interpreter
+            validate = true;
+            break;
+
+        case 'd':
+            // Run under the debugger
+            debug = true;
+            break;
+
+        case 'F':
+            // Run as the target of a coverage guided fuzzer
+            fuzz = true;
+            break;
+
+        case 'A':
+            // Print the static analysis of the programs and stop
+            report = true;
+            break;
+
+        case 'n':
+            // Instructions each fuzz input or rollout may run for
+            budget = atol(optarg);
+            break;
+
+        case 's':
+            // Start here rather than at the entry of the programs
+            start_text = optarg;
+            break;
+
+        case 'c':
+            // Cores sharing the memory of the machine
+            cores = atoi(optarg);
+            break;
+
+        case 'R':
+            // Resume from a snapshot taken over the same programs
+            snapshot_path = optarg;
+            break;
+
+        case 'B':
+            // Run once for each input in the directory, batched
+            rollout_dir = optarg;
+            break;
+
         default:
             usage();
         }
     }
     argc -= optind;
     argv += optind;
-
-
-    char* filename = "a.obj";
-    if (argc > 1) {
+    if (cores < 1 || cores > MAX_CORES
+        || (cores > 1 && (validate || debug || fuzz || LOG))
+        || (rollout_dir != NULL
+            && (cores > 1 || validate || debug || fuzz || report || LOG))) {
         usage();
-    } else if (argc == 1) {
-        filename = argv[0];
     }
 
-    // Initialize machine
-    x16_t* machine = x16_create();
+    // The fuzzer takes its input after the files, when there are several
+    char* default_file = "a.obj";
+    char** files = &default_file;
+    int file_count = 1;
+    char* input = NULL;
+    if (fuzz && argc >= 2) {
+        input = argv[--argc];
+    }
+    if (argc >= 1) {
+        files = argv;
+        file_count = argc;
+    }
 
-    // Read the image file into memory
-    if (read_image(machine, filename) != 0) {
-        fprintf(stderr, "Failed to read image: %s\n", filename);
+    // Sources are assembled straight into memory, with no image or debug
+    // map written out. Images bring the debug map next to them if xas -g
+    // wrote one.
+    program_t* programs = (program_t*) calloc(file_count, sizeof(program_t));
+    for (int i = 0; i < file_count; i++) {
+        if (read_program(files[i], &programs[i]) != 0) {
+            exit(1);
+        }
+    }
+    if (check_overlap(programs, file_count) != 0) {
         exit(1);
     }
 
-    // Set up signal handler to clean up TTY state on SIGINT
-    signal(SIGINT, handle_interrupt);
+    // Labels and source lines come from every map there is
+    debugmap_t* maps = (debugmap_t*) calloc(file_count, sizeof(debugmap_t));
+    int map_count = 0;
+    for (int i = 0; i < file_count; i++) {
+        if (programs[i].have_map) {
+            maps[map_count++] = programs[i].map;
+        }
+    }
+    debugmap_t map;
+    bool have_map = map_count > 0;
+    if (have_map) {
+        debugmap_merge(&map, maps, map_count);
+    }
+    free(maps);
 
-    // Disable so we can read keystrokes without newline
-    disable_input_buffering();
+    long start = -1;
+    if (start_text != NULL) {
+        start = parse_start(start_text, programs, file_count,
+                            have_map ? &map : NULL);
+        if (start < 0) {
+            fprintf(stderr, "Bad start pc: %s\n", start_text);
+            exit(1);
+        }
+    }
 
-    // Execute the emulation till we see a halt or some error occurs
-    for (;;) {
-        if (LOG) {
-            x16_print(machine);
+    // Initialize machine and load the programs into memory
+    x16_t* machine = x16_create();
+    load_programs(machine, programs, file_count, start);
+
+    // The reference machine for lockstep validation gets the same programs
+    x16_t* reference = NULL;
+    if (validate) {
+        reference = x16_create();
+        load_programs(reference, programs, file_count, start);
+    }
+
+    // Both go on from where the snapshot was taken
+    if (snapshot_path != NULL) {
+        snapshot_t snapshot;
+        const char* error;
+        if (!snapshot_read(snapshot_path, &snapshot, &error)) {
+            fprintf(stderr, "Can't read %s: %s\n", snapshot_path, error);
+            exit(1);
         }
-        if (execute_instruction(machine) != 0) {
-            break;
+        if (snapshot.baseline != x16_fingerprint(machine)) {
+            fprintf(stderr, "Can't resume from %s: it was saved over other "
+                    "programs\n", snapshot_path);
+            exit(1);
+        }
+        snapshot_restore(&snapshot, machine);
+        if (reference != NULL) {
+            snapshot_restore(&snapshot, reference);
         }
+        snapshot_free(&snapshot);
     }
 
-    // Restore TTY state
-    restore_input_buffering();
+    // The fast engine skips checking for modified code where static
+    // analysis shows stores cannot have written it
+    analysis_t* analysis = NULL;
+    if (report || (use_fast && cores == 1 && rollout_dir == NULL)
+        || validate) {
+        analysis = (analysis_t*) malloc(sizeof(analysis_t));
+        analysis_run(analysis, machine);
+    }
+
+    // The fuzzer feeds input itself and leaves the terminal alone
+    int status = 0;
+    if (report) {
+        analysis_write_report(analysis, stdout);
+    } else if (fuzz) {
+        status = fuzz_run(machine, input, budget);
+    } else if (rollout_dir != NULL) {
+        status = rollout_run(machine, rollout_dir, budget, !use_fast);
+    } else {
+        status = run(machine, reference, have_map ? &map : NULL, analysis,
+                     debug, use_fast, cores);
+    }
+    free(analysis);
 
+    for (int i = 0; i < file_count; i++) {
+        free_program(&programs[i]);
+    }
+    free(programs);
+    if (have_map) {
+        debugmap_free(&map);
+    }
     x16_free(machine);
+    return status;
 }
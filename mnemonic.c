@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include "mnemonic.h"
+
+// Slots in the mnemonic table, a power of 2
+#define TABLE_SIZE      128
+
+// Longest mnemonic
+#define MAX_MNEMONIC    5
+
+// Mnemonics in the table. Two entries for one slot leave only the last,
+// so the check below counts them.
+#define MNEMONICS       31
+
+// Every mnemonic sits in the slot its hash picks, and no two mnemonics
+// hash to the same slot, so a lookup is one hash and one compare. The
+// multiplier was searched for offline; adding a mnemonic that collides
+// trips the check on the first lookup.
+static const mnemonic_t table[TABLE_SIZE] = {
+    [0] = {"putc", OP_TRAP, FORMAT_NONE, OP_TRAP << 12 | TRAP_OUT},
+    [4] = {"puts", OP_TRAP, FORMAT_NONE, OP_TRAP << 12 | TRAP_PUTS},
+    [17] = {"cas", OP_CAS, FORMAT_CAS, 0},
+    [25] = {"jmp", OP_JMP, FORMAT_BASE, 0},
+    [28] = {"val", OP_BR, FORMAT_VALUE, 0},
+    [29] = {"trap", OP_TRAP, FORMAT_TRAP, 0},
+    [42] = {"sti", OP_STI, FORMAT_PCREL, 0},
+    [44] = {"str", OP_STR, FORMAT_BASE_OFFSET, 0},
+    [45] = {"ld", OP_LD, FORMAT_PCREL, 0},
+    [47] = {"jsr", OP_JSR, FORMAT_JSR, 0},
+    [48] = {"getc", OP_TRAP, FORMAT_NONE, OP_TRAP << 12 | TRAP_GETC},
+    [54] = {"br", OP_BR, FORMAT_BRANCH, 0},
+    [62] = {"ldi", OP_LDI, FORMAT_PCREL, 0},
+    [64] = {"ldr", OP_LDR, FORMAT_BASE_OFFSET, 0},
+    [66] = {"brnp", OP_BR, FORMAT_BRANCH, FL_NEG | FL_POS},
+    [68] = {"brnz", OP_BR, FORMAT_BRANCH, FL_NEG | FL_ZRO},
+    [75] = {"and", OP_AND, FORMAT_ALU, 0},
+    [81] = {"add", OP_ADD, FORMAT_ALU, 0},
+    [85] = {"lea", OP_LEA, FORMAT_PCREL, 0},
+    [92] = {"not", OP_NOT, FORMAT_NOT, 0},
+    [94] = {"brnzp", OP_BR, FORMAT_BRANCH, FL_NEG | FL_ZRO | FL_POS},
+    [96] = {"st", OP_ST, FORMAT_PCREL, 0},
+    [102] = {"rti", OP_RTI, FORMAT_NONE, OP_RTI << 12},
+    [105] = {"enter", OP_TRAP, FORMAT_NONE, OP_TRAP << 12 | TRAP_IN},
+    [106] = {"jsrr", OP_JSR, FORMAT_BASE, 0},
+    [109] = {"halt", OP_TRAP, FORMAT_NONE, OP_TRAP << 12 | TRAP_HALT},
+    [110] = {"brzp", OP_BR, FORMAT_BRANCH, FL_ZRO | FL_POS},
+    [117] = {"brn", OP_BR, FORMAT_BRANCH, FL_NEG},
+    [118] = {"brp", OP_BR, FORMAT_BRANCH, FL_POS},
+    [119] = {"putsp", OP_TRAP, FORMAT_NONE, OP_TRAP << 12 | TRAP_PUTSP},
+    [120] = {"brz", OP_BR, FORMAT_BRANCH, FL_ZRO},
+};
+
+// Hash of a mnemonic, which is a slot in the table
+static unsigned hash(const char* name, int length) {
+    uint32_t x = length;
+    for (int i = 0; i < length; i++) {
+        x = x * 100 + (unsigned char) name[i];
+    }
+    return (x >> 2) & (TABLE_SIZE - 1);
+}
+
+// Check that every mnemonic sits in its own slot and looks itself up
+static void check_table(void) {
+    int count = 0;
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        const char* name = table[i].name;
+        if (name == NULL) {
+            continue;
+        }
+        int length = strlen(name);
+        assert(length <= MAX_MNEMONIC);
+        assert(hash(name, length) == (unsigned) i);
+        assert(mnemonic_find(name, length) == &table[i]);
+        count++;
+    }
+    assert(count == MNEMONICS);
+}
+
+// Find a mnemonic
+const mnemonic_t* mnemonic_find(const char* name, int length) {
+    if (length < 1 || length > MAX_MNEMONIC) {
+        return NULL;
+    }
+    static bool checked = false;
+    if (!checked) {
+        checked = true;
+        check_table();
+    }
+    const mnemonic_t* m = &table[hash(name, length)];
+    if (m->name == NULL || strncmp(m->name, name, length) != 0
+        || m->name[length] != '\0') {
+        return NULL;
+    }
+    return m;
+}
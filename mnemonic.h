@@ -0,0 +1,35 @@
+#ifndef MNEMONIC_H_
+#define MNEMONIC_H_
+
+#include <stdint.h>
+#include "instruction.h"
+
+// Operands an instruction takes
+typedef enum {
+    FORMAT_NONE = 0,    // no operands, the word is fixed
+    FORMAT_ALU,         // register, register, register or immediate
+    FORMAT_NOT,         // register, register
+    FORMAT_BRANCH,      // label, 9 bit offset
+    FORMAT_JSR,         // label, 11 bit offset
+    FORMAT_BASE,        // register
+    FORMAT_PCREL,       // register, label with 9 bit offset
+    FORMAT_BASE_OFFSET, // register, register, 6 bit immediate
+    FORMAT_CAS,         // register, register, register
+    FORMAT_TRAP,        // trap vector
+    FORMAT_VALUE        // a word of data
+} format_t;
+
+// What a mnemonic assembles to
+typedef struct {
+    const char* name;
+    opcode_t opcode;
+    format_t format;
+    uint16_t bits;      // condition bits of a branch, or the whole word
+                        // of an instruction without operands
+} mnemonic_t;
+
+// Find a mnemonic. The name does not need to be NUL terminated.
+// Return NULL if there is no such mnemonic.
+const mnemonic_t* mnemonic_find(const char* name, int length);
+
+#endif  // MNEMONIC_H_
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "object.h"
+
+// Words in the header
+#define HEADER_WORDS    9
+
+// Words in a symbol table entry
+#define SYMBOL_WORDS    4
+
+// Write an object to a file in one go
+bool object_write(FILE* fp, const object_t* object) {
+    size_t strings = 0;
+    for (int i = 0; i < object->symbol_count; i++) {
+        strings += strlen(object->symbols[i].name) + 1;
+    }
+    strings = (strings + 1) & ~1;
+
+    size_t words = HEADER_WORDS + object->count
+        + SYMBOL_WORDS * object->symbol_count
+        + 3 * object->fixup_count + strings / 2;
+    uint16_t* buffer = (uint16_t*) calloc(words, sizeof(uint16_t));
+    uint16_t* p = buffer;
+    *p++ = htons(OBJECT_MAGIC_HI);
+    *p++ = htons(OBJECT_MAGIC_LO);
+    *p++ = htons(OBJECT_VERSION);
+    *p++ = 0;
+    *p++ = htons(object->count);
+    *p++ = htons(object->symbol_count);
+    *p++ = htons(object->fixup_count);
+    *p++ = htons(strings >> 16);
+    *p++ = htons(strings & 0xffff);
+
+    for (int i = 0; i < object->count; i++) {
+        *p++ = htons(object->code[i]);
+    }
+
+    char* names = (char*) (p + SYMBOL_WORDS * object->symbol_count
+                           + 3 * object->fixup_count);
+    size_t offset = 0;
+    for (int i = 0; i < object->symbol_count; i++) {
+        const object_symbol_t* symbol = &object->symbols[i];
+        size_t length = strlen(symbol->name) + 1;
+        memcpy(names + offset, symbol->name, length);
+        *p++ = htons(offset >> 16);
+        *p++ = htons(offset & 0xffff);
+        *p++ = htons(symbol->value);
+        *p++ = htons(symbol->flags);
+        offset += length;
+    }
+    for (int i = 0; i < object->fixup_count; i++) {
+        const object_fixup_t* fixup = &object->fixups[i];
+        *p++ = htons(fixup->index);
+        *p++ = htons(fixup->symbol);
+        *p++ = htons(fixup->kind);
+    }
+
+    bool ok = fwrite(buffer, sizeof(uint16_t), words, fp) == words;
+    free(buffer);
+    return ok;
+}
+
+// Read an object file
+bool object_read(const char* path, object_t* object, const char** error) {
+    memset(object, 0, sizeof(object_t));
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        *error = "cannot open file";
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint16_t* buffer = (uint16_t*) malloc(size + 1);
+    size_t words = fread(buffer, 1, size, fp) / 2;
+    fclose(fp);
+
+    for (size_t i = 0; i < words; i++) {
+        buffer[i] = ntohs(buffer[i]);
+    }
+    uint16_t* h = buffer;
+    if (words < HEADER_WORDS || h[0] != OBJECT_MAGIC_HI
+        || h[1] != OBJECT_MAGIC_LO) {
+        *error = "not an object file";
+        free(buffer);
+        return false;
+    }
+    if (h[2] != OBJECT_VERSION) {
+        *error = "unsupported object version";
+        free(buffer);
+        return false;
+    }
+    object->count = h[4];
+    object->symbol_count = h[5];
+    object->fixup_count = h[6];
+    size_t strings = (size_t) h[7] << 16 | h[8];
+    if (words != HEADER_WORDS + object->count
+        + SYMBOL_WORDS * object->symbol_count
+        + 3 * object->fixup_count + strings / 2 || strings % 2 != 0) {
+        *error = "truncated object file";
+        free(buffer);
+        return false;
+    }
+
+    uint16_t* p = buffer + HEADER_WORDS;
+    object->code = (uint16_t*) malloc((object->count + 1) * sizeof(uint16_t));
+    memcpy(object->code, p, object->count * sizeof(uint16_t));
+    p += object->count;
+
+    // The names were byte swapped along with everything else
+    uint16_t* names = p + SYMBOL_WORDS * object->symbol_count
+        + 3 * object->fixup_count;
+    object->strings = (char*) malloc(strings + 1);
+    for (size_t i = 0; i < strings / 2; i++) {
+        uint16_t word = htons(names[i]);
+        memcpy(object->strings + 2 * i, &word, 2);
+    }
+    object->strings[strings] = '\0';
+
+    object->symbols = (object_symbol_t*) calloc(object->symbol_count + 1,
+                                                sizeof(object_symbol_t));
+    for (int i = 0; i < object->symbol_count; i++, p += SYMBOL_WORDS) {
+        size_t name = (size_t) p[0] << 16 | p[1];
+        if (name >= strings) {
+            *error = "bad symbol name";
+            free(buffer);
+            object_free(object);
+            return false;
+        }
+        object->symbols[i].name = object->strings + name;
+        object->symbols[i].value = p[2];
+        object->symbols[i].flags = p[3];
+    }
+
+    object->fixups = (object_fixup_t*) calloc(object->fixup_count + 1,
+                                              sizeof(object_fixup_t));
+    for (int i = 0; i < object->fixup_count; i++, p += 3) {
+        if (p[0] >= object->count || p[1] >= object->symbol_count
+            || fixup_bits(p[2]) == 0) {
+            *error = "bad fixup";
+            free(buffer);
+            object_free(object);
+            return false;
+        }
+        object->fixups[i].index = p[0];
+        object->fixups[i].symbol = p[1];
+        object->fixups[i].kind = p[2];
+    }
+
+    free(buffer);
+    return true;
+}
+
+// Free an object filled in by object_read
+void object_free(object_t* object) {
+    free(object->code);
+    free(object->symbols);
+    free(object->fixups);
+    free(object->strings);
+    memset(object, 0, sizeof(object_t));
+}
+
+// Width of the offset field a fixup patches
+int fixup_bits(uint16_t kind) {
+    switch (kind) {
+    case FIXUP_PC9:
+        return 9;
+    case FIXUP_PC11:
+        return 11;
+    case FIXUP_ABS16:
+        return 16;
+    default:
+        return 0;
+    }
+}
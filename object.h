@@ -0,0 +1,80 @@
+#ifndef OBJECT_H_
+#define OBJECT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A relocatable object holds the code of one source file assembled
+// without knowing where it will end up, the labels it defines and uses,
+// and the places in the code that need a label from another file. xld
+// links objects into an image.
+//
+// On disk everything is stored as big endian 16 bit words, like images:
+//
+//   "X1" "6R"              magic
+//   version                OBJECT_VERSION
+//   flags                  reserved, 0
+//   count                  words of code
+//   symbols                entries in the symbol table
+//   fixups                 entries in the fixup table
+//   strings                bytes of names, a multiple of 2, as 2 words
+//                          with the high word first
+//   code[count]
+//   symbol[symbols]        name offset as 2 words, value, flags
+//   fixup[fixups]          word index, symbol index, kind
+//   names                  NUL terminated, padded with NUL to a word
+#define OBJECT_MAGIC_HI     0x5831
+#define OBJECT_MAGIC_LO     0x3652
+#define OBJECT_VERSION      1
+
+// Flags of a symbol
+typedef enum {
+    SYMBOL_DEFINED = 1,     // value is an index into the code
+    SYMBOL_EXPORT = 2       // other objects may use it
+} symbol_flag_t;
+
+// What a fixup patches
+typedef enum {
+    FIXUP_PC9 = 1,          // 9 bit PC relative offset of BR, LD, ST, LEA...
+    FIXUP_PC11 = 2,         // 11 bit PC relative offset of JSR
+    FIXUP_ABS16 = 3         // the whole word is the address, from .fill
+} fixup_kind_t;
+
+typedef struct {
+    const char* name;
+    uint16_t value;         // word index relative to the start of the code
+    uint16_t flags;
+} object_symbol_t;
+
+// A word whose offset field must be set to reach an undefined symbol
+typedef struct {
+    uint16_t index;         // word to patch
+    uint16_t symbol;        // index into the symbol table
+    uint16_t kind;
+} object_fixup_t;
+
+typedef struct {
+    uint16_t* code;         // host byte order
+    uint16_t count;
+    object_symbol_t* symbols;
+    uint16_t symbol_count;
+    object_fixup_t* fixups;
+    uint16_t fixup_count;
+    char* strings;          // names of an object that was read
+} object_t;
+
+// Write an object to a file in one go. Return false on errors.
+bool object_write(FILE* fp, const object_t* object);
+
+// Read an object file. Return false and set error to a message if the
+// file cannot be read or is malformed.
+bool object_read(const char* path, object_t* object, const char** error);
+
+// Free an object filled in by object_read
+void object_free(object_t* object);
+
+// Width of the offset field a fixup patches
+int fixup_bits(uint16_t kind);
+
+#endif  // OBJECT_H_
@@ -0,0 +1,247 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bits.h"
+#include "instruction.h"
+#include "peephole.h"
+#include "x16.h"
+
+// Longest chain of branches followed
+#define MAX_CHAIN 16
+
+// Width of the PC relative offset of an instruction, 0 if it has none
+static int offset_bits(uint16_t word) {
+    switch (getopcode(word)) {
+    case OP_BR:
+        return getbits(word, 9, 3) != 0 ? 9 : 0;
+    case OP_JSR:
+        return getbit(word, 11) ? 11 : 0;
+    case OP_LD:
+    case OP_LDI:
+    case OP_LEA:
+    case OP_ST:
+    case OP_STI:
+        return 9;
+    default:
+        return 0;
+    }
+}
+
+// Index of the word a PC relative instruction at index refers to
+static int target_of(uint16_t word, int index) {
+    int bits = offset_bits(word);
+    return index + 1 + (int16_t) sign_extend(getbits(word, 0, bits), bits);
+}
+
+// Encode the offset from index to target, if it fits
+static bool retarget(uint16_t* word, int index, int target) {
+    int bits = offset_bits(*word);
+    int offset = target - (index + 1);
+    if (offset < -(1 << (bits - 1)) || offset >= (1 << (bits - 1))) {
+        return false;
+    }
+    uint16_t mask = (1 << bits) - 1;
+    *word = (*word & ~mask) | (offset & mask);
+    return true;
+}
+
+static bool is_unconditional_branch(uint16_t word) {
+    return getopcode(word) == OP_BR && getbits(word, 9, 3) == 7;
+}
+
+// True if the instruction sets the condition codes from its result
+static bool sets_cond(uint16_t word) {
+    switch (getopcode(word)) {
+    case OP_ADD:
+    case OP_AND:
+    case OP_NOT:
+    case OP_LD:
+    case OP_LDI:
+    case OP_LDR:
+    case OP_LEA:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// True if execution never falls through to the next word
+static bool ends_flow(uint16_t word) {
+    opcode_t op = getopcode(word);
+    return is_unconditional_branch(word) || op == OP_JMP || op == OP_RTI
+        || word == emit_trap(TRAP_HALT);
+}
+
+// add %rX, %rX, $0
+static bool is_nop_add(uint16_t word) {
+    return getopcode(word) == OP_ADD && getbit(word, 5)
+        && getbits(word, 9, 3) == getbits(word, 6, 3)
+        && getbits(word, 0, 5) == 0;
+}
+
+// An instruction of the code with a PC relative offset to keep right
+static bool is_relative(uint16_t word, uint8_t flags) {
+    return (flags & (WORD_CODE | WORD_EXTERN)) == WORD_CODE
+        && offset_bits(word) != 0;
+}
+
+// Set the new index of every word with the removed ones closed up, words
+// after a gap staying where they are. Return the new count.
+static int compact(const uint8_t* flags, const bool* removed, int count,
+                   int* remap) {
+    int n = 0;
+    for (int i = 0; i <= count; i++) {
+        if (i > 0 && (flags[i - 1] & WORD_GAP)
+            && (i == count || !(flags[i] & WORD_GAP))) {
+            n = i;
+        }
+        remap[i] = n;
+        if (i < count && !removed[i] && !(flags[i] & WORD_GAP)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+// Where the word a target index named went. Targets outside the code and
+// in gaps keep their addresses.
+static int moved(const uint8_t* flags, int count, const int* remap,
+                 int target) {
+    if (target < 0 || target > count
+        || (target < count && (flags[target] & WORD_GAP))) {
+        return target;
+    }
+    return remap[target];
+}
+
+// Optimize assembled code in place
+int peephole_optimize(uint16_t* code, const uint8_t* flags, int count,
+                      uint16_t origin, int* remap) {
+    // Words that control or an address may reach
+    bool* reached = (bool*) calloc(count + 1, sizeof(bool));
+    bool* removed = (bool*) calloc(count + 1, sizeof(bool));
+    int* targets = (int*) malloc((count + 1) * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        targets[i] = -1;
+        reached[i] |= (flags[i] & WORD_LABEL) != 0;
+        if ((flags[i] & (WORD_CODE | WORD_EXTERN)) == WORD_CODE
+            && offset_bits(code[i]) != 0) {
+            int target = target_of(code[i], i);
+            if (target >= 0 && target <= count) {
+                targets[i] = target;
+                reached[target] = true;
+            }
+        }
+    }
+
+    // A load right after a store to the same place copies the register
+    for (int i = 0; i + 1 < count; i++) {
+        uint16_t st = code[i];
+        uint16_t ld = code[i + 1];
+        if (!(flags[i] & flags[i + 1] & WORD_CODE) || reached[i + 1]) {
+            continue;
+        }
+        // Only ST and LD name their address: a base register may point
+        // at a device register, where a load does more than read
+        if (getopcode(st) == OP_ST && getopcode(ld) == OP_LD
+            && targets[i] >= 0 && targets[i] == targets[i + 1]
+            && targets[i] != i + 1 && origin + targets[i] < MMIO_BASE) {
+            code[i + 1] = emit_add_imm(getbits(ld, 9, 3), getbits(st, 9, 3), 0);
+            targets[i + 1] = -1;
+        }
+    }
+
+    // Branch to where a chain of unconditional branches ends up
+    for (int i = 0; i < count; i++) {
+        int target = targets[i];
+        opcode_t op = getopcode(code[i]);
+        if (target < 0 || (op != OP_BR && op != OP_JSR)) {
+            continue;
+        }
+        int hops = 0;
+        while (target < count && target != i && hops++ < MAX_CHAIN
+               && (flags[target] & (WORD_CODE | WORD_EXTERN)) == WORD_CODE
+               && is_unconditional_branch(code[target])
+               && targets[target] >= 0 && targets[target] != target) {
+            target = targets[target];
+        }
+        if (target != targets[i] && retarget(&code[i], i, target)) {
+            targets[i] = target;
+        }
+    }
+
+    // Remove instructions that do nothing, last first so that the next
+    // instruction left is known
+    int next = -1;
+    for (int i = count - 1; i >= 0; i--) {
+        uint16_t word = code[i];
+        if (!(flags[i] & WORD_CODE) || (flags[i] & WORD_EXTERN)) {
+            next = i;
+            continue;
+        }
+        if (getopcode(word) == OP_BR
+            && (getbits(word, 9, 3) == 0 || targets[i] == i + 1)) {
+            removed[i] = true;
+        } else if (is_nop_add(word) && next >= 0 && (flags[next] & WORD_CODE)
+                   && sets_cond(code[next])) {
+            removed[i] = true;
+        } else {
+            next = i;
+        }
+    }
+
+    // Remove code no label or branch reaches
+    for (int i = 0; i < count; i++) {
+        if (!(flags[i] & WORD_CODE) || removed[i] || !ends_flow(code[i])) {
+            continue;
+        }
+        for (int j = i + 1; j < count && flags[j] == WORD_CODE && !reached[j];
+             j++) {
+            removed[j] = true;
+        }
+    }
+
+    // Close up what was removed, then point offsets at where their
+    // targets went. An offset that no longer fits gets back the words
+    // removed before it and its target, which leaves it as it was.
+    int n = compact(flags, removed, count, remap);
+    for (int i = 0; i < count; i++) {
+        uint16_t word = code[i];
+        if (!is_relative(word, flags[i]) || removed[i]) {
+            continue;
+        }
+        int target = target_of(word, i);
+        if (!retarget(&word, remap[i], moved(flags, count, remap, target))) {
+            for (int j = 0; j < (target < i ? target : i); j++) {
+                removed[j] = false;
+            }
+            n = compact(flags, removed, count, remap);
+            i = -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (is_relative(code[i], flags[i]) && !removed[i]) {
+            retarget(&code[i], remap[i],
+                     moved(flags, count, remap, target_of(code[i], i)));
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (!removed[i] && !(flags[i] & WORD_GAP)) {
+            code[remap[i]] = code[i];
+        }
+    }
+    // A gap starts where the words before it now end
+    for (int i = 0; i < count; i++) {
+        if (flags[i] & WORD_GAP) {
+            bool first = i == 0 || !(flags[i - 1] & WORD_GAP);
+            for (int j = first ? remap[i] : i; j <= i; j++) {
+                code[j] = 0;
+            }
+        }
+    }
+
+    free(reached);
+    free(removed);
+    free(targets);
+    return n;
+}
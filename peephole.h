@@ -0,0 +1,38 @@
+#ifndef PEEPHOLE_H_
+#define PEEPHOLE_H_
+
+#include <stdint.h>
+
+// What the optimizer knows about each word
+typedef enum {
+    WORD_CODE = 1,      // an instruction, otherwise data that is kept as is
+    WORD_LABEL = 2,     // a label names the word, so control may reach it
+    WORD_EXTERN = 4,    // a field is filled in later, by the linker or
+                        // the assembler, so the word is left alone
+    WORD_GAP = 8        // skipped by .orig: the words after a gap keep
+                        // their addresses, and the gap grows instead
+} word_flag_t;
+
+// Optimize assembled code in place. The words are in host byte order and
+// the first one is at origin. Instructions are removed or rewritten when
+// that cannot change what the program does, assuming it does not modify
+// its own code:
+//
+//   - branches and JSRs to an unconditional branch go to its target
+//   - branches that never branch or go to the next word are removed
+//   - add %rX, %rX, $0 is removed when the next instruction sets the
+//     condition codes anyway
+//   - ld right after st to the same address below the device registers
+//     becomes a register copy, which the rule above may remove
+//   - code that follows halt, an unconditional branch, jmp or rti and
+//     that has no label is removed
+//
+// Every PC relative offset is encoded again for where its instruction
+// and target end up; words are kept where an offset would not fit
+// otherwise. remap has room for count + 1 entries and is set to the new
+// index of every word, with removed words going to the word after them
+// and gap words to where their gap now starts. Return the new count.
+int peephole_optimize(uint16_t* code, const uint8_t* flags, int count,
+                      uint16_t origin, int* remap);
+
+#endif  // PEEPHOLE_H_
@@ -0,0 +1,221 @@
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "batch.h"
+#include "fast.h"
+#include "rollout.h"
+
+// Largest input that is read
+#define MAX_KEYS       (1 << 20)
+
+// Keystrokes of the input of a lane
+typedef struct {
+    uint8_t* data;
+    size_t length;
+    size_t position;
+    bool exhausted;     // the guest asked for more keys than the input has
+
+    // Stopped when the input is exhausted, if running batched
+    batch_t* batch;
+    int lane;
+} keys_t;
+
+static void exhaust(keys_t* keys) {
+    keys->exhausted = true;
+    if (keys->batch != NULL) {
+        batch_stop(keys->batch, keys->lane);
+    }
+}
+
+static int keys_ready(void* ctx) {
+    keys_t* keys = (keys_t*) ctx;
+    if (keys->position == keys->length) {
+        exhaust(keys);
+        return 0;
+    }
+    return 1;
+}
+
+static int keys_get(void* ctx) {
+    keys_t* keys = (keys_t*) ctx;
+    if (keys->position == keys->length) {
+        exhaust(keys);
+        return 0;
+    }
+    return keys->data[keys->position++];
+}
+
+static void keys_put(void* ctx, int c) {
+    // Runs are judged by where they end, not by what they print
+}
+
+// Take only regular files
+static int is_file(const struct dirent* entry) {
+    return entry->d_type == DT_REG;
+}
+
+// Read an input into the keys. Return false if it cannot be read.
+static bool read_input(const char* path, keys_t* keys) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return false;
+    }
+    keys->length = fread(keys->data, 1, MAX_KEYS, fp);
+    keys->position = 0;
+    keys->exhausted = false;
+    fclose(fp);
+    return true;
+}
+
+// Run one lane on the fast engine. Return its steps.
+static uint32_t run_alone(fast_t* engine, x16_t* machine, keys_t* keys,
+                          uint32_t budget, bool* halted) {
+    uint32_t steps = 0;
+    int count;
+    int rv = 0;
+    while (rv == 0 && steps < budget && !keys->exhausted) {
+        uint32_t limit = budget - steps;
+        rv = fast_run(engine, machine,
+                      limit < INT32_MAX ? (int) limit : INT32_MAX, &count);
+        steps += count;
+    }
+    *halted = rv == -1;
+    return steps;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// How a run ended
+typedef struct {
+    uint32_t steps;
+    bool halted;
+    bool exhausted;
+    uint32_t fingerprint;
+} result_t;
+
+// Reset a lane to the loaded machine and feed it an input. Return false
+// if the input cannot be read.
+static bool start_lane(x16_t* lane, keys_t* keys, x16_t* machine,
+                       const char* dir, const char* name) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    x16_reset_to(lane, machine);
+    if (!read_input(path, keys)) {
+        keys->length = 0;
+        return false;
+    }
+    return true;
+}
+
+static void finish(result_t* result, x16_t* lane, keys_t* keys,
+                   uint32_t steps, bool halted) {
+    result->steps = steps;
+    result->halted = halted;
+    result->exhausted = keys->exhausted;
+    result->fingerprint = x16_fingerprint(lane);
+}
+
+// Run the machine once for every input in the directory
+int rollout_run(x16_t* machine, const char* dir, long budget, bool batched) {
+    struct dirent** names;
+    int total = scandir(dir, &names, is_file, alphasort);
+    if (total < 0) {
+        perror(dir);
+        return 1;
+    }
+    if (budget < 0 || budget > UINT32_MAX) {
+        budget = UINT32_MAX;
+    }
+
+    x16_t* lanes[BATCH_LANES];
+    keys_t keys[BATCH_LANES];
+    x16_io_t io[BATCH_LANES];
+    for (int i = 0; i < BATCH_LANES; i++) {
+        lanes[i] = x16_create();
+        memset(&keys[i], 0, sizeof(keys_t));
+        keys[i].data = (uint8_t*) malloc(MAX_KEYS);
+        keys[i].lane = i;
+        io[i] = (x16_io_t) { keys_ready, keys_get, keys_put, &keys[i] };
+        x16_set_io(lanes[i], &io[i]);
+    }
+
+    int status = 0;
+    result_t* results = (result_t*) calloc(total + 1, sizeof(result_t));
+    double start = now();
+    if (batched && total > 0) {
+        // A lane that ends starts on the next input straight away
+        int running[BATCH_LANES];
+        int next = 0;
+        for (; next < total && next < BATCH_LANES; next++) {
+            running[next] = next;
+            if (!start_lane(lanes[next], &keys[next], machine, dir,
+                            names[next]->d_name)) {
+                status = 1;
+            }
+        }
+        batch_t* batch = batch_create(lanes, next);
+        for (int i = 0; i < next; i++) {
+            keys[i].batch = batch;
+        }
+        int lane;
+        while ((lane = batch_run(batch, budget)) >= 0) {
+            finish(&results[running[lane]], lanes[lane], &keys[lane],
+                   batch_steps(batch, lane), batch_halted(batch, lane));
+            if (next < total) {
+                running[lane] = next;
+                if (!start_lane(lanes[lane], &keys[lane], machine, dir,
+                                names[next++]->d_name)) {
+                    status = 1;
+                }
+                batch_restart(batch, lane);
+            }
+        }
+        batch_free(batch);
+    } else {
+        fast_t* engine = fast_create();
+        for (int i = 0; i < total; i++) {
+            if (!start_lane(lanes[0], &keys[0], machine, dir,
+                            names[i]->d_name)) {
+                status = 1;
+            }
+            bool halted;
+            uint32_t steps = run_alone(engine, lanes[0], &keys[0], budget,
+                                       &halted);
+            finish(&results[i], lanes[0], &keys[0], steps, halted);
+        }
+        fast_free(engine);
+    }
+    double elapsed = now() - start;
+
+    uint64_t steps = 0;
+    for (int i = 0; i < total; i++) {
+        printf("%s/%s: %s after %u steps, memory 0x%08x\n", dir,
+               names[i]->d_name, results[i].halted ? "halted"
+               : results[i].exhausted ? "ran out of input"
+               : "ran out of steps", results[i].steps,
+               results[i].fingerprint);
+        steps += results[i].steps;
+    }
+    fprintf(stderr, "%d runs, %llu steps in %.3f s, %.1f million steps/s\n",
+            total, (unsigned long long) steps, elapsed,
+            elapsed > 0 ? steps / elapsed / 1e6 : 0.0);
+
+    free(results);
+    for (int i = 0; i < total; i++) {
+        free(names[i]);
+    }
+    free(names);
+    for (int i = 0; i < BATCH_LANES; i++) {
+        x16_free(lanes[i]);
+        free(keys[i].data);
+    }
+    return status;
+}
@@ -0,0 +1,19 @@
+#ifndef ROLLOUT_H_
+#define ROLLOUT_H_
+
+#include <stdbool.h>
+#include "x16.h"
+
+// Run the loaded machine once for every regular file in a directory,
+// taken in name order, feeding the file to the guest as keystrokes. A run
+// ends when the guest halts, asks for more keys than the file has or has
+// run budget instructions. Guest output is dropped; each run is reported
+// on stdout with its end, steps and memory fingerprint, and the rate of
+// instructions over all runs on stderr.
+//
+// With batched the runs go BATCH_LANES at a time on the batched engine,
+// otherwise one by one on the fast engine, with the same results. The
+// machine itself is left as it was loaded.
+int rollout_run(x16_t* machine, const char* dir, long budget, bool batched);
+
+#endif  // ROLLOUT_H_
@@ -0,0 +1,60 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "control.h"
+#include "fast.h"
+#include "smp.h"
+
+typedef struct {
+    x16_t* machine;
+    bool use_fast;
+    pthread_t thread;
+} core_t;
+
+// Run one core until it halts
+static void* run_core(void* arg) {
+    core_t* core = (core_t*) arg;
+    if (core->use_fast) {
+        // No analysis: it cannot see the stores of other cores
+        fast_t* engine = fast_create();
+        int count;
+        while (fast_run_block(engine, core->machine, &count) == 0) {
+        }
+        fast_free(engine);
+    } else {
+        while (execute_instruction(core->machine) == 0) {
+        }
+    }
+    return NULL;
+}
+
+// Run the machine on several cores until all of them halt
+int smp_run(x16_t* machine, int cores, bool use_fast) {
+    core_t* all = (core_t*) calloc(cores, sizeof(core_t));
+    for (int i = 0; i < cores; i++) {
+        all[i].machine = i == 0 ? machine : x16_create_core(machine, i);
+        all[i].use_fast = use_fast;
+    }
+
+    // Every core is set up before any of them writes memory
+    int started = 0;
+    for (; started < cores; started++) {
+        if (pthread_create(&all[started].thread, NULL, run_core,
+                           &all[started]) != 0) {
+            fprintf(stderr, "Can't start core %d\n", started);
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(all[i].thread, NULL);
+    }
+
+    // Each core kept count of its own writes only
+    x16_rehash(machine);
+
+    for (int i = 1; i < cores; i++) {
+        x16_free(all[i].machine);
+    }
+    free(all);
+    return started == cores ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+#ifndef SMP_H_
+#define SMP_H_
+
+#include <stdbool.h>
+#include "x16.h"
+
+// Most cores a machine can run with
+#define MAX_CORES       64
+
+// Run a loaded machine on several cores, each on a host thread of its
+// own, until every core has halted. Core 0 is the machine; the others
+// are added with x16_create_core and start at the same PC with the same
+// registers, so programs tell them apart by reading MR_CORE.
+//
+// Memory ordering: cores share one memory with no caches of their own.
+// Loads and stores are relaxed atomic 16 bit accesses, which never
+// tear, but they are not ordered between cores: a core may see the
+// stores of another late and in any order, and its own loads and stores
+// may be seen by others out of order. CAS is the only synchronization. It is
+// atomic and sequentially consistent, and a full barrier: loads and
+// stores before it on a core are seen by every core before it, and
+// those after it are seen after it. A lock is taken with a CAS loop and
+// released with another CAS, not a plain store.
+//
+// While the cores run, the fingerprint, dirty pages and version of each
+// core count only its own writes. Once they all halted these are made
+// right again for the machine by x16_rehash, which takes every page as
+// dirty. Only core 0 drives the keyboard: reads of KBSR and KBDR on
+// other cores have no side effects, and they take no keyboard
+// interrupts. Traps that read and write the console run on any core.
+//
+// With use_fast each core runs the fast engine, which compares every
+// word it runs with what it decoded, so cores see code that others
+// rewrote. Return 0 once every core halts.
+int smp_run(x16_t* machine, int cores, bool use_fast);
+
+#endif  // SMP_H_
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "image.h"
+#include "snapshot.h"
+
+// Words before the registers, and of the CRC at the end
+#define HEADER_WORDS    5
+#define CRC_WORDS       2
+
+// Take the registers and dirty pages of a machine
+void snapshot_take(snapshot_t* snapshot, x16_t* machine) {
+    snapshot->baseline = x16_clean_fingerprint(machine);
+    memcpy(snapshot->registers, x16_registers(machine),
+           sizeof(snapshot->registers));
+    snapshot->page_count = 0;
+    snapshot->pages = (uint8_t*) malloc(MAX_PAGES);
+    for (int page = 0; page < MAX_PAGES; page++) {
+        if (x16_page_dirty(machine, page)) {
+            snapshot->pages[snapshot->page_count++] = page;
+        }
+    }
+    snapshot->words = (uint16_t*) malloc(
+        snapshot->page_count * PAGE_WORDS * sizeof(uint16_t));
+    for (int i = 0; i < snapshot->page_count; i++) {
+        memcpy(snapshot->words + i * PAGE_WORDS,
+               x16_memory(machine, snapshot->pages[i] << PAGE_SHIFT),
+               PAGE_WORDS * sizeof(uint16_t));
+    }
+}
+
+// Write the snapshot into a machine. Words go through x16_memwrite so the
+// fingerprint and dirty pages stay right.
+void snapshot_restore(const snapshot_t* snapshot, x16_t* machine) {
+    for (int i = 0; i < snapshot->page_count; i++) {
+        uint16_t first = snapshot->pages[i] << PAGE_SHIFT;
+        const uint16_t* words = snapshot->words + i * PAGE_WORDS;
+        for (int j = 0; j < PAGE_WORDS; j++) {
+            if (*x16_memory(machine, first + j) != words[j]) {
+                x16_memwrite(machine, first + j, words[j]);
+            }
+        }
+    }
+    memcpy(x16_registers(machine), snapshot->registers,
+           sizeof(snapshot->registers));
+}
+
+// Write a snapshot in one go
+bool snapshot_write(FILE* fp, const snapshot_t* snapshot) {
+    size_t words = HEADER_WORDS + MAX_STATE_REGISTERS + 1
+        + snapshot->page_count * (1 + PAGE_WORDS) + CRC_WORDS;
+    uint16_t* buffer = (uint16_t*) malloc(words * sizeof(uint16_t));
+    uint16_t* p = buffer;
+    *p++ = htons(SNAPSHOT_MAGIC_HI);
+    *p++ = htons(SNAPSHOT_MAGIC_LO);
+    *p++ = htons(SNAPSHOT_VERSION);
+    *p++ = htons(snapshot->baseline >> 16);
+    *p++ = htons(snapshot->baseline & 0xffff);
+    for (int i = 0; i < MAX_STATE_REGISTERS; i++) {
+        *p++ = htons(snapshot->registers[i]);
+    }
+    *p++ = htons(snapshot->page_count);
+    for (int i = 0; i < snapshot->page_count; i++) {
+        *p++ = htons(snapshot->pages[i]);
+        for (int j = 0; j < PAGE_WORDS; j++) {
+            *p++ = htons(snapshot->words[i * PAGE_WORDS + j]);
+        }
+    }
+
+    size_t size = (words - CRC_WORDS) * sizeof(uint16_t);
+    uint32_t crc = image_crc32(buffer, size);
+    buffer[words - 2] = htons(crc >> 16);
+    buffer[words - 1] = htons(crc & 0xffff);
+    bool ok = fwrite(buffer, sizeof(uint16_t), words, fp) == words;
+    free(buffer);
+    return ok;
+}
+
+// Check the words of a snapshot file and take its contents
+static bool parse(const uint16_t* data, size_t words, snapshot_t* snapshot,
+                  const char** error) {
+    size_t fixed = HEADER_WORDS + MAX_STATE_REGISTERS + 1 + CRC_WORDS;
+    if (words < fixed || ntohs(data[0]) != SNAPSHOT_MAGIC_HI
+        || ntohs(data[1]) != SNAPSHOT_MAGIC_LO) {
+        *error = "not a snapshot";
+        return false;
+    }
+    if (ntohs(data[2]) != SNAPSHOT_VERSION) {
+        *error = "unknown version";
+        return false;
+    }
+    snapshot->baseline = (uint32_t) ntohs(data[3]) << 16 | ntohs(data[4]);
+    const uint16_t* p = data + HEADER_WORDS;
+    for (int i = 0; i < MAX_STATE_REGISTERS; i++) {
+        snapshot->registers[i] = ntohs(*p++);
+    }
+    snapshot->page_count = ntohs(*p++);
+    if (snapshot->page_count > MAX_PAGES
+        || words != fixed + snapshot->page_count * (1 + PAGE_WORDS)) {
+        *error = "truncated";
+        return false;
+    }
+    uint32_t crc = (uint32_t) ntohs(data[words - 2]) << 16
+        | ntohs(data[words - 1]);
+    if (image_crc32(data, (words - CRC_WORDS) * sizeof(uint16_t)) != crc) {
+        *error = "bad CRC";
+        return false;
+    }
+
+    snapshot->pages = (uint8_t*) malloc(MAX_PAGES);
+    snapshot->words = (uint16_t*) malloc(
+        snapshot->page_count * PAGE_WORDS * sizeof(uint16_t));
+    for (int i = 0; i < snapshot->page_count; i++) {
+        uint16_t page = ntohs(*p++);
+        if (page >= MAX_PAGES) {
+            *error = "bad page number";
+            snapshot_free(snapshot);
+            return false;
+        }
+        snapshot->pages[i] = page;
+        for (int j = 0; j < PAGE_WORDS; j++) {
+            snapshot->words[i * PAGE_WORDS + j] = ntohs(*p++);
+        }
+    }
+    return true;
+}
+
+// Read a snapshot file
+bool snapshot_read(const char* path, snapshot_t* snapshot,
+                   const char** error) {
+    memset(snapshot, 0, sizeof(snapshot_t));
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        *error = "cannot open file";
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint16_t* data = (uint16_t*) malloc(size + 1);
+    size_t read = fread(data, 1, size, fp);
+    fclose(fp);
+    bool ok = read % sizeof(uint16_t) == 0
+        && parse(data, read / sizeof(uint16_t), snapshot, error);
+    if (read % sizeof(uint16_t) != 0) {
+        *error = "truncated";
+    }
+    free(data);
+    return ok;
+}
+
+// Free a snapshot
+void snapshot_free(snapshot_t* snapshot) {
+    free(snapshot->pages);
+    free(snapshot->words);
+    memset(snapshot, 0, sizeof(snapshot_t));
+}
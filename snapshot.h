@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "x16.h"
+
+// The state of a machine as a delta: its registers and only the pages of
+// memory that are dirty, written since the last reset or since memory
+// was marked clean. Restoring it onto a machine that holds that
+// reference state again gives back the whole state. The fingerprint of
+// the reference is kept, to tell which memory the delta applies to.
+//
+// On disk everything is stored as big endian 16 bit words:
+//
+//   "X1" "6S"              magic
+//   version                SNAPSHOT_VERSION
+//   baseline               fingerprint of the reference, as 2 words
+//   registers              MAX_STATE_REGISTERS words
+//   pages                  how many follow
+//   page[pages]            its number, then its words
+//   crc                    CRC-32 of the bytes before it, as 2 words
+#define SNAPSHOT_MAGIC_HI   0x5831
+#define SNAPSHOT_MAGIC_LO   0x3653
+#define SNAPSHOT_VERSION    2
+
+// Words in a page
+#define PAGE_WORDS          (1 << PAGE_SHIFT)
+
+typedef struct {
+    uint32_t baseline;      // x16_clean_fingerprint of the machine
+    uint16_t registers[MAX_STATE_REGISTERS];
+    uint16_t page_count;
+    uint8_t* pages;         // number of each page
+    uint16_t* words;        // PAGE_WORDS words of each page in turn
+} snapshot_t;
+
+// Take the registers and dirty pages of a machine
+void snapshot_take(snapshot_t* snapshot, x16_t* machine);
+
+// Write the pages and registers of a snapshot into a machine that holds
+// the state it was taken against, which the caller checks by comparing
+// the fingerprint of its memory with baseline
+void snapshot_restore(const snapshot_t* snapshot, x16_t* machine);
+
+// Write a snapshot in one go. Return false on errors.
+bool snapshot_write(FILE* fp, const snapshot_t* snapshot);
+
+// Read a snapshot file. Return false and set error to a message if it is
+// malformed.
+bool snapshot_read(const char* path, snapshot_t* snapshot,
+                   const char** error);
+
+// Free a snapshot filled in by snapshot_take or snapshot_read
+void snapshot_free(snapshot_t* snapshot);
+
+#endif  // SNAPSHOT_H_
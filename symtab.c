@@ -0,0 +1,128 @@
+#include <string.h>
+#include "symtab.h"
+
+// Initial number of hash slots, always a power of 2
+#define INITIAL_SLOTS   64
+
+// A symbol along with what the table needs to find it
+typedef struct {
+    symbol_t symbol;
+    size_t length;
+    uint32_t hash;
+} entry_t;
+
+struct symtab {
+    arena_t* arena;         // everything below
+    entry_t** slots;        // open addressing, linear probing
+    size_t capacity;
+    entry_t** order;        // entries in the order they were added
+    size_t count;
+    size_t allocated;
+};
+
+// FNV-1a hash of a name
+static uint32_t hash_name(const char* name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Allocate zeroed hash slots
+static entry_t** new_slots(arena_t* arena, size_t capacity) {
+    entry_t** slots = (entry_t**) arena_alloc(arena,
+                                              capacity * sizeof(entry_t*));
+    memset(slots, 0, capacity * sizeof(entry_t*));
+    return slots;
+}
+
+// Create an empty symbol table
+symtab_t* symtab_create(arena_t* arena) {
+    symtab_t* table = (symtab_t*) arena_alloc(arena, sizeof(symtab_t));
+    memset(table, 0, sizeof(symtab_t));
+    table->arena = arena;
+    table->capacity = INITIAL_SLOTS;
+    table->slots = new_slots(arena, table->capacity);
+    return table;
+}
+
+// Find the slot that holds the name, or the empty slot where it belongs
+static entry_t** probe(symtab_t* table, const char* name, size_t length,
+                       uint32_t hash) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (table->slots[i] != NULL) {
+        entry_t* entry = table->slots[i];
+        if (entry->hash == hash && entry->length == length
+            && memcmp(entry->symbol.name, name, length) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+// Double the number of slots
+static void grow(symtab_t* table) {
+    entry_t** old = table->slots;
+    size_t capacity = table->capacity;
+    table->capacity *= 2;
+    table->slots = new_slots(table->arena, table->capacity);
+    for (size_t i = 0; i < capacity; i++) {
+        if (old[i] != NULL) {
+            size_t j = old[i]->hash & (table->capacity - 1);
+            while (table->slots[j] != NULL) {
+                j = (j + 1) & (table->capacity - 1);
+            }
+            table->slots[j] = old[i];
+        }
+    }
+}
+
+// Find a symbol by name
+symbol_t* symtab_find(symtab_t* table, const char* name, size_t length) {
+    entry_t* entry = *probe(table, name, length, hash_name(name, length));
+    return entry != NULL ? &entry->symbol : NULL;
+}
+
+// Find a symbol by name, adding an undefined one if it is not there
+symbol_t* symtab_intern(symtab_t* table, const char* name, size_t length) {
+    uint32_t hash = hash_name(name, length);
+    entry_t** slot = probe(table, name, length, hash);
+    if (*slot != NULL) {
+        return &(*slot)->symbol;
+    }
+
+    // Keep the load factor under one half
+    if (2 * (table->count + 1) > table->capacity) {
+        grow(table);
+        slot = probe(table, name, length, hash);
+    }
+
+    entry_t* entry = (entry_t*) arena_alloc(table->arena, sizeof(entry_t));
+    memset(entry, 0, sizeof(entry_t));
+    entry->symbol.name = arena_strndup(table->arena, name, length);
+    entry->length = length;
+    entry->hash = hash;
+    *slot = entry;
+
+    if (table->count == table->allocated) {
+        size_t allocated = table->allocated ? table->allocated * 2 : 64;
+        table->order = (entry_t**) arena_grow(table->arena, table->order,
+            table->allocated * sizeof(entry_t*), allocated * sizeof(entry_t*));
+        table->allocated = allocated;
+    }
+    table->order[table->count++] = entry;
+    return &entry->symbol;
+}
+
+// Number of symbols in the table
+size_t symtab_count(symtab_t* table) {
+    return table->count;
+}
+
+// Get a symbol by the order it was added in
+symbol_t* symtab_at(symtab_t* table, size_t index) {
+    return &table->order[index]->symbol;
+}
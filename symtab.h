@@ -0,0 +1,46 @@
+#ifndef SYMTAB_H_
+#define SYMTAB_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+// A label known to the assembler
+typedef struct {
+    const char* name;       // interned and NUL terminated
+    uint16_t address;       // address of the word the label names
+    int line;               // source line of the definition, or of the
+                            // declaration until it is defined
+    bool defined;
+    bool exported;          // visible to other objects
+    bool imported;          // defined by another object
+    int pending;            // 1 + index of the last unresolved use, or 0
+    int index;              // position in the symbols of an object
+    int expression;         // 1 + index of the expression of a constant
+                            // set by .equ, or 0 for a label
+} symbol_t;
+
+// A symbol table. Names are hashed once and interned, so finding a label
+// costs the same however many labels there are, and the table grows
+// without limit.
+typedef struct symtab symtab_t;
+
+// Create an empty symbol table. The table, the symbols and their names
+// are allocated from the arena and go away with it.
+symtab_t* symtab_create(arena_t* arena);
+
+// Find a symbol by name. Return NULL if it is not in the table
+symbol_t* symtab_find(symtab_t* table, const char* name, size_t length);
+
+// Find a symbol by name, adding an undefined one if it is not there.
+// Symbols never move, so the pointer stays valid as the table grows.
+symbol_t* symtab_intern(symtab_t* table, const char* name, size_t length);
+
+// Number of symbols in the table
+size_t symtab_count(symtab_t* table);
+
+// Get a symbol by the order it was added in
+symbol_t* symtab_at(symtab_t* table, size_t index);
+
+#endif  // SYMTAB_H_
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "tape.h"
+
+// Append an event to the tape
+static void record(tape_t* tape, tape_kind_t kind, int value) {
+    if (tape->count == tape->capacity) {
+        tape->capacity = tape->capacity ? tape->capacity * 2 : 1024;
+        tape->events = (tape_event_t*) realloc(tape->events,
+            tape->capacity * sizeof(tape_event_t));
+    }
+    tape->events[tape->count].kind = kind;
+    tape->events[tape->count].value = value;
+    tape->count++;
+}
+
+// Produce the next event of the given kind, either from the tape or from
+// the live device
+static int next(tape_head_t* head, tape_kind_t kind) {
+    tape_t* tape = head->tape;
+    if (head->cursor < tape->count) {
+        tape_event_t* event = &tape->events[head->cursor++];
+        if (event->kind != kind) {
+            head->overrun = true;
+        }
+        return event->value;
+    }
+
+    if (head->live == NULL) {
+        // Nothing left to replay
+        head->overrun = true;
+        return kind == TAPE_POLL ? 0 : EOF;
+    }
+
+    int value = kind == TAPE_POLL
+        ? head->live->key_ready(head->live->ctx)
+        : head->live->get_key(head->live->ctx);
+    record(tape, kind, value);
+    head->cursor++;
+    return value;
+}
+
+static int head_key_ready(void* ctx) {
+    return next((tape_head_t*) ctx, TAPE_POLL);
+}
+
+static int head_get_key(void* ctx) {
+    return next((tape_head_t*) ctx, TAPE_KEY);
+}
+
+static void head_put_char(void* ctx, int c) {
+    tape_head_t* head = (tape_head_t*) ctx;
+    if (!head->mute && head->live != NULL) {
+        head->live->put_char(head->live->ctx, c);
+    }
+}
+
+// Fill in console hooks that read and write through the head
+void tape_io(tape_head_t* head, x16_io_t* io) {
+    io->key_ready = head_key_ready;
+    io->get_key = head_get_key;
+    io->put_char = head_put_char;
+    io->ctx = head;
+}
+
+// Release the events held by a tape
+void tape_free(tape_t* tape) {
+    free(tape->events);
+    tape->events = NULL;
+    tape->count = tape->capacity = 0;
+}
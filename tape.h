@@ -0,0 +1,46 @@
+#ifndef TAPE_H_
+#define TAPE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "x16.h"
+
+// Kinds of console events that are recorded on a tape
+typedef enum {
+    TAPE_POLL = 0,      // result of a key_ready check
+    TAPE_KEY            // keystroke returned by get_key
+} tape_kind_t;
+
+// A single console input event
+typedef struct {
+    tape_kind_t kind;
+    int value;
+} tape_event_t;
+
+// A recording of every console input event a machine observed. Replaying
+// it makes a run deterministic regardless of when keys were pressed.
+typedef struct {
+    tape_event_t* events;
+    size_t count;
+    size_t capacity;
+} tape_t;
+
+// A position on a tape that a machine reads its console input from.
+// Events are replayed while the head is behind the end of the tape. At
+// the end, input comes from the live device and is appended to the
+// tape; a head without a live device marks the run as overrun instead.
+typedef struct {
+    tape_t* tape;
+    size_t cursor;
+    const x16_io_t* live;   // device to record from, or NULL
+    bool mute;              // drop output instead of writing it
+    bool overrun;           // set when replay asked for a missing event
+} tape_head_t;
+
+// Fill in console hooks that read and write through the head
+void tape_io(tape_head_t* head, x16_io_t* io);
+
+// Release the events held by a tape
+void tape_free(tape_t* tape);
+
+#endif  // TAPE_H_
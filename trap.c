@@ -7,6 +7,12 @@
 #include "bits.h"
 #include "control.h"
 
+// Write a string to the console of the machine
+static void put_string(x16_t* machine, const char* str) {
+    while (*str != '\0') {
+        x16_putchar(machine, *str++);
+    }
+}
 
 int trap(x16_t* machine, uint16_t instruction) {
     uint16_t vec = getbits(instruction, 0, 8);
@@ -22,7 +28,7 @@ int trap(x16_t* machine, uint16_t instruction) {
         // We do this by calling getchar, and setting the data to be
         // in the memory data register. It will get moved to R0 in the
         // WB stage.
-        key = getchar();
+        key = x16_getchar(machine);
         if (key == EOF) {
             perror("Getchar error");
             abort();
@@ -35,7 +41,7 @@ int trap(x16_t* machine, uint16_t instruction) {
         // TRAP OUT
         // Write a single char in R0 to output
         c = x16_reg(machine, R_R0);
-        putchar((char) c);
+        x16_putchar(machine, (char) c);
         fflush(stdout);
         break;
 
@@ -45,7 +51,7 @@ int trap(x16_t* machine, uint16_t instruction) {
         base = x16_reg(machine, R_R0);
         char c = (char) x16_memread(machine, base);
         while (c != '\0') {
-            putc(c, stdout);
+            x16_putchar(machine, c);
             c = (char) x16_memread(machine, ++base);
         }
         fflush(stdout);
@@ -53,9 +59,9 @@ int trap(x16_t* machine, uint16_t instruction) {
 
     case TRAP_IN:
         // Read and echo a character, put it in R0
-        printf("Enter a character: ");
-        c = getchar();
-        putc(c, stdout);
+        put_string(machine, "Enter a character: ");
+        c = x16_getchar(machine);
+        x16_putchar(machine, c);
         fflush(stdout);
         // Setting the data to be in the memory data register.
         // It will get moved to R0 in the WB stage.
@@ -71,11 +77,11 @@ int trap(x16_t* machine, uint16_t instruction) {
         for (int val = x16_memread(machine, base);
             (val = x16_memread(machine, base)) != 0; base++) {
             char char1 = (val) & 0xff;
-            putc(char1, stdout);
+            x16_putchar(machine, char1);
             fprintf(stderr, "Putting %c\n", char1);
             char char2 = (val) >> 8;
             if (char2) {
-                putc(char2, stdout);
+                x16_putchar(machine, char2);
                 fprintf(stderr, "Putting %c\n", char2);
             }
         }
@@ -84,7 +90,7 @@ int trap(x16_t* machine, uint16_t instruction) {
 
     case TRAP_HALT:
         // TRAP HALT
-        puts("HALT\n");
+        put_string(machine, "HALT\n\n");
         fflush(stdout);
         return -1;
 
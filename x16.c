@@ -15,18 +15,59 @@ int LOG = 0;
 // Don't move this declaration to a .h file.
 typedef struct x16 {
     // The memory of the computer is emulated by this array, each slot of
-    // which stores a 16 bit value.
-    uint16_t memory[MAX_MEMORY];
+    // which stores a 16 bit value. Cores of one machine share it.
+    uint16_t* memory;
+    bool owns_memory;
 
-    // The register file contains R0-R7, PC and condition registers
-    uint16_t registers[MAX_REGISTERS];
+    // Which core of the machine this is, 0 for the first
+    uint16_t core;
+
+    // The register file contains R0-R7, PC and condition registers,
+    // followed by the processor status registers
+    uint16_t registers[MAX_STATE_REGISTERS];
+
+    // Fingerprint of memory, kept up to date on every write, and what it
+    // was when memory last matched the reference of dirty pages
+    uint32_t fingerprint;
+    uint32_t clean_fingerprint;
+
+    // A bit per page written since memory last matched a reference: the
+    // baseline of the last reset, or itself when marked clean
+    uint64_t dirty[MAX_PAGES / 64];
+
+    // Numbers every machine uniquely, and counts changes to its memory,
+    // so a reset can tell whether the baseline changed since the last
+    // reset to it
+    uint64_t id;
+    uint64_t version;
+    uint64_t base_id;
+    uint64_t base_version;
+
+    // Journal of overwritten values, or NULL when not journaling
+    x16_journal_t* journal;
+
+    // Console device
+    x16_io_t io;
+
+    // Flags of every page, see page_flag_t
+    uint8_t pages[MAX_PAGES];
+
+    // Watched access kinds of every address, allocated on first use
+    uint8_t* watches;
+
+    // The last watchpoint hit, valid while watch_hit is set
+    bool watch_hit;
+    uint16_t watch_address;
+    int watch_kind;
 } x16_t;
 
-// Special location in memory for memory mapped registers
-typedef enum {
-    MR_KBSR = 0xfe00,    // keyboard status
-    MR_KBDR = 0xfe02     // keyboard data
-} mmap_reg_t;
+// Number of block boundaries between keyboard polls while keyboard
+// interrupts are enabled
+#define POLL_INTERVAL   256
+
+// The id of the next machine. Ids are never reused, so a machine freed
+// and another created in its place are never mistaken for each other.
+static uint64_t next_id = 1;
 
 
 
@@ -34,15 +75,93 @@ typedef enum {
 x16_t* x16_create() {
     x16_t* machine = (x16_t*) malloc(sizeof(x16_t));
     memset(machine, 0, sizeof(x16_t));
+    machine->memory = (uint16_t*) calloc(MAX_MEMORY, sizeof(uint16_t));
+    machine->owns_memory = true;
+    machine->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
     x16_set(machine, R_PC, DEFAULT_CODESTART);         // default PC start
+    x16_set(machine, R_PSR, PSR_USER);                 // user mode
+    x16_set(machine, R_SAVED_SSP, DEFAULT_SSP);
+    x16_set_io(machine, x16_console());
+    x16_rehash(machine);
+    machine->pages[MMIO_BASE >> PAGE_SHIFT] = PAGE_MMIO;
     return machine;
 }
 
+// Add a core to a machine
+x16_t* x16_create_core(x16_t* machine, uint16_t core) {
+    x16_t* other = (x16_t*) malloc(sizeof(x16_t));
+    memset(other, 0, sizeof(x16_t));
+    other->memory = machine->memory;
+    other->core = core;
+    other->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    memcpy(other->registers, machine->registers, sizeof(other->registers));
+    other->registers[R_SAVED_SSP] -= core * CORE_STACK;
+    other->fingerprint = machine->fingerprint;
+    other->io = machine->io;
+    memcpy(other->pages, machine->pages, sizeof(other->pages));
+    return other;
+}
+
 // Free the memory consumed by the machine
 void x16_free(x16_t* machine) {
+    if (machine->owns_memory) {
+        free(machine->memory);
+    }
+    free(machine->watches);
     free(machine);
 }
 
+// Copy registers and memory of the baseline machine. After a reset to
+// the same baseline, unchanged since, only the pages written since then
+// differ.
+void x16_reset_to(x16_t* machine, x16_t* baseline) {
+    if (machine->base_id == baseline->id
+        && machine->base_version == baseline->version) {
+        for (int i = 0; i < MAX_PAGES / 64; i++) {
+            for (uint64_t bits = machine->dirty[i]; bits != 0;
+                 bits &= bits - 1) {
+                int page = i * 64 + __builtin_ctzll(bits);
+                memcpy(machine->memory + (page << PAGE_SHIFT),
+                       baseline->memory + (page << PAGE_SHIFT),
+                       sizeof(uint16_t) << PAGE_SHIFT);
+            }
+        }
+    } else {
+        memcpy(machine->memory, baseline->memory,
+               MAX_MEMORY * sizeof(uint16_t));
+    }
+    memset(machine->dirty, 0, sizeof(machine->dirty));
+    machine->version++;
+    machine->base_id = baseline->id;
+    machine->base_version = baseline->version;
+    memcpy(machine->registers, baseline->registers,
+           sizeof(machine->registers));
+    machine->fingerprint = baseline->fingerprint;
+    machine->clean_fingerprint = baseline->fingerprint;
+}
+
+// Take the memory as it is now as the reference for dirty pages
+void x16_mark_clean(x16_t* machine) {
+    memset(machine->dirty, 0, sizeof(machine->dirty));
+    machine->base_id = 0;
+    machine->clean_fingerprint = machine->fingerprint;
+}
+
+// True if the page was written since memory last matched a reference
+bool x16_page_dirty(x16_t* machine, uint16_t page) {
+    return machine->dirty[page / 64] & (1ull << (page % 64));
+}
+
+// Fingerprint of the reference of dirty pages
+uint32_t x16_clean_fingerprint(x16_t* machine) {
+    return machine->clean_fingerprint;
+}
+
+// Count of changes to memory
+uint64_t x16_version(x16_t* machine) {
+    return machine->version;
+}
+
 // Get the program counter
 uint16_t x16_pc(x16_t* machine) {
     return x16_reg(machine, R_PC);
@@ -66,7 +185,7 @@ void x16_set(x16_t* machine, reg_t reg, uint16_t value) {
 
 
 // Check Key
-static uint16_t check_key() {
+static int check_key(void* ctx) {
     fd_set readfds;
     FD_ZERO(&readfds);
     FD_SET(STDIN_FILENO, &readfds);
@@ -77,25 +196,270 @@ static uint16_t check_key() {
     return select(1, &readfds, NULL, NULL, &timeout) != 0;
 }
 
-// Read memory. Handles memory mapped registers
-uint16_t x16_memread(x16_t* machine, uint16_t address) {
-    if (address == MR_KBSR) {
+static int console_get_key(void* ctx) {
+    return getchar();
+}
+
+static void console_put_char(void* ctx, int c) {
+    putchar(c);
+}
+
+static const x16_io_t console = {
+    check_key, console_get_key, console_put_char, NULL
+};
+
+// The console attached to the controlling terminal
+const x16_io_t* x16_console() {
+    return &console;
+}
+
+// Attach a console device to the machine
+void x16_set_io(x16_t* machine, const x16_io_t* io) {
+    machine->io = *io;
+}
+
+// Non-zero if the console has a keystroke waiting
+int x16_key_ready(x16_t* machine) {
+    return machine->io.key_ready(machine->io.ctx);
+}
+
+// Read a keystroke from the console
+int x16_getchar(x16_t* machine) {
+    return machine->io.get_key(machine->io.ctx);
+}
+
+// Take a keystroke for the keyboard registers. The end of the input stops
+// the machine, as it does for the GETC trap, rather than handing the
+// guest EOF as a key over and over.
+static uint16_t take_key(x16_t* machine) {
+    int key = x16_getchar(machine);
+    if (key == EOF) {
+        perror("Getchar error");
+        abort();
+    }
+    return key;
+}
+
+// Write a character to the console
+void x16_putchar(x16_t* machine, int c) {
+    machine->io.put_char(machine->io.ctx, c);
+}
+
+// Mix an address and the value stored there into a 32 bit hash. The
+// memory fingerprint is the sum of this over every word, so a single
+// write can update it without looking at the rest of memory.
+static uint32_t mix(uint16_t address, uint16_t val) {
+    uint32_t h = ((uint32_t) address << 16 | val) * 0x9e3779b1u;
+    h ^= h >> 15;
+    h *= 0x85ebca77u;
+    h ^= h >> 13;
+    return h;
+}
+
+// Keep the fingerprint and journal up to date for a word that changes
+// from old to val
+static void record(x16_t* machine, uint16_t address, uint16_t old,
+                   uint16_t val) {
+    if (machine->journal != NULL) {
+        x16_journal_t* journal = machine->journal;
+        if (journal->count == journal->capacity) {
+            journal->capacity = journal->capacity ? journal->capacity * 2 : 256;
+            journal->entries = (x16_undo_t*) realloc(journal->entries,
+                journal->capacity * sizeof(x16_undo_t));
+        }
+        journal->entries[journal->count].address = address;
+        journal->entries[journal->count].value = old;
+        journal->entries[journal->count].when = journal->clock;
+        journal->count++;
+    }
+    machine->fingerprint += mix(address, val) - mix(address, old);
+    machine->dirty[address >> (PAGE_SHIFT + 6)] |=
+        1ull << ((address >> PAGE_SHIFT) & 63);
+    machine->version++;
+}
+
+// Store a word, keeping the fingerprint and journal up to date
+static void poke(x16_t* machine, uint16_t address, uint16_t val) {
+    uint16_t* word = &machine->memory[address];
+    record(machine, address, x16_shared_read(word), val);
+    x16_shared_write(word, val);
+}
+
+// Record a watchpoint hit if the access is watched
+static void check_watch(x16_t* machine, uint16_t address, int kind) {
+    if (machine->watches != NULL && (machine->watches[address] & kind)) {
+        machine->watch_hit = true;
+        machine->watch_address = address;
+        machine->watch_kind = kind;
+    }
+}
+
+// Read from a page that has flags set. Only core 0 drives the keyboard;
+// other cores see its registers as core 0 left them.
+static uint16_t slow_read(x16_t* machine, uint16_t address) {
+    uint16_t status = x16_shared_read(&machine->memory[MR_KBSR]);
+    bool console = machine->core == 0;
+    if (address == MR_KBSR && console) {
         // LOG = 0;
-        if (check_key()) {
-            machine->memory[MR_KBSR] = (1 << 15);
-            machine->memory[MR_KBDR] = getchar();
+        if ((status & KBSR_IE) && (status & KBSR_READY)) {
+            // The key is latched until the handler reads KBDR
+        } else if (x16_key_ready(machine)) {
+            poke(machine, MR_KBSR, KBSR_READY | (status & KBSR_IE));
+            poke(machine, MR_KBDR, take_key(machine));
             // printf("check_key: got %d\n", (int) machine->memory[MR_KBDR]);
             // LOG = 1;
         } else {
-            machine->memory[MR_KBSR] = 0;
+            poke(machine, MR_KBSR, status & KBSR_IE);
         }
+    } else if (address == MR_KBDR && console && (status & KBSR_IE)) {
+        // Reading the key acknowledges the interrupt
+        poke(machine, MR_KBSR, status & ~KBSR_READY);
+    } else if (address == MR_CORE) {
+        // Each core reads its own number, whatever memory holds
+        check_watch(machine, address, WATCH_READ);
+        return machine->core;
     }
-    return machine->memory[address];
+    check_watch(machine, address, WATCH_READ);
+    return x16_shared_read(&machine->memory[address]);
+}
+
+// Read memory. Handles memory mapped registers
+uint16_t x16_memread(x16_t* machine, uint16_t address) {
+    if (machine->pages[address >> PAGE_SHIFT] != 0) {
+        return slow_read(machine, address);
+    }
+    return x16_shared_read(&machine->memory[address]);
 }
 
 // Memory write
 void x16_memwrite(x16_t* machine, uint16_t address, uint16_t val) {
-    machine->memory[address] = val;
+    poke(machine, address, val);
+    if (machine->pages[address >> PAGE_SHIFT] & PAGE_WATCH) {
+        check_watch(machine, address, WATCH_WRITE);
+    }
+}
+
+// Compare and swap a word atomically
+bool x16_cas(x16_t* machine, uint16_t address, uint16_t* expected,
+             uint16_t val) {
+    uint16_t old = *expected;
+    if (machine->pages[address >> PAGE_SHIFT] & PAGE_MMIO) {
+        // Device registers have side effects on reads, so they are not
+        // swapped atomically
+        *expected = x16_memread(machine, address);
+        if (*expected != old) {
+            return false;
+        }
+        x16_memwrite(machine, address, val);
+        return true;
+    }
+    if (!__atomic_compare_exchange_n(&machine->memory[address], expected,
+                                     val, false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_SEQ_CST)) {
+        check_watch(machine, address, WATCH_READ);
+        return false;
+    }
+    record(machine, address, old, val);
+    check_watch(machine, address, WATCH_WRITE);
+    return true;
+}
+
+// Get the processor status register, with the condition codes
+uint16_t x16_psr(x16_t* machine) {
+    return machine->registers[R_PSR] | (machine->registers[R_COND] & 7);
+}
+
+// Push a word on the stack in R6
+static void push(x16_t* machine, uint16_t val) {
+    machine->registers[R_R6]--;
+    x16_memwrite(machine, machine->registers[R_R6], val);
+}
+
+// Pop a word off the stack in R6
+static uint16_t pop(x16_t* machine) {
+    uint16_t val = x16_memread(machine, machine->registers[R_R6]);
+    machine->registers[R_R6]++;
+    return val;
+}
+
+// Enter a handler: switch to the supervisor stack, push PSR and PC and
+// jump through the vector table. Return false if there is no handler.
+static bool enter(x16_t* machine, uint16_t vector, uint16_t priority) {
+    uint16_t* reg = machine->registers;
+    uint16_t handler = x16_shared_read(&machine->memory[VECTOR_TABLE
+                                                        + vector]);
+    if (handler == 0) {
+        return false;
+    }
+
+    uint16_t psr = x16_psr(machine);
+    if (psr & PSR_USER) {
+        reg[R_SAVED_USP] = reg[R_R6];
+        reg[R_R6] = reg[R_SAVED_SSP];
+    }
+    push(machine, psr);
+    push(machine, reg[R_PC]);
+    reg[R_PSR] = priority << 8;
+    reg[R_PC] = handler;
+    return true;
+}
+
+// Take a pending keyboard interrupt at a block boundary
+bool x16_interrupt(x16_t* machine, bool idle) {
+    uint16_t* reg = machine->registers;
+    uint16_t status = x16_shared_read(&machine->memory[MR_KBSR]);
+    if (!(status & KBSR_IE) || machine->core != 0) {
+        return false;
+    }
+
+    int priority = (reg[R_PSR] & PSR_PRIORITY) >> 8;
+    bool allowed = KEYBOARD_PRIORITY > priority;
+    if (!(status & KBSR_READY)) {
+        int key;
+        if (idle && allowed) {
+            // Nothing to do until a key arrives, so wait for it
+            key = take_key(machine);
+        } else if (reg[R_POLL] > 0) {
+            reg[R_POLL]--;
+            return false;
+        } else {
+            // Polling the device is a system call, so only do it every
+            // so many blocks
+            reg[R_POLL] = POLL_INTERVAL;
+            if (!x16_key_ready(machine)) {
+                return false;
+            }
+            key = take_key(machine);
+        }
+        poke(machine, MR_KBDR, key);
+        poke(machine, MR_KBSR, status | KBSR_READY);
+    }
+
+    return allowed && enter(machine, VECTOR_KEYBOARD, KEYBOARD_PRIORITY);
+}
+
+// Raise an exception, keeping the current priority
+bool x16_exception(x16_t* machine, uint16_t vector) {
+    int priority = (machine->registers[R_PSR] & PSR_PRIORITY) >> 8;
+    return enter(machine, vector, priority);
+}
+
+// Return from an interrupt or exception
+bool x16_rti(x16_t* machine) {
+    uint16_t* reg = machine->registers;
+    if (reg[R_PSR] & PSR_USER) {
+        return x16_exception(machine, VECTOR_PRIVILEGE);
+    }
+
+    reg[R_PC] = pop(machine);
+    uint16_t psr = pop(machine);
+    reg[R_PSR] = psr & (PSR_USER | PSR_PRIORITY);
+    reg[R_COND] = psr & 7;
+    if (psr & PSR_USER) {
+        reg[R_SAVED_SSP] = reg[R_R6];
+        reg[R_R6] = reg[R_SAVED_USP];
+    }
+    return true;
 }
 
 // Get a pointer to the 16bit word in the given offset in memoty
@@ -103,6 +467,97 @@ uint16_t* x16_memory(x16_t* machine, uint16_t offset) {
     return &machine->memory[offset];
 }
 
+// Get a pointer to the register file
+uint16_t* x16_registers(x16_t* machine) {
+    return machine->registers;
+}
+
+// Get the number of the core
+uint16_t x16_core(x16_t* machine) {
+    return machine->core;
+}
+
+// Get the page map
+const uint8_t* x16_pages(x16_t* machine) {
+    return machine->pages;
+}
+
+// Set or remove a watchpoint
+void x16_watch(x16_t* machine, uint16_t address, int kinds) {
+    if (machine->watches == NULL) {
+        machine->watches = (uint8_t*) calloc(MAX_MEMORY, 1);
+    }
+    machine->watches[address] = kinds;
+
+    // The page stays on the slow path while any of its words is watched
+    uint16_t page = address >> PAGE_SHIFT;
+    uint16_t first = page << PAGE_SHIFT;
+    machine->pages[page] &= ~PAGE_WATCH;
+    for (int i = 0; i < (1 << PAGE_SHIFT); i++) {
+        if (machine->watches[first + i] != 0) {
+            machine->pages[page] |= PAGE_WATCH;
+            break;
+        }
+    }
+}
+
+// True if a watchpoint was hit and not yet collected
+bool x16_watch_pending(x16_t* machine) {
+    return machine->watch_hit;
+}
+
+// Collect a pending watchpoint hit
+bool x16_watch_hit(x16_t* machine, uint16_t* address, int* kind) {
+    if (!machine->watch_hit) {
+        return false;
+    }
+    machine->watch_hit = false;
+    *address = machine->watch_address;
+    *kind = machine->watch_kind;
+    return true;
+}
+
+// Fingerprint of memory
+uint32_t x16_fingerprint(x16_t* machine) {
+    return machine->fingerprint;
+}
+
+// Recompute the memory fingerprint from scratch
+void x16_rehash(x16_t* machine) {
+    uint32_t fingerprint = 0;
+    for (int i = 0; i < MAX_MEMORY; i++) {
+        fingerprint += mix(i, machine->memory[i]);
+    }
+    machine->fingerprint = fingerprint;
+
+    // Memory was written behind its back, anywhere
+    memset(machine->dirty, 0xff, sizeof(machine->dirty));
+    machine->version++;
+}
+
+// Attach a write journal
+void x16_set_journal(x16_t* machine, x16_journal_t* journal) {
+    machine->journal = journal;
+}
+
+// Undo every journaled write, newest first
+void x16_journal_undo(x16_t* machine, x16_journal_t* journal) {
+    x16_journal_t* active = machine->journal;
+    machine->journal = NULL;
+    while (journal->count > 0) {
+        x16_undo_t* undo = &journal->entries[--journal->count];
+        poke(machine, undo->address, undo->value);
+    }
+    machine->journal = active;
+}
+
+// Release the entries held by a journal
+void x16_journal_free(x16_journal_t* journal) {
+    free(journal->entries);
+    journal->entries = NULL;
+    journal->count = journal->capacity = 0;
+}
+
 // Compute a hash value over memory. This gives a fingerprint of memory.
 // If a byte changes in memory, the fingerprint should pick it up
 static int compute_hash(unsigned char* data, int length) {
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 
 // Total amount of memory for 16 bit address
 #define MAX_MEMORY                  65536
@@ -10,6 +11,26 @@
 // Default code starting point
 #define DEFAULT_CODESTART           0x3000
 
+// Memory mapped device registers live at and above this address
+#define MMIO_BASE                   0xfe00
+
+// Memory is divided into pages of 256 words. A page with any flag set is
+// accessed through the slow path of x16_memread and x16_memwrite; pages
+// without flags are plain memory.
+#define PAGE_SHIFT                  8
+#define MAX_PAGES                   (MAX_MEMORY >> PAGE_SHIFT)
+
+typedef enum {
+    PAGE_MMIO = 1,          // holds memory mapped device registers
+    PAGE_WATCH = 2,         // holds at least one watchpoint
+} page_flag_t;
+
+// Kinds of memory access a watchpoint triggers on
+typedef enum {
+    WATCH_READ = 1,
+    WATCH_WRITE = 2,
+} watch_t;
+
 // 10 total registers, each of which is 16 bits. Most of them are general
 // purpose, but a few have designated roles.
 typedef enum {
@@ -23,23 +44,122 @@ typedef enum {
     R_R7,
     R_PC,                   // program counter
     R_COND,                 // condition flag
+    R_PSR,                  // processor status: privilege and priority
+    R_SAVED_SSP,            // supervisor stack pointer while in user mode
+    R_SAVED_USP,            // user stack pointer while in supervisor mode
+    R_POLL,                 // blocks left until the keyboard is polled
 } reg_t;
 
-// There are 10 total registers
+// There are 10 total registers visible to programs
 #define MAX_REGISTERS   10
 
+// The machine state also includes the processor status registers
+#define MAX_STATE_REGISTERS     14
+
+// Special location in memory for memory mapped registers
+typedef enum {
+    MR_KBSR = 0xfe00,    // keyboard status
+    MR_KBDR = 0xfe02,    // keyboard data
+    MR_CORE = 0xfe08     // number of the core that reads it
+} mmap_reg_t;
+
+// Keyboard status bits
+#define KBSR_READY      (1 << 15)   // a key is waiting in KBDR
+#define KBSR_IE         (1 << 14)   // interrupt when a key is ready
+
+// Processor status bits. Bits 2-0 mirror R_COND.
+#define PSR_USER        (1 << 15)   // user mode, otherwise supervisor
+#define PSR_PRIORITY    (7 << 8)    // priority level of the running code
+
+// Interrupt and exception vectors. The vector table in low memory holds
+// the address of the handler for each vector.
+#define VECTOR_TABLE        0x0100
+#define VECTOR_PRIVILEGE    0x00    // RTI in user mode
+#define VECTOR_ILLEGAL      0x01    // reserved opcode
+#define VECTOR_KEYBOARD     0x80
+
+// Priority of keyboard interrupts
+#define KEYBOARD_PRIORITY   4
+
+// Initial supervisor stack, growing down from the user program
+#define DEFAULT_SSP         0x3000
+
+// Each further core starts its supervisor stack this many words lower
+#define CORE_STACK          0x0100
+
 // The X16 machine
 typedef struct x16 x16_t;
 
+// Console device of a machine. Keystrokes are read and characters are
+// written through these hooks so that input can be recorded or replayed.
+typedef struct {
+    // Non-zero if a keystroke is waiting
+    int (*key_ready)(void* ctx);
+
+    // Read one keystroke, blocking if needed. EOF when input is exhausted
+    int (*get_key)(void* ctx);
+
+    // Write a single character
+    void (*put_char)(void* ctx, int c);
+
+    void* ctx;
+} x16_io_t;
+
+// A single entry in a write journal: the address, its previous value and
+// the journal clock at the time of the write
+typedef struct {
+    uint16_t address;
+    uint16_t value;
+    uint64_t when;
+} x16_undo_t;
+
+// A journal of memory writes, used to roll memory back. The clock is
+// maintained by the owner of the journal, typically as an instruction
+// count, and stamped on every entry.
+typedef struct {
+    x16_undo_t* entries;
+    size_t count;
+    size_t capacity;
+    uint64_t clock;
+} x16_journal_t;
+
 
 // Initialize and return a new x16 machine. The program counter
 // is set to the default start location DEFAULT_CODESTART
 // All registers and memory are cleared to 0
 x16_t* x16_create();
 
+// Add a core to a machine. The core shares the memory and console of the
+// machine and starts with a copy of its registers, except for a
+// supervisor stack of its own. Only core 0 takes keyboard interrupts.
+// Free the core before the machine.
+x16_t* x16_create_core(x16_t* machine, uint16_t core);
+
 // Free all resources consumed by a machine
 void x16_free(x16_t* machine);
 
+// Copy the registers and memory of baseline into the machine. Console,
+// journal, page map and watchpoints of the machine stay as they are.
+// Resetting again to the same baseline, if it was not written in the
+// meantime, copies only the pages that are dirty.
+void x16_reset_to(x16_t* machine, x16_t* baseline);
+
+// Take memory as it is now as the reference for dirty pages, as a reset
+// does. The next reset copies all of memory.
+void x16_mark_clean(x16_t* machine);
+
+// True if a page of memory was written since the last reset or since it
+// was marked clean
+bool x16_page_dirty(x16_t* machine, uint16_t page);
+
+// Fingerprint of memory as it was at the last reset or when it was marked
+// clean, which is what the dirty pages differ from
+uint32_t x16_clean_fingerprint(x16_t* machine);
+
+// Count of changes to memory. It moves on with every write, so comparing
+// it before and after running tells whether memory may have changed.
+uint64_t x16_version(x16_t* machine);
+
 // Get the program counter
 uint16_t x16_pc(x16_t* machine);
 
@@ -58,15 +178,103 @@ uint16_t x16_memread(x16_t* machine, uint16_t address);
 // Memory write
 void x16_memwrite(x16_t* machine, uint16_t address, uint16_t val);
 
-// Get a pointer to the 16bit word in the given offset in memoty
+// Compare and swap: if the word at the address equals expected, replace
+// it with val and return true. Otherwise return false. Either way
+// expected is left holding the old word. Atomic with respect to other
+// cores, and a full memory barrier, except on device registers.
+bool x16_cas(x16_t* machine, uint16_t address, uint16_t* expected,
+             uint16_t val);
+
+// Get a pointer to the 16bit word in the given offset in memoty.
+// Writes through this pointer bypass the memory fingerprint and dirty
+// pages, so call x16_rehash once done.
 uint16_t* x16_memory(x16_t* machine, uint16_t offset);
 
+// Read and write a word of memory that other cores may access at the same
+// time. Relaxed atomics never tear, and cost no more than plain accesses.
+static inline uint16_t x16_shared_read(const uint16_t* word) {
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+static inline void x16_shared_write(uint16_t* word, uint16_t val) {
+    __atomic_store_n(word, val, __ATOMIC_RELAXED);
+}
+
+// Get a pointer to the register file
+uint16_t* x16_registers(x16_t* machine);
+
+// Get the number of the core, 0 for a machine that has no other cores
+uint16_t x16_core(x16_t* machine);
+
+// Get the page map, one set of page_flag_t bits per page
+const uint8_t* x16_pages(x16_t* machine);
+
+// Watch the address for the given watch_t kinds. Zero kinds removes
+// the watchpoint.
+void x16_watch(x16_t* machine, uint16_t address, int kinds);
+
+// True if a watchpoint was hit and not yet collected
+bool x16_watch_pending(x16_t* machine);
+
+// Collect a pending watchpoint hit. Return false if there is none
+bool x16_watch_hit(x16_t* machine, uint16_t* address, int* kind);
+
+// Fingerprint of memory, updated incrementally on every write
+uint32_t x16_fingerprint(x16_t* machine);
+
+// Recompute the memory fingerprint from scratch, and take every page as
+// dirty
+void x16_rehash(x16_t* machine);
+
+// Attach a journal that records the old value of every memory write,
+// or NULL to stop journaling
+void x16_set_journal(x16_t* machine, x16_journal_t* journal);
+
+// Roll memory back to the state before the first journaled write and
+// empty the journal
+void x16_journal_undo(x16_t* machine, x16_journal_t* journal);
+
+// Release the entries held by a journal
+void x16_journal_free(x16_journal_t* journal);
+
+// The console attached to the controlling terminal
+const x16_io_t* x16_console();
+
+// Attach a console device to the machine
+void x16_set_io(x16_t* machine, const x16_io_t* io);
+
+// Non-zero if the console has a keystroke waiting
+int x16_key_ready(x16_t* machine);
+
+// Read a keystroke from the console. EOF when input is exhausted
+int x16_getchar(x16_t* machine);
+
+// Write a character to the console
+void x16_putchar(x16_t* machine, int c);
+
 // Dump X16
 void x16_print(x16_t* machine);
 
 // Execute one single instruction. Return 0 on success or -1 for HALT
 int x16_exec(x16_t* machine);
 
+// Get the processor status register, with the condition codes
+uint16_t x16_psr(x16_t* machine);
+
+// Take a pending keyboard interrupt. This is checked only at the end of
+// basic blocks, and cheaply skipped while KBSR interrupts are disabled.
+// Set idle when the guest spins in a branch to itself; the machine then
+// waits for a key instead of spinning. Return true if one was taken.
+bool x16_interrupt(x16_t* machine, bool idle);
+
+// Raise an exception through the vector table. Return false if the
+// table has no handler for the vector.
+bool x16_exception(x16_t* machine, uint16_t vector);
+
+// Return from an interrupt or exception. Return false on a privilege
+// violation that has no handler.
+bool x16_rti(x16_t* machine);
+
 // This variable is set to 1 to turn on logging at each instruction execution
 extern int LOG;
 
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "analysis.h"
+#include "bits.h"
+#include "disasm.h"
+#include "image.h"
+#include "instruction.h"
+#include "loader.h"
+#include "trap.h"
+#include "x16.h"
+
+// Image words on each line of the output
+#define WORDS_PER_LINE 8
+
+typedef struct {
+    FILE* fp;
+    const analysis_t* analysis;
+    const uint16_t* memory;
+    const uint8_t* loaded;      // whether the image has a word
+} translation_t;
+
+void usage() {
+    fprintf(stderr, "Usage: ./x16c [-o output] image\n"
+            "Translates an image into C for the runtime in libx16rt.a:\n"
+            "  gcc -O2 -I. output.c libx16rt.a -o program\n");
+    exit(1);
+}
+
+// Name of the translation of an image: the image name with a .c
+// extension
+static char* output_path(const char* image) {
+    const char* dot = strrchr(image, '.');
+    const char* slash = strrchr(image, '/');
+    size_t length = dot && (!slash || dot > slash) ? (size_t) (dot - image)
+                                                   : strlen(image);
+    char* path = (char*) malloc(length + 3);
+    memcpy(path, image, length);
+    strcpy(path + length, ".c");
+    return path;
+}
+
+// Only code in the image is translated. Control flow that runs on into
+// the rest of memory is left to the interpreter.
+static bool translated(const translation_t* t, uint16_t address) {
+    return (t->analysis->flags[address] & ANALYSIS_CODE)
+        && t->loaded[address];
+}
+
+// Leave native code for the interpreter at the PC
+static void leave(const translation_t* t, const char* why) {
+    fprintf(t->fp, "    rv = %s;\n    goto leave;\n", why);
+}
+
+// Go on at an address known when translating, natively if it was
+// translated. Falling through to the next word needs no goto.
+static void go(const translation_t* t, uint16_t from, uint16_t to) {
+    if (!translated(t, to)) {
+        fprintf(t->fp, "    pc = 0x%04x;\n", to);
+        leave(t, "AOT_LEAVE");
+    } else if (to != (uint16_t) (from + 1)) {
+        fprintf(t->fp, "    goto L_%04x;\n", to);
+    }
+}
+
+// Go on at the PC, found at run time
+static void dispatch(const translation_t* t) {
+    fprintf(t->fp, "    goto dispatch;\n");
+}
+
+// Let the runtime take an interrupt after a control transfer, as the
+// interpreter does
+static void poll(const translation_t* t, const char* why) {
+    fprintf(t->fp, "    if (mem[MR_KBSR] & KBSR_IE) {\n"
+            "        rv = %s;\n        goto leave;\n    }\n", why);
+}
+
+// Store a register. A store the analysis could not keep off translated
+// code leaves native code for good if it writes some.
+static void store(const translation_t* t, uint16_t address,
+                  const char* target, int sr) {
+    uint16_t next = address + 1;
+    fprintf(t->fp, "    x16_memwrite(m, %s, r%d);\n", target, sr);
+    if (t->analysis->flags[address] & ANALYSIS_STORE_DATA) {
+        return;
+    }
+    fprintf(t->fp, "    if (aot_translated(&program, %s)) {\n"
+            "        pc = 0x%04x;\n        rv = AOT_MODIFIED;\n"
+            "        goto leave;\n    }\n", target, next);
+}
+
+// Translate the instruction at an address. Instructions native code does
+// not model are left to the interpreter.
+static void translate(const translation_t* t, uint16_t address) {
+    FILE* fp = t->fp;
+    uint16_t word = t->memory[address];
+    uint16_t next = address + 1;
+    int dr = getbits(word, 9, 3);
+    int sr = getbits(word, 6, 3);
+    int sr2 = getbits(word, 0, 3);
+    uint16_t imm5 = sign_extend(getbits(word, 0, 5), 5);
+    uint16_t offset6 = sign_extend(getbits(word, 0, 6), 6);
+    uint16_t target9 = next + sign_extend(getbits(word, 0, 9), 9);
+    uint16_t target11 = next + sign_extend(getbits(word, 0, 11), 11);
+    int nzp = getbits(word, 9, 3);
+    char text[DISASM_MAX];
+    char operand[16];
+    disassemble(word, text);
+    fprintf(fp, "L_%04x:  // %s\n", address, text);
+
+    switch (getopcode(word)) {
+    case OP_ADD:
+    case OP_AND:
+        if (getimmediate(word) == 1) {
+            snprintf(operand, sizeof(operand), "0x%04x", imm5);
+        } else {
+            snprintf(operand, sizeof(operand), "r%d", sr2);
+        }
+        fprintf(fp, "    r%d = r%d %c %s;\n    cc = AOT_CC(r%d);\n", dr, sr,
+                getopcode(word) == OP_ADD ? '+' : '&', operand, dr);
+        break;
+
+    case OP_NOT:
+        fprintf(fp, "    r%d = ~r%d;\n    cc = AOT_CC(r%d);\n", dr, sr, dr);
+        break;
+
+    case OP_LEA:
+        fprintf(fp, "    r%d = 0x%04x;\n    cc = AOT_CC(r%d);\n", dr, target9,
+                dr);
+        break;
+
+    case OP_LD:
+        fprintf(fp, "    r%d = AOT_LOAD(0x%04x);\n    cc = AOT_CC(r%d);\n", dr,
+                target9, dr);
+        break;
+
+    case OP_LDI:
+        fprintf(fp, "    t = AOT_LOAD(0x%04x);\n    r%d = AOT_LOAD(t);\n"
+                "    cc = AOT_CC(r%d);\n", target9, dr, dr);
+        break;
+
+    case OP_LDR:
+        fprintf(fp, "    r%d = AOT_LOAD(r%d + 0x%04x);\n"
+                "    cc = AOT_CC(r%d);\n", dr, sr, offset6, dr);
+        break;
+
+    case OP_ST:
+        snprintf(operand, sizeof(operand), "0x%04x", target9);
+        store(t, address, operand, dr);
+        break;
+
+    case OP_STI:
+        fprintf(fp, "    t = AOT_LOAD(0x%04x);\n", target9);
+        store(t, address, "t", dr);
+        break;
+
+    case OP_STR:
+        fprintf(fp, "    t = r%d + 0x%04x;\n", sr, offset6);
+        store(t, address, "t", dr);
+        break;
+
+    case OP_BR:
+        // Every branch polls, even one that is never taken
+        if (nzp != 0) {
+            fprintf(fp, "    if (cc & %d) {\n        pc = 0x%04x;\n", nzp,
+                    target9);
+            fprintf(fp, "        if (mem[MR_KBSR] & KBSR_IE) {\n"
+                    "            rv = %s;\n            goto leave;\n"
+                    "        }\n",
+                    target9 == address ? "AOT_IDLE" : "AOT_POLL");
+            if (translated(t, target9)) {
+                fprintf(fp, "        goto L_%04x;\n", target9);
+            } else {
+                fprintf(fp, "        rv = AOT_LEAVE;\n        goto leave;\n");
+            }
+            fprintf(fp, "    }\n");
+        }
+        if (nzp != (FL_NEG | FL_ZRO | FL_POS)) {
+            fprintf(fp, "    pc = 0x%04x;\n", next);
+            poll(t, "AOT_POLL");
+            go(t, address, next);
+        }
+        return;
+
+    case OP_JMP:
+        if (dr != 0) {
+            break;
+        }
+        fprintf(fp, "    pc = r%d;\n", sr);
+        poll(t, "AOT_POLL");
+        dispatch(t);
+        return;
+
+    case OP_JSR:
+        // R7 is set before the base register is read
+        if (getbit(word, 11) == 0 && getbits(word, 9, 2) != 0) {
+            break;
+        }
+        fprintf(fp, "    r7 = 0x%04x;\n", next);
+        if (getbit(word, 11) == 1) {
+            fprintf(fp, "    pc = 0x%04x;\n", target11);
+            poll(t, "AOT_POLL");
+            go(t, address, target11);
+        } else {
+            fprintf(fp, "    pc = r%d;\n", sr);
+            poll(t, "AOT_POLL");
+            dispatch(t);
+        }
+        return;
+
+    case OP_TRAP:
+        // Traps run in trap.c on the registers of the machine
+        fprintf(fp, "    pc = 0x%04x;\n    SAVE();\n", next);
+        fprintf(fp, "    rv = trap(m, 0x%04x);\n    RESTORE();\n", word);
+        fprintf(fp, "    if (rv != 0) {\n        goto leave;\n    }\n");
+        poll(t, "AOT_POLL");
+        if (getbits(word, 0, 8) != TRAP_HALT) {
+            go(t, address, next);
+        }
+        return;
+
+    default:
+        break;
+    }
+
+    if (getopcode(word) == OP_RTI || getopcode(word) == OP_CAS
+        || getopcode(word) == OP_JMP || getopcode(word) == OP_JSR) {
+        fprintf(fp, "    pc = 0x%04x;\n", address);
+        leave(t, "AOT_LEAVE");
+        return;
+    }
+    go(t, address, next);
+}
+
+// Write the image the runtime loads, and which words have native code
+static void write_data(const translation_t* t, const image_t* image) {
+    FILE* fp = t->fp;
+    for (int i = 0; i < image->segment_count; i++) {
+        const image_segment_t* segment = &image->segments[i];
+        fprintf(fp, "static uint16_t words_%d[] = {", i);
+        for (uint32_t j = 0; j < segment->count; j++) {
+            fprintf(fp, "%s0x%04x,", j % WORDS_PER_LINE == 0 ? "\n    " : " ",
+                    segment->words[j]);
+        }
+        fprintf(fp, "\n};\n\n");
+    }
+    fprintf(fp, "static image_segment_t segments[] = {\n");
+    for (int i = 0; i < image->segment_count; i++) {
+        fprintf(fp, "    { 0x%04x, %u, words_%d },\n",
+                image->segments[i].origin, image->segments[i].count, i);
+    }
+    fprintf(fp, "};\n\n");
+    fprintf(fp, "static const image_t image = {\n"
+            "    .has_entry = %s,\n    .entry = 0x%04x,\n"
+            "    .segments = segments,\n    .segment_count = %d,\n};\n\n",
+            image->has_entry ? "true" : "false", image->entry,
+            image->segment_count);
+
+    fprintf(fp, "static const uint8_t translated[MAX_MEMORY / 8] = {\n");
+    for (int i = 0; i < MAX_MEMORY / 8; i++) {
+        uint8_t bits = 0;
+        for (int j = 0; j < 8; j++) {
+            bits |= translated(t, i * 8 + j) ? 1 << j : 0;
+        }
+        if (bits != 0) {
+            fprintf(fp, "    [0x%04x] = 0x%02x,\n", i, bits);
+        }
+    }
+    fprintf(fp, "};\n\n");
+}
+
+// Write the native function: registers in locals, a label for each
+// translated word, and a switch on the PC for jumps through registers
+static void write_native(const translation_t* t) {
+    FILE* fp = t->fp;
+    fprintf(fp,
+            "static const aot_program_t program;\n\n"
+            "#define SAVE() \\\n"
+            "    reg[0] = r0; reg[1] = r1; reg[2] = r2; reg[3] = r3; \\\n"
+            "    reg[4] = r4; reg[5] = r5; reg[6] = r6; reg[7] = r7; \\\n"
+            "    reg[R_COND] = cc; reg[R_PC] = pc\n"
+            "#define RESTORE() \\\n"
+            "    r0 = reg[0]; r1 = reg[1]; r2 = reg[2]; r3 = reg[3]; \\\n"
+            "    r4 = reg[4]; r5 = reg[5]; r6 = reg[6]; r7 = reg[7]; \\\n"
+            "    cc = reg[R_COND]\n\n"
+            "static int native(x16_t* m) {\n"
+            "    uint16_t* mem = x16_memory(m, 0);\n"
+            "    uint16_t* reg = x16_registers(m);\n"
+            "    const uint8_t* pages = x16_pages(m);\n"
+            "    uint16_t r0, r1, r2, r3, r4, r5, r6, r7, cc, t;\n"
+            "    uint16_t pc = reg[R_PC];\n"
+            "    int rv;\n"
+            "    RESTORE();\n"
+            "    (void) pages;\n"
+            "    (void) t;\n\n"
+            "dispatch: __attribute__((unused))\n"
+            "    switch (pc) {\n");
+    for (uint32_t i = 0; i < MAX_MEMORY; i++) {
+        if (translated(t, i)) {
+            fprintf(fp, "    case 0x%04x: goto L_%04x;\n", i, i);
+        }
+    }
+    fprintf(fp, "    default:\n        rv = AOT_LEAVE;\n"
+            "        goto leave;\n    }\n\n");
+
+    for (uint32_t i = 0; i < MAX_MEMORY; i++) {
+        if (translated(t, i)) {
+            translate(t, i);
+        }
+    }
+
+    fprintf(fp, "\nleave:\n    SAVE();\n    return rv;\n}\n\n");
+    fprintf(fp, "static const aot_program_t program = {\n"
+            "    &image, translated, native,\n};\n\n"
+            "int main() {\n    return aot_main(&program);\n}\n");
+}
+
+int main(int argc, char** argv) {
+    int ch;
+    char* output = NULL;
+    while ((ch = getopt(argc, argv, "o:")) != -1) {
+        switch (ch) {
+        case 'o':
+            output = optarg;
+            break;
+
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 1) {
+        usage();
+    }
+
+    image_t image;
+    const char* error;
+    if (!image_read(argv[0], &image, &error)) {
+        fprintf(stderr, "Can't read %s: %s\n", argv[0], error);
+        exit(2);
+    }
+
+    // Find the code the way x16 would load and start the image
+    x16_t* machine = x16_create();
+    uint8_t* loaded = (uint8_t*) calloc(MAX_MEMORY, 1);
+    for (int i = 0; i < image.segment_count; i++) {
+        const image_segment_t* segment = &image.segments[i];
+        memset(loaded + segment->origin, 1, loader_words(segment));
+    }
+    loader_load(machine, &image);
+    analysis_t* analysis = (analysis_t*) malloc(sizeof(analysis_t));
+    analysis_run(analysis, machine);
+    if (analysis_modifies_code(analysis)) {
+        fprintf(stderr, "%s: may modify its code, so stores are checked "
+                "and native code stops if one does\n", argv[0]);
+    }
+
+    char* path = output ? strdup(output) : output_path(argv[0]);
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't write %s\n", path);
+        exit(2);
+    }
+    translation_t t = { fp, analysis, x16_memory(machine, 0), loaded };
+    fprintf(fp, "// Translated by x16c from %s\n"
+            "#include \"aot.h\"\n#include \"trap.h\"\n\n", argv[0]);
+    write_data(&t, &image);
+    write_native(&t);
+    bool ok = fclose(fp) == 0;
+
+    free(path);
+    free(loaded);
+    free(analysis);
+    x16_free(machine);
+    image_free(&image);
+    return ok ? 0 : 2;
+}
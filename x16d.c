@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "fast.h"
+#include "image.h"
+#include "loader.h"
+#include "x16.h"
+
+// A daemon that runs jobs on machines kept warm between them, so that a
+// short job costs neither a process nor a fresh machine. Workers are
+// processes forked up front that take turns accepting connections on a
+// Unix socket; each keeps one machine, a blank machine to reset it to
+// and a fast engine. A guest that makes the emulator abort only takes
+// its worker down, and the daemon forks another.
+//
+// A connection carries one job. Numbers are 32 bits in network order.
+//
+//   request:   image bytes, input bytes, steps, then the image as x16
+//              reads it from a file and the input
+//   response:  status, steps run, memory fingerprint, R0-R7, PC, COND
+//              and PSR as 16 bits each, output bytes, then the output
+//
+// The input is fed to the guest as keystrokes; the job ends when the
+// guest halts, runs its steps, or asks for a key past the end of the
+// input. Zero steps means DEFAULT_STEPS. A job that is rejected gets
+// X16D_ERROR and the reason as its output. The steps of X16D_FAULT leave
+// out the basic block the emulator aborted in, as the fast engine counts
+// a block only once it finished.
+
+// Why a job ended
+enum {
+    X16D_HALTED = 0,
+    X16D_BUDGET,            // ran all of its steps
+    X16D_INPUT,             // wanted more input than it was given
+    X16D_FAULT,             // the emulator aborted
+    X16D_ERROR,             // the request was bad
+};
+
+#define DEFAULT_STEPS           10000000
+#define MAX_IMAGE               (1 << 20)
+#define MAX_INPUT               (1 << 20)
+#define MAX_OUTPUT              (1 << 20)
+
+// Seconds a worker waits on a client that went quiet
+#define CLIENT_TIMEOUT          10
+
+// Bytes of the response before the output
+#define RESPONSE_HEADER         (4 * 4 + (MAX_REGISTERS + 1) * 2)
+
+// The job a worker is running
+typedef struct {
+    int fd;
+    x16_t* machine;
+    uint32_t steps;
+
+    // Keystrokes of the input
+    uint8_t* input;
+    uint32_t input_size;
+    uint32_t position;
+    bool exhausted;
+
+    // What the guest wrote, up to MAX_OUTPUT
+    char* output;
+    uint32_t output_size;
+} job_t;
+
+// The job of this worker, for the abort handler
+static job_t* current;
+
+// The socket path the daemon removes when it stops, and its workers
+static const char* socket_path;
+static pid_t* worker_pids;
+static int worker_count;
+
+void usage() {
+    fprintf(stderr, "Usage: ./x16d [-w workers] socket\n"
+            "       ./x16d -r socket [-n steps] image [input-file]\n"
+            "Serves jobs on a Unix socket, or with -r runs one there.\n");
+    exit(1);
+}
+
+static int keys_ready(void* ctx) {
+    job_t* job = (job_t*) ctx;
+    if (job->position == job->input_size) {
+        job->exhausted = true;
+        return 0;
+    }
+    return 1;
+}
+
+static int keys_get(void* ctx) {
+    job_t* job = (job_t*) ctx;
+    if (job->position == job->input_size) {
+        job->exhausted = true;
+        return 0;
+    }
+    return job->input[job->position++];
+}
+
+static void keys_put(void* ctx, int c) {
+    job_t* job = (job_t*) ctx;
+    if (job->output_size < MAX_OUTPUT) {
+        job->output[job->output_size++] = c;
+    }
+}
+
+// Read or write all of a buffer. Return false on errors or end of file.
+static bool read_full(int fd, void* buffer, size_t size) {
+    uint8_t* p = (uint8_t*) buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void* buffer, size_t size) {
+    const uint8_t* p = (const uint8_t*) buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t value) {
+    value = htonl(value);
+    memcpy(p, &value, 4);
+    return p + 4;
+}
+
+static uint8_t* put16(uint8_t* p, uint16_t value) {
+    value = htons(value);
+    memcpy(p, &value, 2);
+    return p + 2;
+}
+
+static uint32_t get32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return ntohl(value);
+}
+
+static uint16_t get16(const uint8_t* p) {
+    uint16_t value;
+    memcpy(&value, p, 2);
+    return ntohs(value);
+}
+
+// Send the state of the machine and the output. Only calls write, so
+// the abort handler can use it.
+static void respond(const job_t* job, uint32_t status) {
+    uint8_t header[RESPONSE_HEADER];
+    uint8_t* p = put32(header, status);
+    p = put32(p, job->steps);
+    p = put32(p, x16_fingerprint(job->machine));
+    for (int i = 0; i < MAX_REGISTERS; i++) {
+        p = put16(p, x16_reg(job->machine, (reg_t) i));
+    }
+    p = put16(p, x16_psr(job->machine));
+    p = put32(p, job->output_size);
+    if (write_full(job->fd, header, sizeof(header))) {
+        write_full(job->fd, job->output, job->output_size);
+    }
+}
+
+// Reject a request, with the reason as the output
+static void reject(job_t* job, const char* reason) {
+    job->output_size = strlen(reason);
+    memcpy(job->output, reason, job->output_size);
+    respond(job, X16D_ERROR);
+}
+
+// Answer the client of a job the guest made abort, then die. Its steps
+// are those before the block that aborted.
+static void handle_abort(int signal) {
+    if (current != NULL) {
+        respond(current, X16D_FAULT);
+    }
+    _exit(1);
+}
+
+// Read a job from the client, run it and answer
+static void serve_job(job_t* job, x16_t* blank, fast_t* engine,
+                      uint8_t* image_data) {
+    job->steps = 0;
+    job->position = 0;
+    job->exhausted = false;
+    job->output_size = 0;
+    x16_reset_to(job->machine, blank);
+
+    uint8_t request[12];
+    if (!read_full(job->fd, request, sizeof(request))) {
+        return;
+    }
+    uint32_t image_size = get32(request);
+    job->input_size = get32(request + 4);
+    uint32_t budget = get32(request + 8);
+    if (image_size > MAX_IMAGE || job->input_size > MAX_INPUT) {
+        reject(job, "request too large");
+        return;
+    }
+    if (!read_full(job->fd, image_data, image_size)
+        || !read_full(job->fd, job->input, job->input_size)) {
+        return;
+    }
+
+    image_t image;
+    const char* error;
+    if (!image_parse(image_data, image_size, &image, &error)) {
+        reject(job, error);
+        return;
+    }
+    loader_load(job->machine, &image);
+    image_free(&image);
+
+    if (budget == 0) {
+        budget = DEFAULT_STEPS;
+    }
+    int rv = 0;
+    int count;
+    current = job;
+    while (rv == 0 && job->steps < budget && !job->exhausted) {
+        uint32_t limit = budget - job->steps;
+        rv = fast_run(engine, job->machine,
+                      limit < INT32_MAX ? (int) limit : INT32_MAX, &count);
+        job->steps += count;
+    }
+    current = NULL;
+    respond(job, rv == -1 ? X16D_HALTED
+                 : job->exhausted ? X16D_INPUT : X16D_BUDGET);
+}
+
+// Take jobs from the socket for good, on a machine kept for all of them
+static void worker(int listener) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGABRT, handle_abort);
+
+    x16_t* blank = x16_create();
+    fast_t* engine = fast_create();
+    job_t job = {0};
+    job.machine = x16_create();
+    job.input = (uint8_t*) malloc(MAX_INPUT);
+    job.output = (char*) malloc(MAX_OUTPUT);
+    uint8_t* image_data = (uint8_t*) malloc(MAX_IMAGE);
+    x16_io_t io = { keys_ready, keys_get, keys_put, &job };
+    x16_set_io(job.machine, &io);
+
+    struct timeval timeout = { CLIENT_TIMEOUT, 0 };
+    for (;;) {
+        job.fd = accept(listener, NULL, NULL);
+        if (job.fd < 0) {
+            continue;
+        }
+        setsockopt(job.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+        setsockopt(job.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout));
+        serve_job(&job, blank, engine, image_data);
+        close(job.fd);
+    }
+}
+
+// Take the workers down with the daemon
+static void stop(int signal) {
+    unlink(socket_path);
+    for (int i = 0; i < worker_count; i++) {
+        if (worker_pids[i] > 0) {
+            kill(worker_pids[i], SIGTERM);
+        }
+    }
+    _exit(0);
+}
+
+// Listen on the socket and keep the workers going
+static int serve(const char* path, int workers) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listener < 0
+        || bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0
+        || listen(listener, SOMAXCONN) != 0) {
+        perror(path);
+        return 1;
+    }
+
+    // A worker a guest aborted is replaced
+    socket_path = path;
+    worker_pids = (pid_t*) calloc(workers, sizeof(pid_t));
+    worker_count = workers;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    for (;;) {
+        for (int i = 0; i < workers; i++) {
+            if (worker_pids[i] > 0) {
+                continue;
+            }
+            pid_t child = fork();
+            if (child < 0) {
+                perror("fork");
+                sleep(1);
+            } else if (child == 0) {
+                worker(listener);
+            }
+            worker_pids[i] = child;
+        }
+        int status;
+        pid_t child = wait(&status);
+        for (int i = 0; i < workers; i++) {
+            if (worker_pids[i] == child) {
+                worker_pids[i] = 0;
+            }
+        }
+    }
+}
+
+// Read a whole file, or nothing if path is NULL
+static uint8_t* read_file(const char* path, uint32_t* size, uint32_t max) {
+    uint8_t* data = (uint8_t*) malloc(max);
+    *size = 0;
+    if (path == NULL) {
+        return data;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(2);
+    }
+    ssize_t n;
+    while (*size < max && (n = read(fd, data + *size, max - *size)) > 0) {
+        *size += n;
+    }
+    close(fd);
+    return data;
+}
+
+// Run a job on the daemon: write the output of the guest to stdout and
+// its final state to stderr
+static int submit(const char* path, uint32_t steps, const char* image_path,
+                  const char* input_path) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0
+        || connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        perror(path);
+        return 2;
+    }
+
+    uint32_t image_size;
+    uint32_t input_size;
+    uint8_t* image = read_file(image_path, &image_size, MAX_IMAGE);
+    uint8_t* input = read_file(input_path, &input_size, MAX_INPUT);
+    uint8_t request[12];
+    uint8_t* p = put32(request, image_size);
+    p = put32(p, input_size);
+    put32(p, steps);
+    bool sent = write_full(fd, request, sizeof(request))
+        && write_full(fd, image, image_size)
+        && write_full(fd, input, input_size);
+    free(image);
+    free(input);
+
+    uint8_t header[RESPONSE_HEADER];
+    if (!sent || !read_full(fd, header, sizeof(header))) {
+        fprintf(stderr, "No answer from %s\n", path);
+        close(fd);
+        return 2;
+    }
+    uint32_t status = get32(header);
+    uint32_t output_size = get32(header + sizeof(header) - 4);
+    char* output = (char*) malloc(output_size + 1);
+    if (!read_full(fd, output, output_size)) {
+        output_size = 0;
+    }
+    close(fd);
+
+    static const char* ends[] = {
+        "halted", "ran out of steps", "ran out of input", "faulted",
+    };
+    if (status == X16D_ERROR) {
+        output[output_size] = '\0';
+        fprintf(stderr, "Rejected: %s\n", output);
+        free(output);
+        return 2;
+    }
+    fwrite(output, 1, output_size, stdout);
+    free(output);
+    fprintf(stderr, "%s after %u steps, memory 0x%08x\n",
+            status <= X16D_FAULT ? ends[status] : "stopped",
+            get32(header + 4), get32(header + 8));
+    p = header + 12;
+    for (int i = 0; i < MAX_REGISTERS; i++, p += 2) {
+        static const char* names[] = {
+            "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND",
+        };
+        fprintf(stderr, "%s=0x%04x ", names[i], get16(p));
+    }
+    fprintf(stderr, "PSR=0x%04x\n", get16(p));
+    return status == X16D_HALTED ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    int ch;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    bool run = false;
+    uint32_t steps = 0;
+    while ((ch = getopt(argc, argv, "w:rn:")) != -1) {
+        switch (ch) {
+        case 'w':
+            // Worker processes, each with a machine
+            workers = atol(optarg);
+            break;
+
+        case 'r':
+            // Run a job on the daemon rather than be one
+            run = true;
+            break;
+
+        case 'n':
+            // Steps the job may run for
+            steps = strtoul(optarg, NULL, 0);
+            break;
+
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (run && (argc == 2 || argc == 3)) {
+        return submit(argv[0], steps, argv[1], argc == 3 ? argv[2] : NULL);
+    }
+    if (run || argc != 1 || workers < 1) {
+        usage();
+    }
+    return serve(argv[0], workers);
+}
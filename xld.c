@@ -0,0 +1,217 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "object.h"
+#include "symtab.h"
+#include "x16.h"
+
+// An object and where it goes in memory
+typedef struct {
+    const char* path;
+    object_t object;
+    uint32_t base;
+} input_t;
+
+static int errors = 0;
+
+static void usage() {
+    fprintf(stderr, "Usage: xld [-o image] [-T origin] object[@origin]...\n");
+    exit(1);
+}
+
+static void error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "xld: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    errors++;
+}
+
+// Parse an address in decimal or 0x hex. Return false if malformed
+static bool parse_address(const char* text, uint32_t* address) {
+    char* end;
+    long value = strtol(text, &end, 0);
+    if (*text == '\0' || *end != '\0' || value < 0 || value >= MAX_MEMORY) {
+        return false;
+    }
+    *address = value;
+    return true;
+}
+
+// Make the exported symbols of every object known by name
+static void collect(symtab_t* globals, input_t* inputs, int count) {
+    for (int i = 0; i < count; i++) {
+        object_t* object = &inputs[i].object;
+        for (int j = 0; j < object->symbol_count; j++) {
+            object_symbol_t* symbol = &object->symbols[j];
+            if (!(symbol->flags & SYMBOL_EXPORT)) {
+                continue;
+            }
+            symbol_t* global = symtab_intern(globals, symbol->name,
+                                             strlen(symbol->name));
+            if (global->defined) {
+                error("'%s' is also defined in %s", symbol->name,
+                      inputs[global->index].path);
+                continue;
+            }
+            global->defined = true;
+            global->address = inputs[i].base + symbol->value;
+            global->index = i;
+        }
+    }
+}
+
+// Set the offset fields that refer to other objects
+static void relocate(symtab_t* globals, input_t* input, uint16_t* memory) {
+    object_t* object = &input->object;
+    for (int i = 0; i < object->fixup_count; i++) {
+        object_fixup_t* fixup = &object->fixups[i];
+        object_symbol_t* symbol = &object->symbols[fixup->symbol];
+        uint32_t target;
+        if (symbol->flags & SYMBOL_DEFINED) {
+            target = input->base + symbol->value;
+        } else {
+            symbol_t* global = symtab_find(globals, symbol->name,
+                                           strlen(symbol->name));
+            if (global == NULL || !global->defined) {
+                error("undefined reference to '%s' in %s", symbol->name,
+                      input->path);
+                continue;
+            }
+            target = global->address;
+        }
+
+        uint32_t address = input->base + fixup->index;
+        if (fixup->kind == FIXUP_ABS16) {
+            memory[address] = target;
+            continue;
+        }
+
+        // PC relative to the word after the instruction
+        int bits = fixup_bits(fixup->kind);
+        int offset = (int) target - (int) (address + 1);
+        if (offset < -(1 << (bits - 1)) || offset >= (1 << (bits - 1))) {
+            error("'%s' is out of range of the reference in %s",
+                  symbol->name, input->path);
+            continue;
+        }
+        uint16_t mask = (1 << bits) - 1;
+        memory[address] = (memory[address] & ~mask) | (offset & mask);
+    }
+}
+
+int main(int argc, char** argv) {
+    int ch;
+    const char* output = "a.obj";
+    uint32_t origin = DEFAULT_CODESTART;
+    while ((ch = getopt(argc, argv, "o:T:")) != -1) {
+        switch (ch) {
+        case 'o':
+            output = optarg;
+            break;
+
+        case 'T':
+            // Where the first object goes
+            if (!parse_address(optarg, &origin)) {
+                usage();
+            }
+            break;
+
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc == 0) {
+        usage();
+    }
+
+    // Lay the objects out one after the other, unless placed with @
+    input_t* inputs = (input_t*) calloc(argc, sizeof(input_t));
+    uint32_t next = origin;
+    uint32_t low = MAX_MEMORY;
+    uint32_t high = 0;
+    for (int i = 0; i < argc; i++) {
+        input_t* input = &inputs[i];
+        const char* message;
+        char* at = strrchr(argv[i], '@');
+        if (at != NULL) {
+            *at = '\0';
+            if (!parse_address(at + 1, &next)) {
+                usage();
+            }
+        }
+        input->path = argv[i];
+        if (!object_read(input->path, &input->object, &message)) {
+            error("%s: %s", input->path, message);
+            continue;
+        }
+        input->base = next;
+        next += input->object.count;
+        if (next > MAX_MEMORY) {
+            error("%s does not fit in memory", input->path);
+            continue;
+        }
+        for (int j = 0; j < i; j++) {
+            input_t* other = &inputs[j];
+            if (input->base < other->base + other->object.count
+                && other->base < next) {
+                error("%s overlaps %s", input->path, other->path);
+            }
+        }
+        low = input->base < low ? input->base : low;
+        high = next > high ? next : high;
+    }
+    if (errors > 0) {
+        return 2;
+    }
+
+    arena_t arena = {0};
+    symtab_t* globals = symtab_create(&arena);
+    // One spare word in front for the origin of the image
+    uint16_t* buffer = (uint16_t*) calloc(MAX_MEMORY + 1, sizeof(uint16_t));
+    uint16_t* memory = buffer + 1;
+    collect(globals, inputs, argc);
+    for (int i = 0; i < argc; i++) {
+        input_t* input = &inputs[i];
+        memcpy(memory + input->base, input->object.code,
+               input->object.count * sizeof(uint16_t));
+        relocate(globals, input, memory);
+    }
+
+    // The image starts at the lowest object, gaps are zero filled
+    if (errors == 0) {
+        if (low > high) {
+            low = high = origin;
+        }
+        size_t words = high - low;
+        uint16_t* image = memory + low - 1;
+        image[0] = low;
+        for (size_t i = 0; i <= words; i++) {
+            image[i] = htons(image[i]);
+        }
+        FILE* fp = fopen(output, "wb");
+        if (fp == NULL || fwrite(image, sizeof(uint16_t), words + 1, fp)
+            != words + 1) {
+            error("cannot write %s", output);
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+    }
+
+    for (int i = 0; i < argc; i++) {
+        object_free(&inputs[i].object);
+    }
+    free(inputs);
+    free(buffer);
+    arena_free(&arena);
+    return errors > 0 ? 2 : 0;
+}
@@ -2,201 +2,255 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <arpa/inet.h>
-#include <assert.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cfg.h"
 #include "instruction.h"
+#include "debugmap.h"
+#include "disasm.h"
+#include "image.h"
+
+// Output is gathered here and written in large chunks
+#define OUTPUT_SIZE (64 * 1024)
+
+// Most a word takes up to the end of its text: "0x" and 8 hex digits and
+// ": ", 4 nibbles each with a space, ": ", then the text and its NUL
+#define WORD_LINE_MAX (12 + 20 + 2 + DISASM_MAX)
+
+typedef struct {
+    char buffer[OUTPUT_SIZE];
+    size_t used;
+} output_t;
+
+// The bits of each nibble, as print_instruction shows them
+static const char nibbles[16][4] = {
+    "0000", "0001", "0010", "0011", "0100", "0101", "0110", "0111",
+    "1000", "1001", "1010", "1011", "1100", "1101", "1110", "1111",
+};
 
 void usage() {
-    fprintf(stderr, "Usage: ./xod file\n");
+    fprintf(stderr, "Usage: ./xod [-g] [-a | -c] file\n");
     exit(1);
 }
 
-char* decode(uint16_t instruction) {
-    // The string is returned in this static buffer
-    char* buf;
-    char br[1024];
-    br[0] = '\0';
-
-    reg_t dst, src1, src2, base;
-    uint16_t cond, vec;
-    int16_t offset;
-    int16_t value;
-
-    opcode_t opcode = getopcode(instruction);
-    switch (opcode) {
-    case OP_ADD:
-        dst = (reg_t) getbits(instruction, 9, 3);
-        src1 = (reg_t) getbits(instruction, 6, 3);
-        if (getimmediate(instruction) == 1) {
-            value = sign_extend(getbits(instruction, 0, 5), 5);
-            asprintf(&buf, "add    %%r%d, %%r%d, $%d",
-                (int) dst, (int) src1, (int) value);
-        } else {
-            src2 = (reg_t) getbits(instruction, 0, 3);
-            asprintf(&buf, "add    %%r%d, %%r%d, %%r%d",
-                (int) dst, (int) src1, (int) src2);
-        }
-        break;
-
-    case OP_AND:
-        dst = (reg_t) getbits(instruction, 9, 3);
-        src1 = (reg_t) getbits(instruction, 6, 3);
-        if (getimmediate(instruction) == 1) {
-            value = (uint16_t) sign_extend(getbits(instruction, 0, 5), 5);
-            asprintf(&buf, "and    %%r%d, %%r%d, $%d",
-                (int) dst, (int) src1, (int) value);
-        } else {
-            src2 = (reg_t) getbits(instruction, 0, 3);
-            asprintf(&buf, "and    %%r%d, %%r%d, %%r%d",
-                (int) dst, (int) src1, (int) src2);
-        }
-        break;
-
-    case OP_NOT:
-        dst = (reg_t) getbits(instruction, 9, 3);
-        src1 = (reg_t) getbits(instruction, 6, 3);
-        asprintf(&buf, "not    %%r%d, %%r%d",
-            (int) dst, (int) src1);
-        break;
-
-    case OP_BR:
-        offset = sign_extend(getbits(instruction, 0, 9), 9);
-        cond = (uint16_t) getbits(instruction, 9, 3);
-        snprintf(br, sizeof(br), "br");
-        if (cond & FL_NEG) {
-            strcat(br, "n");
-        }
-        if (cond & FL_ZRO) {
-            strcat(br, "z");
-        }
-        if (cond & FL_POS) {
-            strcat(br, "p");
-        }
-        asprintf(&buf, "%-6s $%d", br, offset);
-        break;
-
-    case OP_JMP:
-        base = getbits(instruction, 6, 3);
-        asprintf(&buf, "jmp    %%r%d", base);
-        break;
-
-    case OP_JSR:
-        if (getbit(instruction, 11) == 1) {
-            offset = sign_extend(getbits(instruction, 0, 11), 11);
-            asprintf(&buf, "jsr    $%d", offset);
-        } else {
-            base = getbits(instruction, 6, 3);
-            asprintf(&buf, "jsrr   %%r%d", base);
+static void flush(output_t* out) {
+    fwrite(out->buffer, 1, out->used, stdout);
+    out->used = 0;
+}
+
+// Make room for size bytes in the buffer
+static char* reserve(output_t* out, size_t size) {
+    if (out->used + size > OUTPUT_SIZE) {
+        flush(out);
+    }
+    return out->buffer + out->used;
+}
+
+// Append text of any length
+static void put(output_t* out, const char* text, size_t length) {
+    if (length > OUTPUT_SIZE) {
+        flush(out);
+        fwrite(text, 1, length, stdout);
+        return;
+    }
+    memcpy(reserve(out, length), text, length);
+    out->used += length;
+}
+
+// Append a number in lowercase hex, without leading zeros
+static char* put_hex(char* p, uint32_t value) {
+    static const char hex[] = "0123456789abcdef";
+    int shift = 28;
+    while (shift > 0 && (value >> shift) == 0) {
+        shift -= 4;
+    }
+    for (; shift >= 0; shift -= 4) {
+        *p++ = hex[(value >> shift) & 0xf];
+    }
+    return p;
+}
+
+// Append a line of the source, as "  # file:line"
+static void put_source(output_t* out, const char* file, uint32_t line) {
+    char number[16];
+    int length = snprintf(number, sizeof(number), ":%u", line);
+    put(out, "  # ", 4);
+    put(out, file, strlen(file));
+    put(out, number, length);
+}
+
+// Recover the control flow of the image and write it as a listing or a
+// graph instead of a word per line
+static void analyze(const image_t* image, const debugmap_t* map,
+                    bool graph) {
+    cfg_t cfg;
+    cfg_build(&cfg, image, map);
+    if (graph) {
+        cfg_write_dot(&cfg, stdout);
+    } else {
+        cfg_write_listing(&cfg, stdout);
+    }
+    cfg_free(&cfg);
+}
+
+// Write a line for each word of a segment, after its origin
+static void dump_segment(output_t* out, const image_segment_t* segment,
+                         const debugmap_t* map) {
+    char* p = reserve(out, 32);
+    p += sprintf(p, "Origin: 0x%x\n", segment->origin);
+    out->used = p - out->buffer;
+
+    uint32_t location = segment->origin;
+    uint32_t next = 0;
+    const char* file;
+    const char* last_file = NULL;
+    uint32_t line;
+    uint32_t last_line = 0;
+    for (uint32_t i = 0; i < segment->count; i++, location++) {
+        uint16_t instruction = segment->words[i];
+        // Walk the labels along with the addresses, which both go up
+        while (map && next < map->symbol_count
+               && map->symbols[next].address <= location) {
+            if (map->symbols[next].address == location) {
+                const char* name = map->symbols[next].name;
+                put(out, name, strlen(name));
+                put(out, ":\n", 2);
+            }
+            next++;
         }
-        break;
-
-    case OP_LD:
-        dst = (reg_t) getbits(instruction, 9, 3);
-        offset = sign_extend(getbits(instruction, 0, 9), 9);
-        asprintf(&buf, "ld     %%r%d, $%d", dst, offset);
-        break;
-
-    case OP_LDI:
-        dst = (reg_t) getbits(instruction, 9, 3);
-        offset = sign_extend(getbits(instruction, 0, 9), 9);
-        asprintf(&buf, "ldi    %%r%d, $%d", dst, offset);
-        break;
-
-    case OP_LDR:
-        dst = (reg_t) getbits(instruction, 9, 3);
-        base = getbits(instruction, 6, 3);
-        offset = sign_extend(getbits(instruction, 0, 6), 6);
-        asprintf(&buf, "ldr    %%r%d, %%r%d, $%d", dst, base,
-            offset);
-        break;
-
-    case OP_LEA:
-        dst = (reg_t) getbits(instruction, 9, 3);
-        offset = sign_extend(getbits(instruction, 0, 9), 9);
-        asprintf(&buf, "lea    %%r%d, $%d", dst, offset);
-        break;
-
-    case OP_ST:
-        src1 = (reg_t) getbits(instruction, 9, 3);
-        offset = sign_extend(getbits(instruction, 0, 9), 9);
-        asprintf(&buf, "st     %%r%d, $%d", src1, offset);
-        break;
-
-    case OP_STI:
-        src1 = (reg_t) getbits(instruction, 9, 3);
-        offset = sign_extend(getbits(instruction, 0, 9), 9);
-        asprintf(&buf, "sti    %%r%d, $%d", src1, offset);
-        break;
-
-    case OP_STR:
-        src1 = (reg_t) getbits(instruction, 9, 3);
-        base = (reg_t) getbits(instruction, 6, 3);
-        offset = sign_extend(getbits(instruction, 0, 6), 6);
-        asprintf(&buf, "str    %%r%d, %%r%d, $%d",
-            src1, base, offset);
-        break;
-
-    case OP_TRAP:
-        vec = getbits(instruction, 0, 8);
-        if (vec == TRAP_GETC) {
-            asprintf(&buf, "getc");
-        } else if (vec == TRAP_OUT) {
-            asprintf(&buf, "putc");
-        } else if (vec == TRAP_PUTS) {
-            asprintf(&buf, "puts");
-        } else if (vec == TRAP_IN) {
-            asprintf(&buf, "enter");
-        } else if (vec == TRAP_PUTSP) {
-            asprintf(&buf, "putsp");
-        } else if (vec == TRAP_HALT) {
-            asprintf(&buf, "halt");
-        } else {
-            asprintf(&buf, "-");
+
+        char* start = reserve(out, WORD_LINE_MAX);
+        p = start;
+        *p++ = '0';
+        *p++ = 'x';
+        p = put_hex(p, location);
+        *p++ = ':';
+        *p++ = ' ';
+        for (int shift = 12; shift >= 0; shift -= 4) {
+            memcpy(p, nibbles[(instruction >> shift) & 0xf], 4);
+            p += 4;
+            *p++ = ' ';
         }
-        break;
+        *p++ = ':';
+        *p++ = ' ';
+        p += disassemble(instruction, p);
+        out->used += p - start;
 
-    // case OP_RES:
-    // case OP_RTI:
-    default:
-        // Consider everything else a value
-        asprintf(&buf, "val    0x%x", (unsigned int) instruction);
-        break;
+        if (map && debugmap_line(map, location, &file, &line)
+            && (line != last_line || file != last_file)) {
+            put_source(out, file, line);
+            last_file = file;
+            last_line = line;
+        }
+        put(out, "\n", 1);
     }
+}
 
-    return buf;
+// Write the words of each segment, with the entry and exported labels of
+// a container
+static void dump(const image_t* image, const debugmap_t* map) {
+    static output_t out;
+    char text[32];
+    if (image->has_entry) {
+        put(&out, text, sprintf(text, "Entry: 0x%x\n", image->entry));
+    }
+    for (int i = 0; i < image->segment_count; i++) {
+        dump_segment(&out, &image->segments[i], map);
+    }
+    for (int i = 0; i < image->symbol_count; i++) {
+        const image_symbol_t* symbol = &image->symbols[i];
+        put(&out, text, sprintf(text, "Symbol: 0x%x ", symbol->address));
+        put(&out, symbol->name, strlen(symbol->name));
+        put(&out, "\n", 1);
+    }
+    flush(&out);
 }
 
 int main(int argc, char** argv) {
-    if (argc > 2) {
+    int ch;
+    bool symbols = false;
+    bool listing = false;
+    bool graph = false;
+    while ((ch = getopt(argc, argv, "gac")) != -1) {
+        switch (ch) {
+        case 'g':
+            // Show labels and source lines from the debug map of the image
+            symbols = true;
+            break;
+
+        case 'a':
+            // Write a listing xas can assemble, from control flow analysis
+            listing = true;
+            break;
+
+        case 'c':
+            // Write the control flow graph for Graphviz
+            graph = true;
+            break;
+
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc > 1 || (listing && graph)) {
         usage();
     }
 
     char* filename = "a.obj";
-    if (argc == 2) {
-        filename = argv[1];
+    if (argc == 1) {
+        filename = argv[0];
+    }
+
+    debugmap_t map;
+    if (symbols) {
+        const char* error;
+        char* map_path = debugmap_path(filename);
+        if (!debugmap_read(map_path, &map, &error)) {
+            fprintf(stderr, "Can't read %s: %s\n", map_path, error);
+            exit(2);
+        }
+        free(map_path);
     }
 
-    FILE* fp = fopen(filename, "rb");
-    uint16_t origin;
-    if (fread(&origin, sizeof(origin), 1, fp) != 1) {
+    // Map the whole image rather than reading it a word at a time
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s\n", filename);
+        exit(2);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(uint16_t)) {
         fprintf(stderr, "Can't read origin\n");
         exit(2);
     }
-    origin = ntohs(origin);
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Can't map %s\n", filename);
+        exit(2);
+    }
+    image_t image;
+    const char* error;
+    bool ok = image_parse(data, st.st_size, &image, &error);
+    munmap(data, st.st_size);
+    if (!ok) {
+        fprintf(stderr, "Can't read %s: %s\n", filename, error);
+        exit(2);
+    }
 
-    printf("Origin: 0x%x\n", origin);
-    int location = origin;
-    uint16_t instruction;
-    while (fread(&instruction, sizeof(instruction), 1, fp) == 1) {
-        instruction = ntohs(instruction);
-        printf("0x%x: ", location);
-        print_instruction(instruction);
-        char* str = decode(instruction);
-        printf(" : %s\n", str);
-        free(str);
-        location++;
+    if (listing || graph) {
+        analyze(&image, symbols ? &map : NULL, graph);
+    } else {
+        dump(&image, symbols ? &map : NULL);
     }
 
-    fclose(fp);
+    image_free(&image);
+    if (symbols) {
+        debugmap_free(&map);
+    }
 }